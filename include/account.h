@@ -3,7 +3,7 @@
 
 #include "messaging.h"
 
-extern const funcMapping acc_func[];
+int account_register(void);
 
 ssize_t account_create(request_t *request);
 
@@ -0,0 +1,46 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 8
+#define ARENA_MIN 256
+
+/* Memory that did not fit in the arena's block, freed on the next reset. */
+typedef struct arena_spill_t
+{
+    struct arena_spill_t *next;
+    uint8_t               data[];
+} arena_spill_t;
+
+/*
+ * Scratch memory for one request: allocations bump a pointer and are all released together
+ * by arena_reset. The block keeps the size of the largest request seen, so it stops allocating.
+ */
+typedef struct arena_t
+{
+    uint8_t       *base;
+    size_t         cap;
+    size_t         used;
+    size_t         spilled;    // bytes that overflowed into spills since the last reset
+    arena_spill_t *spills;
+} arena_t;
+
+void arena_init(arena_t *arena);
+
+void arena_destroy(arena_t *arena);
+
+int arena_reserve(arena_t *arena, size_t size, int *err);
+
+void *arena_alloc(arena_t *arena, size_t size);
+
+void *arena_memdup(arena_t *arena, const void *data, size_t size);
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+void arena_reset(arena_t *arena);
+
+#endif    // ARENA_H
@@ -12,6 +12,14 @@ typedef struct args_t
     in_port_t   port;
     const char *sm_addr;
     in_port_t   sm_port;
+    const char *history_dir;
+    size_t      max_clients;
+    size_t      threads;
+    size_t      workers;
+    size_t      out_high;
+    size_t      out_low;
+    int         io_uring;
+    int         backlog;
 } args_t;
 
 _Noreturn void usage(const char *binary_name, int exit_code, const char *message);
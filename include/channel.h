@@ -0,0 +1,49 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHANNEL_NAME_MAX 32    // bytes in a channel name
+#define CHANNEL_MAX 1024       // channels open at once, across every reactor
+#define CHANNEL_BUCKETS 1024
+#define CHANNEL_PER_CONN 8     // channels one connection can be in
+#define CHANNEL_ALL 0          // not a channel: every client
+
+struct conn_t;
+struct conn_table_t;
+
+/* A channel a connection is in, and where the connection sits in that channel's member list. */
+typedef struct conn_channel_t
+{
+    uint32_t id;
+    uint32_t pos;
+} conn_channel_t;
+
+/*
+ * The members of a channel on one reactor, as a dense array so that a send only walks them.
+ * Each reactor keeps its own; a send reaches the others as mail naming the channel.
+ */
+typedef struct channel_members_t
+{
+    uint32_t        id;    // channel the entry belongs to; stale once the slot is reused
+    uint32_t        count;
+    uint32_t        cap;
+    struct conn_t **conns;
+} channel_members_t;
+
+int channel_join(struct conn_table_t *table, struct conn_t *conn, const char *name, uint8_t len);
+
+int channel_leave(struct conn_table_t *table, struct conn_t *conn, const char *name, uint8_t len);
+
+void channel_leave_all(struct conn_table_t *table, struct conn_t *conn);
+
+uint32_t channel_lookup(const struct conn_t *conn, const char *name, uint8_t len);
+
+const channel_members_t *channel_members(const struct conn_table_t *table, uint32_t id);
+
+void channel_table_destroy(struct conn_table_t *table);
+
+#endif    // CHANNEL_H
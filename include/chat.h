@@ -3,8 +3,18 @@
 
 #include "messaging.h"
 
-extern const funcMapping chat_func[];
+int chat_register(void);
 
 ssize_t chat_broadcast(request_t *request);
 
+ssize_t chat_join(request_t *request);
+
+ssize_t chat_leave(request_t *request);
+
+ssize_t chat_channel_send(request_t *request);
+
+ssize_t chat_direct(request_t *request);
+
+ssize_t chat_history(request_t *request);
+
 #endif    // CHAT_H
@@ -0,0 +1,49 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "response.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CODEC_TL_SIZE 2    // tag byte plus one length byte
+#define CODEC_UTF8 0x01    // value must be well-formed UTF-8
+
+/* One TLV of a message body: the tag it must carry, the bounds its length must respect and CODEC_* checks on its value. */
+typedef struct codec_field_t
+{
+    const char *name;
+    uint8_t     tag;
+    uint8_t     min_len;
+    uint8_t     max_len;
+    uint8_t     flags;
+} codec_field_t;
+
+/* A message body, as the exact sequence of TLVs it is made of. */
+typedef struct codec_schema_t
+{
+    const char          *name;
+    const codec_field_t *fields;
+    size_t               nfields;
+} codec_schema_t;
+
+/* A decoded value, borrowed from the buffer it was decoded from. */
+typedef struct codec_view_t
+{
+    const uint8_t *ptr;
+    uint8_t        len;
+} codec_view_t;
+
+int codec_decode(const codec_schema_t *schema, const uint8_t *body, size_t len, codec_view_t *views);
+
+void codec_bounds(const codec_schema_t *schema, size_t *min_len, size_t *max_len);
+
+size_t codec_size(const codec_schema_t *schema, const codec_view_t *values);
+
+ssize_t codec_encode_buf(const codec_schema_t *schema, const codec_view_t *values, uint8_t *buf, size_t cap);
+
+int codec_encode(const codec_schema_t *schema, const codec_view_t *values, response_t *res);
+
+#endif    // CODEC_H
@@ -0,0 +1,166 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "channel.h"
+#include "fsm.h"
+#include "timer.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define DEFAULT_MAX_CLIENTS 1024
+#define CONN_TABLE_INITIAL 64
+#define CONN_IDLE_TIMEOUT 300    // 5min
+#define CONN_READ_TIMEOUT 10     // seconds a client gets to finish a frame it has started
+#define CONN_BUF_SIZE 4096       // receive buffers and send chunks of this size are pooled
+#define CONN_SPARE_MAX 256
+#define CONN_FLUSH_IOV 64    // queued chunks gathered into one sendmsg
+#define CONN_SLAB_SIZE 64
+#define CONN_CACHE_LINE 64
+#define CONN_OUT_HIGH_WATERMARK (64 * 1024)    // stop reading from a client with this much unsent
+#define CONN_OUT_LOW_WATERMARK (16 * 1024)     // and resume once it has drained to this
+#define CONN_OUT_DROP_FACTOR 16                // drop a client that lets this many high watermarks pile up
+
+struct fanout_frame_t;
+struct request_t;
+
+/* Bytes queued for a connection, written out in order: copied into data, or a shared frame. */
+typedef struct out_chunk_t
+{
+    struct out_chunk_t    *next;
+    int                    fd;           // connection the bytes belong to
+    uint64_t               conn_id;      // guards against the fd being reused before a send completes
+    int                    in_flight;    // owned by a submitted io_uring send until it completes
+    struct fanout_frame_t *frame;        // referenced instead of copied; such chunks have no data
+    size_t                 cap;
+    size_t                 len;
+    size_t                 off;          // bytes already written
+    uint8_t                data[];
+} out_chunk_t;
+
+/*
+ * Per-connection session state, kept for as long as the socket stays open. Everything a
+ * readiness event touches sits in the first cache line; the request and receive buffer are
+ * only attached while the connection has a frame in progress, so an idle client costs
+ * sizeof(conn_t) plus its kernel socket.
+ */
+typedef struct conn_t
+{
+    // hot: one cache line
+    _Alignas(CONN_CACHE_LINE) int fd;
+    int               session_id;
+    fsm_state_t       from_id;         // FSM position to resume from when more data arrives
+    fsm_state_t       to_id;
+    uint8_t          *rbuf;            // receive buffer, back in the pool whenever it is empty
+    size_t            rlen;            // bytes received
+    size_t            rpos;            // start of the frame being parsed
+    struct request_t *request;         // lent by the reactor while a frame is in progress
+    uint8_t           pending;         // a worker is handling the current frame
+    uint8_t           ring_fed;        // bytes arrive through io_uring completions instead of recv()
+    uint8_t           recv_armed;      // an io_uring receive is outstanding
+    uint8_t           closing;         // closes once the outbound queue has drained
+    uint8_t           read_paused;     // outbound queue went over the high watermark
+    uint8_t           flush_queued;    // has broadcast frames waiting for the end of the loop pass
+    uint8_t           read_closed;     // the peer shut down its side; close once what it sent is answered
+    out_chunk_t      *out_head;        // outbound queue
+
+    // cold
+    uint64_t        id;           // unique per table, unlike fds which get reused
+    size_t          rcap;         // receive buffer capacity
+    out_chunk_t    *out_tail;
+    size_t          out_bytes;    // queued bytes not yet written
+    size_t          index;        // position in conn_table_t.active
+    wheel_timer_t   idle;         // evicts the client after CONN_IDLE_TIMEOUT without a request
+    wheel_timer_t   deadline;     // armed while a frame is only partly received
+    uint8_t        *batch;        // replies to a v3 envelope being collected, pooled like rbuf
+    conn_channel_t *channels;     // channels joined, in no particular order; pooled, held only while there are any
+    uint8_t         nchannels;
+    uint32_t        peer;         // address slot for the rate limits of clients not logged in
+} conn_t;
+
+/* Connections are carved out of cache-line aligned slabs that live as long as the table. */
+typedef struct conn_slab_t
+{
+    struct conn_slab_t *next;
+    conn_t              conns[CONN_SLAB_SIZE];
+} conn_slab_t;
+
+/* Where a table's memory is going, for the stats dump. */
+typedef struct conn_stats_t
+{
+    size_t open;            // connections
+    size_t slab_slots;      // connection structs allocated, in use or free
+    size_t slab_bytes;
+    size_t busy;            // connections with a frame in progress
+    size_t rbufs;           // receive buffers attached to connections
+    size_t rbuf_bytes;
+    size_t queued_bytes;    // outbound bytes waiting on slow clients
+    size_t spare_bufs;      // pooled receive buffers
+    size_t spare_chunks;    // pooled send chunks
+    size_t spare_refs;      // pooled chunks for shared frames
+    size_t spare_bytes;
+} conn_stats_t;
+
+typedef struct conn_table_t
+{
+    conn_t           **slots;           // indexed by fd
+    size_t             slots_cap;       // number of fd slots
+    conn_t           **active;          // dense list of open connections
+    size_t             active_cap;      // number of active entries allocated
+    size_t             count;           // number of open connections
+    size_t             max_clients;     // runtime connection limit
+    uint64_t           next_id;         // id handed to the next connection
+    conn_slab_t       *slabs;
+    size_t             nslabs;
+    conn_t            *spare_conns;     // free slab entries, linked through their first bytes
+    void              *spare_bufs;      // pooled receive buffers, linked through their first bytes
+    size_t             nspare_bufs;
+    out_chunk_t       *spare_chunks;    // pooled send chunks
+    size_t             nspare_chunks;
+    out_chunk_t       *spare_refs;      // pooled chunks for shared frames, header only
+    size_t             nspare_refs;
+    channel_members_t *channels;        // indexed by channel slot, allocated by the first join
+    void              *spare_joins;     // pooled conn_t.channels arrays, linked through their first bytes
+    size_t             nspare_joins;
+} conn_table_t;
+
+int conn_table_init(conn_table_t *table, size_t max_clients, int *err);
+
+void conn_table_destroy(conn_table_t *table);
+
+conn_t *conn_add(conn_table_t *table, int fd, int *err);
+
+conn_t *conn_get(const conn_table_t *table, int fd);
+
+void conn_close(conn_table_t *table, conn_t *conn);
+
+int conn_fill(conn_table_t *table, conn_t *conn, size_t need, int *err);
+
+int conn_append(conn_table_t *table, conn_t *conn, const void *data, size_t len, int *err);
+
+out_chunk_t *conn_queue(conn_table_t *table, conn_t *conn, const struct iovec *iov, int iovcnt, size_t skip);
+
+out_chunk_t *conn_queue_frame(conn_table_t *table, conn_t *conn, struct fanout_frame_t *frame);
+
+const uint8_t *conn_chunk_bytes(const out_chunk_t *chunk);
+
+void conn_sent(conn_table_t *table, conn_t *conn, size_t size);
+
+void conn_free_chunk(conn_table_t *table, out_chunk_t *chunk);
+
+int conn_writev(conn_table_t *table, conn_t *conn, const struct iovec *iov, int iovcnt, int *err);
+
+int conn_flush(conn_table_t *table, conn_t *conn, int *err);
+
+void conn_consume(conn_table_t *table, conn_t *conn, size_t size);
+
+uint8_t *conn_batch_buf(conn_table_t *table, conn_t *conn);
+
+void conn_batch_done(conn_table_t *table, conn_t *conn);
+
+void conn_table_stats(const conn_table_t *table, conn_stats_t *stats);
+
+#endif    // CONNECTION_H
@@ -3,6 +3,7 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "arena.h"
 #include <ndbm.h>
 #include <sys/types.h>
 
@@ -46,6 +47,8 @@ int retrieve_int(DBM *db, const char *key, int *result);
 
 void *retrieve_byte(DBM *db, const void *key, size_t size);
 
+void *retrieve_byte_arena(DBM *db, const void *key, size_t size, arena_t *arena, size_t *len);
+
 ssize_t init_pk(DBO *dbo, const char *pk_name, int *pk);
 
 #endif    // DATABASE_H
@@ -0,0 +1,26 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "messaging.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISPATCH_TYPES 256    // one slot per value of the type byte
+
+/* What a frame type is served by, and what its frames must look like before that runs. */
+typedef struct dispatch_t
+{
+    ssize_t (*func)(request_t *request);    // NULL: no such type
+    size_t min_len;
+    size_t max_len;
+    int    blocking;
+    int    auth;
+} dispatch_t;
+
+int dispatch_register(const funcMapping functions[]);
+
+const dispatch_t *dispatch_lookup(uint8_t type);
+
+#endif    // DISPATCH_H
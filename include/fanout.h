@@ -0,0 +1,34 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FANOUT_SIZE 512    // frames up to this size are pooled
+#define FANOUT_SPARE_MAX 256
+
+/*
+ * A frame written to many connections from one copy. Every send queue it sits on holds a
+ * reference, possibly from another reactor's thread; the last one to let go frees it.
+ */
+typedef struct fanout_frame_t
+{
+    struct fanout_frame_t *next;    // pool link while unused
+    atomic_size_t          refs;
+    size_t                 cap;
+    size_t                 len;
+    uint8_t                data[];
+} fanout_frame_t;
+
+fanout_frame_t *fanout_create(const void *data, size_t len);
+
+void fanout_hold(fanout_frame_t *frame);
+
+void fanout_release(fanout_frame_t *frame);
+
+void fanout_destroy(void);
+
+#endif    // FANOUT_H
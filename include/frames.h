@@ -0,0 +1,24 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_VALUES 256    // one frame per value of the code or type byte
+
+/* A complete response frame, header included, written to clients as it is. */
+typedef struct frame_t
+{
+    const uint8_t *data;
+    size_t         len;
+} frame_t;
+
+int frames_init(void);
+
+const frame_t *frame_error(uint8_t code);
+
+const frame_t *frame_ack(uint8_t type);
+
+#endif    // FRAMES_H
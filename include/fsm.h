@@ -3,6 +3,8 @@
 #ifndef FSM_H
 #define FSM_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
 typedef enum
@@ -14,20 +16,44 @@ typedef enum
     PROCESS_HANDLER,
     RESPONSE_HANDLER,
     ERROR_HANDLER,
+    BATCH_HANDLER,    // next sub-message of a v3 envelope
+    YIELD,    // out of input, resume on the next readiness event
     END
 } fsm_state;
 
+#define FSM_STATES (END + 1)
+#define FSM_HIST_SUB_BITS 2    // 4 buckets per power of two: within 25%
+#define FSM_HIST_BUCKETS ((64 - FSM_HIST_SUB_BITS + 1) << FSM_HIST_SUB_BITS)
+
 typedef int fsm_state_t;
 
 typedef fsm_state_t (*fsm_state_func)(void *args);
 
-struct fsm_transition
+/* Dense transition table: [from][to] holds what runs on entering `to`, NULL where there is no such edge. */
+typedef fsm_state_func fsm_table_t[FSM_STATES][FSM_STATES];
+
+/* Time spent in one state, in log-linear nanosecond buckets. */
+typedef struct fsm_hist_t
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[FSM_HIST_BUCKETS];
+} fsm_hist_t;
+
+typedef struct fsm_stats_t
 {
-    fsm_state_t    from_id;
-    fsm_state_t    to_id;
-    fsm_state_func perform;
-};
+    fsm_hist_t states[FSM_STATES];
+} fsm_stats_t;
+
+fsm_state_func fsm_transition(fsm_state_t from_id, fsm_state_t to_id, const fsm_table_t table);
+
+uint64_t fsm_now_ns(void);
+
+void fsm_record(fsm_stats_t *stats, fsm_state_t state, uint64_t ns);
+
+uint64_t fsm_percentile(const fsm_hist_t *hist, double pct);
 
-fsm_state_func fsm_transition(fsm_state_t from_id, fsm_state_t to_id, const struct fsm_transition transitions[], size_t transitions_size);
+void fsm_print_stats(const fsm_stats_t *stats, size_t owner);
 
 #endif    // FSM_H
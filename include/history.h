@@ -0,0 +1,38 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_DIR "history"                     // where the log segments live by default
+#define HISTORY_RING 128                          // messages kept in memory per channel
+#define HISTORY_CHANNELS 256                      // channels with a ring, the room included
+#define HISTORY_BATCH 32                          // messages in one HIS_Response at most
+#define HISTORY_PAGE_BYTES 32768                  // and bytes of them
+#define HISTORY_SEGMENT_SIZE ((size_t)4 << 20)    // a log segment is closed once it would grow past this
+#define HISTORY_SEGMENTS 8                        // segments kept on disk, the one being written included
+#define HISTORY_QUEUE 4096                        // messages waiting for the log writer at most
+
+struct fanout_frame_t;
+
+/* What one HIS_Get got: `last` is the sequence to ask from next time. */
+typedef struct history_page_t
+{
+    size_t   count;
+    size_t   used;      // bytes of frames copied out
+    uint32_t last;      // sequence of the last message copied, or the one asked from when none was
+    uint32_t oldest;    // sequence of the oldest message still kept for the channel, 0 when none is
+    int      more;
+} history_page_t;
+
+int history_init(const char *dir);
+
+uint32_t history_append(const char *name, uint8_t len, struct fanout_frame_t *frame);
+
+void history_page(const char *name, uint8_t len, uint32_t since, size_t limit, uint8_t *buf, size_t cap, history_page_t *page);
+
+void history_destroy(void);
+
+#endif    // HISTORY_H
@@ -1,9 +1,20 @@
 #ifndef IO_H
 #define IO_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 4096
+#define IO_TIMEOUT (-2)     // the deadline passed before the transfer finished
+#define IO_NO_DEADLINE 0    // wait for as long as it takes
+
+uint64_t io_deadline(int timeout_ms);
+
+int io_wait(int fd, short events, uint64_t deadline, int *err);
+
+ssize_t read_deadline(int fd, void *buf, size_t size, uint64_t deadline, int *err);
+
+ssize_t write_deadline(int fd, const void *buf, size_t size, uint64_t deadline, int *err);
 
 ssize_t read_fully(int fd, char *buf, size_t size, int *err);
 
@@ -0,0 +1,12 @@
+#ifndef LIST_H
+#define LIST_H
+
+#include "messaging.h"
+
+#define LIST_PAGE_MAX 32    // users per LST_Response
+
+int list_register(void);
+
+ssize_t list_get(request_t *request);
+
+#endif    // LIST_H
@@ -0,0 +1,30 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+
+/* Heap traffic on the request path, so "no allocations per message" can be checked rather than assumed. */
+typedef struct mem_stats_t
+{
+    size_t allocs;      // malloc and realloc calls
+    size_t frees;
+    size_t messages;    // frames served
+} mem_stats_t;
+
+void *mem_alloc(size_t size);
+
+void *mem_alloc_aligned(size_t align, size_t size);
+
+void *mem_realloc(void *ptr, size_t size);
+
+void mem_free(void *ptr);
+
+void mem_count_message(void);
+
+void mem_get_stats(mem_stats_t *stats);
+
+void mem_print_stats(void);
+
+#endif    // MEM_H
@@ -3,18 +3,22 @@
 #ifndef MESSAGING_H
 #define MESSAGING_H
 
+#include "connection.h"
 #include "fsm.h"
-#include <poll.h>
+#include "reactor.h"
+#include "response.h"
+#include "route.h"
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
-#define HEADER_SIZE 6
-#define RESPONSE_SIZE 256
 #define SERVER_ID 0x0000
-#define MAX_CLIENTS 2
-#define MAX_FDS (MAX_CLIENTS + 1)
 
+/*
+ * THREE marks a batch envelope: its type byte is the number of sub-messages, and its payload is
+ * that many complete v2 frames back to back. Their replies come back the same way, in order.
+ */
 typedef enum
 {
     ONE   = 0x01,
@@ -52,6 +56,14 @@ typedef enum
     INVALID_REQUEST = 0x1F,
     // 32
     REQUEST_TIMEOUT = 0x20,
+    // 33
+    RATE_LIMITED = 0x21,
+    // 41
+    NOT_IN_CHANNEL = 0x29,
+    // 42
+    TOO_MANY_CHANNELS = 0x2A,
+    // 51
+    MAILBOX_FULL = 0x33,
 } code_t;
 
 typedef enum
@@ -77,35 +89,56 @@ typedef enum
     // 30
     LST_Get = 0x1E,
     // 31
-    LST_Response = 0x1F
+    LST_Response = 0x1F,
+    // 40
+    CHN_Join = 0x28,
+    // 41
+    CHN_Leave = 0x29,
+    // 42
+    CHN_Send = 0x2A,
+    // 50
+    DM_Send = 0x32,
+    // 60
+    HIS_Get = 0x3C,
+    // 61
+    HIS_Response = 0x3D
 } type_t;
 
 typedef struct request_t
 {
-    void          *content;
-    size_t         len;
-    int            err;
-    int           *client_fd;
-    int           *session_id;
-    int           *user_count;
-    uint16_t       sender_id;
-    uint8_t        type;
-    code_t         code;
-    uint8_t        response[RESPONSE_SIZE];
-    uint16_t       response_len;
-    struct pollfd *fds;
+    void                    *content;
+    size_t                   len;
+    int                      err;
+    int                      disconnect;
+    conn_t                  *conn;
+    int                     *client_fd;
+    int                     *session_id;
+    atomic_int              *user_count;
+    uint16_t                 sender_id;
+    uint8_t                  type;
+    code_t                   code;
+    response_t               response;
+    arena_t                 *arena;            // scratch released when the next frame starts
+    reactor_t               *reactor;
+    const struct dispatch_t *handler;          // registry entry for type, set once the header is read
+    uint8_t                  version;
+    size_t                   frame_len;        // payload of the whole frame; len is the message being served
+    int                      batching;         // serving the sub-messages of a v3 envelope
+    uint8_t                  batch_left;       // sub-messages not yet served
+    size_t                   batch_off;        // where the next one starts, from the frame's header
+    size_t                   batch_len;        // reply bytes collected in conn->batch
+    uint8_t                  batch_replies;    // and how many replies they are
+    const char              *session_name;     // username of a session the handler starts, in content
+    uint8_t                  session_name_len;
 } request_t;
 
-typedef struct codeMapping
-{
-    code_t      code;
-    const char *msg;
-} codeMapping;
-
 typedef struct funcMapping
 {
     type_t type;
     ssize_t (*func)(request_t *request);
+    int                          blocking;    // does disk I/O, run it on the worker pool
+    int                          auth;        // only served on a logged-in connection
+    const struct codec_schema_t *schema;      // body layout, bounds the payload length; NULL for no body
 } funcMapping;
 
 typedef struct user_count_t
@@ -120,9 +153,23 @@ typedef struct user_count_t
 
 const char *code_to_string(const code_t *code);
 
+code_t io_result_code(ssize_t result);
+
 void error_response(request_t *request);
 
-void event_loop(int server_fd, int *err);
+void ack_response(request_t *request);
+
+void event_loop(reactor_t *reactor, int *err);
+
+int reactor_sendv(reactor_t *reactor, conn_t *conn, const struct iovec *iov, int iovcnt, int *err);
+
+int reactor_send(reactor_t *reactor, conn_t *conn, const void *buf, size_t len, int *err);
+
+int reactor_send_frame(reactor_t *reactor, conn_t *conn, struct fanout_frame_t *frame, int *err);
+
+void reactor_broadcast(reactor_t *reactor, uint32_t channel, struct fanout_frame_t *frame, int *err);
+
+void reactor_send_route(reactor_t *reactor, const route_t *route, struct fanout_frame_t *frame, int *err);
 
 fsm_state_t request_handler(void *args);
 
@@ -136,4 +183,6 @@ fsm_state_t response_handler(void *args);
 
 fsm_state_t error_handler(void *args);
 
+fsm_state_t batch_handler(void *args);
+
 #endif
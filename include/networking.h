@@ -6,8 +6,10 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#define O_SOCK_REUSEPORT 1
+
 ssize_t convert_port(const char *str, in_port_t *port);
-int     tcp_server(const char *address, in_port_t port, int backlog, int *err);
+int     tcp_server(const char *address, in_port_t port, int backlog, size_t opts, int *err);
 int     tcp_client(const char *address, in_port_t port, int *err);
 int     setSocketNonBlocking(int socket, int *err);
 
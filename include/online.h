@@ -0,0 +1,36 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef ONLINE_H
+#define ONLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ONLINE_NAME_MAX UINT8_MAX
+
+/* A logged-in user, as a page of the list shows them. */
+typedef struct online_user_t
+{
+    uint16_t id;    // session id
+    uint8_t  name_len;
+    char     name[ONLINE_NAME_MAX];
+} online_user_t;
+
+/* What else a client needs to know about a page it was handed. */
+typedef struct online_page_t
+{
+    uint32_t generation;    // bumped by every change, so pages from different states can be told apart
+    size_t   total;         // users online when the page was taken
+    size_t   count;         // users copied into the page
+    int      more;          // users with higher ids follow
+} online_page_t;
+
+int online_join(uint16_t id, const char *name, uint8_t len);
+
+void online_leave(uint16_t id);
+
+void online_page(uint16_t start, online_user_t *users, size_t limit, online_page_t *page);
+
+void online_destroy(void);
+
+#endif    // ONLINE_H
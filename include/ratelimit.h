@@ -0,0 +1,38 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RATE_RULES_MAX 8          // message types that can be limited
+#define RATE_USERS 65536          // one row of buckets per session id
+#define RATE_ADDR_SLOTS 4096      // rows by peer address, for clients not logged in and for those that are
+#define RATE_NAME_SLOTS 4096      // rows by the username a login is for
+#define RATE_HOST_FACTOR 8        // an address's logged in users share this many times one user's rate
+#define RATE_BURST_MAX 500000     // tokens a bucket can hold
+
+/* How often one message type may be sent: `per_sec` refills a bucket of `burst`; 0 is unlimited. */
+typedef struct rate_rule_t
+{
+    uint8_t  type;
+    uint32_t per_sec;
+    uint32_t burst;
+} rate_rule_t;
+
+int rate_set(uint8_t type, uint32_t per_sec, uint32_t burst);
+
+int rate_parse(const char *spec);
+
+int rate_init(void);
+
+uint32_t rate_peer(int fd);
+
+int rate_allow(uint8_t type, int session_id, uint32_t peer, uint64_t now_ms);
+
+int rate_allow_name(uint8_t type, const char *name, size_t len, uint64_t now_ms);
+
+void rate_destroy(void);
+
+#endif    // RATELIMIT_H
@@ -0,0 +1,93 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "arena.h"
+#include "connection.h"
+#include "database.h"
+#include "fsm.h"
+#include "timer.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAIL_SPARE_MAX 256
+
+/* A frame handed from one reactor to another, e.g. a chat broadcast. The mail holds a reference. */
+typedef struct mail_t
+{
+    struct mail_t         *next;
+    struct fanout_frame_t *frame;
+    uint32_t               channel;    // whose clients it is for, CHANNEL_ALL for all of them
+    int                    fd;         // or the one connection it is for, when not -1
+    uint64_t               conn_id;
+} mail_t;
+
+struct fanout_frame_t;
+struct job_t;
+struct uring_t;
+struct worker_pool_t;
+
+/* One event loop: its own listener, epoll set (or io_uring) and connection table. */
+typedef struct reactor_t
+{
+    size_t                id;
+    int                   server_fd;
+    int                   epfd;
+    int                   use_uring;        // run the io_uring loop instead of epoll
+    struct uring_t       *ring;             // set while the io_uring loop runs
+    int                   wakefd;           // eventfd, signalled when mail or a job arrives
+    conn_table_t          conns;
+    atomic_int           *user_count;       // shared by every reactor
+    DBO                  *meta_userDB;      // only set on the reactor that syncs meta_user
+    timer_wheel_t         timers;           // read deadlines, idle eviction and periodic work
+    wheel_timer_t         flush_timer;      // persists user_count into meta_user
+    struct worker_pool_t *pool;             // runs blocking handlers, NULL to run them inline
+    size_t                out_high;         // pause reading from a client with this many bytes unsent
+    size_t                out_low;          // resume once it is down to this many
+    arena_t               arena;            // request scratch, shared because handlers run one at a time
+    void                 *spare_reqs;       // requests not lent to any connection, linked through their first bytes
+    size_t                nspare_reqs;
+    struct reactor_t     *group;            // every reactor, including this one
+    size_t                group_size;
+    pthread_mutex_t       mail_lock;        // guards both inboxes and the spare mail below
+    mail_t               *mail_head;
+    mail_t               *mail_tail;
+    struct job_t         *done_head;        // jobs finished by the worker pool
+    struct job_t         *done_tail;
+    mail_t               *spare_mail;       // delivered mail, reused by whoever posts here next
+    size_t                nspare_mail;
+    struct job_t         *spare_jobs;       // finished jobs, only touched by this reactor's thread
+    size_t                nspare_jobs;
+    int                   flush_pending;    // some connection has flush_queued set
+    sig_atomic_t          stats_seen;       // last stats request this reactor answered
+    fsm_stats_t           fsm_stats;        // time spent in each FSM state, dumped with the other stats
+    int                   err;
+} reactor_t;
+
+int reactor_init(reactor_t *reactor, size_t id, int server_fd, size_t max_clients, int *err);
+
+void reactor_destroy(reactor_t *reactor);
+
+int reactor_post(reactor_t *reactor, uint32_t channel, struct fanout_frame_t *frame);
+
+int reactor_post_direct(reactor_t *reactor, int fd, uint64_t conn_id, struct fanout_frame_t *frame);
+
+mail_t *reactor_take_mail(reactor_t *reactor);
+
+void reactor_recycle_mail(reactor_t *reactor, mail_t *mail);
+
+void reactor_complete(reactor_t *reactor, struct job_t *job);
+
+struct job_t *reactor_take_completed(reactor_t *reactor);
+
+void reactor_wake(const reactor_t *reactor);
+
+void reactor_print_stats(const reactor_t *reactor);
+
+int reactor_group_run(reactor_t *group, size_t group_size);
+
+#endif    // REACTOR_H
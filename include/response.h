@@ -0,0 +1,61 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define HEADER_SIZE 6
+#define RESPONSE_SIZE 256    // bytes a response can own; larger bodies are referenced
+#define RESPONSE_SEGMENTS 8
+#define RESPONSE_IOV_MAX (RESPONSE_SEGMENTS + 1)    // header plus every segment
+
+/* A run of body bytes: owned ones live in response_t.data, referenced ones stay where they are. */
+typedef struct response_seg_t
+{
+    const uint8_t *ref;    // NULL for owned bytes
+    size_t         off;    // offset into data for owned bytes
+    size_t         len;
+} response_seg_t;
+
+/*
+ * A frame assembled as header + segments and sent with one writev. Owned bytes are kept by
+ * offset, so the struct can be copied by value; referenced bytes must outlive the send.
+ * A frame that already exists whole is sent from where it is instead.
+ */
+typedef struct response_t
+{
+    uint8_t        header[HEADER_SIZE];
+    uint8_t        data[RESPONSE_SIZE];
+    size_t         data_len;
+    response_seg_t segs[RESPONSE_SEGMENTS];
+    int            nsegs;
+    size_t         body_len;
+    int            started;
+    const uint8_t *frame;    // complete frame, header included; NULL when assembled here
+    size_t         frame_len;
+} response_t;
+
+void response_reset(response_t *res);
+
+void response_start(response_t *res, uint8_t type, uint8_t version, uint16_t sender_id);
+
+void response_frame(response_t *res, const uint8_t *frame, size_t len);
+
+uint8_t *response_reserve(response_t *res, size_t len);
+
+void response_unreserve(response_t *res, size_t len);
+
+int response_put(response_t *res, const void *data, size_t len);
+
+int response_put_tlv(response_t *res, uint8_t tag, const void *value, uint8_t len);
+
+int response_ref(response_t *res, const void *data, size_t len);
+
+int response_iov(response_t *res, struct iovec *iov);
+
+size_t response_size(const response_t *res);
+
+#endif    // RESPONSE_H
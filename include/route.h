@@ -0,0 +1,31 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROUTE_CONNS 4            // connections of one user that direct messages reach
+#define ROUTE_MAILBOX 32         // direct messages kept for a user who is offline
+#define ROUTE_QUEUED_MAX 4096    // and for every offline user together
+
+struct fanout_frame_t;
+
+/* Where one of a user's connections lives. */
+typedef struct route_t
+{
+    size_t   reactor;    // index into the reactor group
+    int      fd;
+    uint64_t conn_id;    // guards against the fd having been reused
+} route_t;
+
+int route_join(uint16_t id, const route_t *route, struct fanout_frame_t **queued, size_t *nqueued);
+
+void route_leave(uint16_t id, int fd, uint64_t conn_id);
+
+int route_message(uint16_t id, struct fanout_frame_t *frame, route_t *routes);
+
+void route_destroy(void);
+
+#endif    // ROUTE_H
@@ -0,0 +1,107 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include "codec.h"
+
+// field positions in the views a schema decodes into
+enum
+{
+    CRED_USER = 0,
+    CRED_PASS = 1,
+    CRED_FIELDS
+};
+
+enum
+{
+    CHAT_TIME    = 0,
+    CHAT_CONTENT = 1,
+    CHAT_USER    = 2,
+    CHAT_FIELDS
+};
+
+enum
+{
+    CHANNEL_NAME = 0,
+    CHANNEL_FIELDS
+};
+
+enum
+{
+    CHANNEL_CHAT_NAME    = 0,
+    CHANNEL_CHAT_TIME    = 1,
+    CHANNEL_CHAT_CONTENT = 2,
+    CHANNEL_CHAT_USER    = 3,
+    CHANNEL_CHAT_FIELDS
+};
+
+enum
+{
+    DIRECT_TO      = 0,
+    DIRECT_TIME    = 1,
+    DIRECT_CONTENT = 2,
+    DIRECT_USER    = 3,
+    DIRECT_FIELDS
+};
+
+enum
+{
+    ERROR_CODE = 0,
+    ERROR_MSG  = 1,
+    ERROR_FIELDS
+};
+
+enum
+{
+    LIST_START = 0,
+    LIST_LIMIT = 1,
+    LIST_GET_FIELDS
+};
+
+enum
+{
+    LIST_GENERATION = 0,
+    LIST_TOTAL      = 1,
+    LIST_NEXT       = 2,
+    LIST_MORE       = 3,
+    LIST_PAGE_FIELDS
+};
+
+enum
+{
+    LIST_USER_ID   = 0,
+    LIST_USER_NAME = 1,
+    LIST_USER_FIELDS
+};
+
+enum
+{
+    HISTORY_CHANNEL = 0,
+    HISTORY_SINCE   = 1,
+    HISTORY_LIMIT   = 2,
+    HISTORY_GET_FIELDS
+};
+
+enum
+{
+    HISTORY_LAST   = 0,
+    HISTORY_OLDEST = 1,
+    HISTORY_COUNT  = 2,
+    HISTORY_MORE   = 3,
+    HISTORY_PAGE_FIELDS
+};
+
+extern const codec_schema_t schema_credentials;     // ACC_Create, ACC_Login
+extern const codec_schema_t schema_chat;            // CHT_Send
+extern const codec_schema_t schema_ack;             // SYS_Success
+extern const codec_schema_t schema_error;           // SYS_Error
+extern const codec_schema_t schema_login;           // ACC_Login_Success
+extern const codec_schema_t schema_list_get;        // LST_Get
+extern const codec_schema_t schema_list_page;       // LST_Response, followed by a schema_list_user per user
+extern const codec_schema_t schema_list_user;
+extern const codec_schema_t schema_channel;         // CHN_Join, CHN_Leave
+extern const codec_schema_t schema_channel_chat;    // CHN_Send
+extern const codec_schema_t schema_direct;          // DM_Send
+extern const codec_schema_t schema_history_get;     // HIS_Get
+extern const codec_schema_t schema_history_page;    // HIS_Response, followed by the messages as they were sent
+
+#endif    // SCHEMA_H
@@ -3,6 +3,7 @@
 #ifndef THREADS_H
 #define THREADS_H
 
+#include <pthread.h>
 #include <stdlib.h>
 
 #define O_THREAD_JOIN 1
@@ -12,7 +13,7 @@ typedef struct
     int connfd;
 } thread_args;
 
-int   start_thread(void *(*thread_fn)(void *targs), void *targs, size_t opts);
+int   start_thread(void *(*thread_fn)(void *targs), void *targs, size_t opts, pthread_t *thread_id);
 void *thread_echo(void *targs);
 
 #endif
@@ -0,0 +1,51 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 100
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4    // 64^4 ticks of 100ms: about 19 days
+
+/* Called with the wheel's owner and the timer's own argument. */
+typedef void (*timer_fn)(void *owner, void *arg);
+
+/* A timer node, embedded in whatever it times out. */
+typedef struct wheel_timer_t
+{
+    struct wheel_timer_t *next;
+    struct wheel_timer_t *prev;
+    uint64_t              expires;    // tick it fires on
+    timer_fn              fn;
+    void                 *arg;
+    int                   active;
+} wheel_timer_t;
+
+/* A hierarchical timing wheel: O(1) schedule and cancel, timers cascade down a level as they near. */
+typedef struct timer_wheel_t
+{
+    wheel_timer_t slots[TIMER_LEVELS][TIMER_SLOTS];    // list heads
+    uint64_t      now;                                 // last tick processed
+    uint64_t      start_ms;                            // monotonic time of tick 0
+    void         *owner;
+} timer_wheel_t;
+
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ms, void *owner);
+
+void timer_init(wheel_timer_t *timer, timer_fn fn, void *arg);
+
+void timer_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t delay_ms);
+
+void timer_cancel(wheel_timer_t *timer);
+
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms);
+
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms, int max_ms);
+
+#endif    // TIMER_H
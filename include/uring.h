@@ -0,0 +1,66 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512    // provided receive buffers, must be a power of two
+#define URING_BUFFER_SIZE 2048
+#define URING_BUFFER_GROUP 0
+
+/* A raw io_uring instance plus the provided-buffer ring its receives select from. */
+typedef struct uring_t
+{
+    int                       fd;
+    unsigned                  sq_entries;
+    unsigned                 *sq_head;
+    unsigned                 *sq_tail;
+    unsigned                 *sq_mask;
+    struct io_uring_sqe      *sqes;
+    unsigned                  sq_local_tail;    // prepared but not yet handed to the kernel
+    unsigned                  sq_pending;       // published but not yet submitted
+    unsigned                 *cq_head;
+    unsigned                 *cq_tail;
+    unsigned                 *cq_mask;
+    struct io_uring_cqe      *cqes;
+    void                     *sq_ptr;
+    size_t                    sq_size;
+    void                     *cq_ptr;
+    size_t                    cq_size;
+    size_t                    sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    size_t                    buf_ring_size;
+    uint8_t                  *bufs;
+    unsigned                  nbufs;
+    size_t                    buf_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries, unsigned nbufs, size_t buf_size, int *err);
+
+void uring_destroy(uring_t *ring);
+
+int uring_submit_and_wait(uring_t *ring, int timeout_ms, int *err);
+
+struct io_uring_cqe *uring_peek(const uring_t *ring);
+
+void uring_advance(uring_t *ring);
+
+uint8_t *uring_buffer(const uring_t *ring, unsigned bid);
+
+void uring_recycle(uring_t *ring, unsigned bid);
+
+int uring_prep_accept_multishot(uring_t *ring, int fd, int flags, uint64_t user_data);
+
+int uring_prep_recv_multishot(uring_t *ring, int fd, uint64_t user_data);
+
+int uring_prep_poll_multishot(uring_t *ring, int fd, uint64_t user_data);
+
+int uring_prep_send(uring_t *ring, int fd, const void *buf, size_t len, uint64_t user_data);
+
+int uring_prep_cancel(uring_t *ring, uint64_t target, uint64_t user_data);
+
+#endif    // URING_H
@@ -0,0 +1,21 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void utf8_init(void);
+
+const char *utf8_impl_name(void);
+
+int utf8_valid(const uint8_t *str, size_t len);
+
+int utf8_valid_scalar(const uint8_t *str, size_t len);
+
+#if defined(__x86_64__) || defined(__i386__)
+int utf8_valid_ssse3(const uint8_t *str, size_t len);
+
+int utf8_valid_avx2(const uint8_t *str, size_t len);
+#endif
+
+#endif    // UTF8_H
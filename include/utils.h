@@ -4,6 +4,7 @@
 #include <signal.h>
 
 extern volatile sig_atomic_t running;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+extern volatile sig_atomic_t stats_requested;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 void nfree(void **ptr);
 
@@ -0,0 +1,58 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "arena.h"
+#include "messaging.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_WORKERS 4
+#define WORKER_QUEUE_CAPACITY 1024
+#define JOB_CONTENT_MIN 512    // smallest frame copy a job is allocated for, so pooled jobs fit most requests
+#define JOB_SPARE_MAX 64       // finished jobs a reactor keeps for reuse
+
+/* A blocking request handed to the pool; owns a private copy of the frame and its own scratch arena. */
+typedef struct job_t
+{
+    struct job_t *next;
+    reactor_t    *reactor;    // reactor that gets the completion
+    int           fd;         // connection the job belongs to
+    uint64_t      conn_id;    // guards against the fd being reused meanwhile
+    int           session_id;
+    ssize_t (*func)(request_t *request);
+    ssize_t   result;
+    request_t request;
+    arena_t   arena;
+    size_t    cap;    // bytes of content allocated
+    uint8_t   content[];
+} job_t;
+
+typedef struct worker_pool_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    job_t          *head;
+    job_t          *tail;
+    size_t          queued;
+    size_t          capacity;
+    pthread_t      *threads;
+    size_t          nthreads;
+    int             stopping;
+} worker_pool_t;
+
+int worker_pool_init(worker_pool_t *pool, size_t workers, size_t capacity, int *err);
+
+void worker_pool_destroy(worker_pool_t *pool);
+
+job_t *job_create(const request_t *request, ssize_t (*func)(request_t *request));
+
+int worker_pool_submit(worker_pool_t *pool, job_t *job);
+
+void job_release(job_t *job);
+
+void job_destroy(job_t *job);
+
+#endif    // WORKERS_H
@@ -1,46 +1,68 @@
 #include "account.h"
 #include "database.h"
+#include "dispatch.h"
+#include "ratelimit.h"
+#include "schema.h"
+#include "timer.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <p101_c/p101_stdio.h>
 #include <p101_c/p101_stdlib.h>
+#include <pthread.h>
 #include <string.h>
 
-const funcMapping acc_func[] = {
-    {ACC_Create,  account_create},
-    {ACC_Login,   account_login },
-    {ACC_Logout,  account_logout},
-    {ACC_Edit,    NULL          },
-    {SYS_Success, NULL          }  // Null termination for safety
+// ndbm allows one writer per file, so reactors take turns on the account databases
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static const funcMapping acc_func[] = {
+    {ACC_Create,  account_create, 1, 0, &schema_credentials},
+    {ACC_Login,   account_login,  1, 0, &schema_credentials},
+    {ACC_Logout,  account_logout, 0, 0, NULL               },
+    {ACC_Edit,    NULL,           0, 1, NULL               }, // not implemented, left unregistered
+    {SYS_Success, NULL,           0, 0, NULL               }  // Null termination for safety
 };
 
-ssize_t account_create(request_t *request)
+int account_register(void)
 {
-    DBO         userDB;
-    DBO         index_userDB;
-    char        user_name[]  = "users";
-    char        index_name[] = "index_user";
-    void       *existing;
-    uint8_t     user_len;
-    uint8_t     pass_len;
-    char       *ptr;
-    const char *username;
-    const char *password;
-    char       *copy;
-    int         user_id;
+    return dispatch_register(acc_func);
+}
 
-    // server default to 0
-    uint16_t sender_id = SERVER_ID;
+ssize_t account_create(request_t *request)
+{
+    DBO          userDB;
+    DBO          index_userDB;
+    char         user_name[]  = "users";
+    char         index_name[] = "index_user";
+    void        *existing;
+    size_t       stored_len;
+    uint8_t      user_len;
+    uint8_t      pass_len;
+    codec_view_t fields[CRED_FIELDS];
+    const char  *username;
+    const char  *password;
+    char        *copy;
+    int          user_id;
+    int          new_id;
 
     userDB.name       = user_name;
     userDB.db         = NULL;
     index_userDB.name = index_name;
     index_userDB.db   = NULL;
 
-    copy = NULL;
-
     printf("in account_create %d \n", *request->client_fd);
 
+    if(codec_decode(&schema_credentials, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+    username = (const char *)fields[CRED_USER].ptr;
+    user_len = fields[CRED_USER].len;
+    password = (const char *)fields[CRED_PASS].ptr;
+    pass_len = fields[CRED_PASS].len;
+
+    pthread_mutex_lock(&db_lock);
+
     if(database_open(&userDB, &request->err) < 0)
     {
         perror("database error");
@@ -55,39 +77,22 @@ ssize_t account_create(request_t *request)
         goto error;
     }
 
-    // start from username len
-    ptr = (char *)request->content + HEADER_SIZE + 1;
-
-    memcpy(&user_len, ptr, sizeof(user_len));
-    ptr += sizeof(user_len);
-
-    username = ptr;
-
-    // start from password len
-    ptr += user_len + 1;
-    memcpy(&pass_len, ptr, sizeof(pass_len));
-    ptr += sizeof(pass_len);
-
-    password = ptr;
-
     printf("username: %.*s\n", (int)user_len, username);
     printf("password: %.*s\n", (int)pass_len, password);
 
     // check user exists
-    existing = retrieve_byte(userDB.db, username, user_len);
+    existing = retrieve_byte_arena(userDB.db, username, user_len, request->arena, &stored_len);
     if(existing)
     {
-        printf("Retrieved password: %.*s\n", (int)pass_len, (char *)existing);
         request->code = USER_EXISTS;
-        free(existing);
         goto error;
     }
 
-    (*request->user_count)++;
-    *request->session_id = *request->user_count;
+    // the session only starts once the user is stored; a failed create burns its id and nothing else
+    new_id = atomic_fetch_add(request->user_count, 1) + 1;
 
-    printf("request->user_count: %d\n", *request->user_count);
-    printf("request->session_id: %d\n", *request->session_id);
+    printf("request->user_count: %d\n", atomic_load(request->user_count));
+    printf("new user id: %d\n", new_id);
 
     // Store user
     if(store_byte(userDB.db, username, user_len, password, pass_len) != 0)
@@ -97,7 +102,7 @@ ssize_t account_create(request_t *request)
         goto error;
     }
 
-    copy = strndup(username, user_len);
+    copy = arena_strndup(request->arena, username, user_len);
     if(!copy)
     {
         perror("Failed to allocate memory");
@@ -106,7 +111,7 @@ ssize_t account_create(request_t *request)
     }
 
     // Store user index
-    if(store_int(index_userDB.db, copy, *request->session_id) < 0)
+    if(store_int(index_userDB.db, copy, new_id) < 0)
     {
         perror("update user_index");
         request->code = SERVER_ERROR;
@@ -122,67 +127,70 @@ ssize_t account_create(request_t *request)
     }
     printf("account login: user_id: %.*d\n", (int)sizeof(*request->session_id), user_id);
 
-    ptr = (char *)request->response;
-    // tag
-    *ptr++ = SYS_Success;
-    // version
-    *ptr++ = TWO;
-
-    // sender_id
-    sender_id = htons(sender_id);
-    memcpy(ptr, &sender_id, sizeof(sender_id));
-    ptr += sizeof(sender_id);
-
-    // payload len
-    request->response_len = htons(request->response_len);
-    memcpy(ptr, &request->response_len, sizeof(request->response_len));
-    ptr += sizeof(request->response_len);
+    *request->session_id       = new_id;
+    request->session_name     = username;
+    request->session_name_len = user_len;
 
-    *ptr++ = ENUMERATED;
-    *ptr++ = sizeof(uint8_t);
-    *ptr++ = ACC_Create;
+    ack_response(request);
 
     dbm_close(userDB.db);
     dbm_close(index_userDB.db);
-    free(copy);
+    pthread_mutex_unlock(&db_lock);
     return 0;
 
 error:
     dbm_close(userDB.db);
     dbm_close(index_userDB.db);
-    free(copy);
+    pthread_mutex_unlock(&db_lock);
 
     return -1;
 }
 
 ssize_t account_login(request_t *request)
 {
-    DBO         userDB;
-    DBO         index_userDB;
-    char        user_name[]  = "users";
-    char        index_name[] = "index_user";
-    void       *existing;
-    datum       output;
-    uint8_t     user_len;
-    uint8_t     pass_len;
-    char       *ptr;
-    const char *username;
-    const char *password;
-    char       *copy;
-    int         user_id;
-
-    // server default to 0
-    uint16_t sender_id = SERVER_ID;
+    DBO          userDB;
+    DBO          index_userDB;
+    char         user_name[]  = "users";
+    char         index_name[] = "index_user";
+    void        *existing;
+    size_t       stored_len;
+    datum        output;
+    uint8_t      user_len;
+    uint8_t      pass_len;
+    codec_view_t fields[CRED_FIELDS];
+    codec_view_t reply;
+    const char  *username;
+    const char  *password;
+    char        *copy;
+    int          user_id;
+    uint16_t     user_id_be;
 
     userDB.name       = user_name;
     userDB.db         = NULL;
     index_userDB.name = index_name;
     index_userDB.db   = NULL;
 
-    copy = NULL;
-
     printf("in account_login %d \n", *request->client_fd);
 
+    if(codec_decode(&schema_credentials, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+    username = (const char *)fields[CRED_USER].ptr;
+    user_len = fields[CRED_USER].len;
+    password = (const char *)fields[CRED_PASS].ptr;
+    pass_len = fields[CRED_PASS].len;
+
+    // the sender's address was charged already; this holds the guesses at one account from everywhere
+    if(!rate_allow_name(ACC_Login, username, user_len, timer_now_ms()))
+    {
+        request->code = RATE_LIMITED;
+        return -1;
+    }
+
+    pthread_mutex_lock(&db_lock);
+
     memset(&output, 0, sizeof(datum));
 
     if(database_open(&userDB, &request->err) < 0)
@@ -199,26 +207,11 @@ ssize_t account_login(request_t *request)
         goto error;
     }
 
-    // start from username len
-    ptr = (char *)request->content + HEADER_SIZE + 1;
-
-    memcpy(&user_len, ptr, sizeof(user_len));
-    ptr += sizeof(user_len);
-
-    username = ptr;
-
-    // start from password len
-    ptr += user_len + 1;
-    memcpy(&pass_len, ptr, sizeof(pass_len));
-    ptr += sizeof(pass_len);
-
-    password = ptr;
-
     printf("username: %.*s\n", (int)user_len, username);
     printf("password: %.*s\n", (int)pass_len, password);
 
     // check user exists
-    existing = retrieve_byte(userDB.db, username, user_len);
+    existing = retrieve_byte_arena(userDB.db, username, user_len, request->arena, &stored_len);
     if(!existing)
     {
         perror("Username not found");
@@ -226,16 +219,14 @@ ssize_t account_login(request_t *request)
         goto error;
     }
 
-    printf("Retrieved password: %.*s\n", (int)pass_len, (char *)existing);
-
-    if(memcmp(existing, password, pass_len) != 0)
+    // a prefix of the stored password is not the password, and a longer one would read past it
+    if(stored_len != pass_len || memcmp(existing, password, pass_len) != 0)
     {
-        free(existing);
         request->code = INVALID_AUTH;
         goto error;
     }
 
-    copy = strndup(username, user_len);
+    copy = arena_strndup(request->arena, username, user_len);
     if(!copy)
     {
         perror("Failed to allocate memory");
@@ -246,49 +237,33 @@ ssize_t account_login(request_t *request)
     if(retrieve_int(index_userDB.db, copy, &user_id) < 0)
     {
         printf("account login retrieve_int error\n");
-        free(existing);
         request->code = SERVER_ERROR;
         goto error;
     }
     printf("account login: user_id: %.*d\n", (int)sizeof(*request->session_id), user_id);
 
-    ptr = (char *)request->response;
-    // tag
-    *ptr++ = ACC_Login_Success;
-    // version
-    *ptr++ = TWO;
-
-    // sender_id
-    sender_id = htons(sender_id);
-    memcpy(ptr, &sender_id, sizeof(sender_id));
-    ptr += sizeof(sender_id);
-
-    // payload len
-    request->response_len = 4;
-    request->response_len = htons(request->response_len);
-    memcpy(ptr, &request->response_len, sizeof(request->response_len));
-    ptr += sizeof(request->response_len);
-
-    *ptr++ = INTEGER;
-    *ptr++ = sizeof(uint16_t);
-
-    user_id = htons((uint16_t)user_id);
-    memcpy(ptr, &user_id, sizeof(user_id));
+    // server default to 0
+    response_start(&request->response, ACC_Login_Success, TWO, SERVER_ID);
+    user_id_be = htons((uint16_t)user_id);
+    reply.ptr = (const uint8_t *)&user_id_be;
+    reply.len = sizeof(user_id_be);
+    codec_encode(&schema_login, &reply, &request->response);
 
-    *request->session_id = ntohs((uint16_t)user_id);
+    *request->session_id       = ntohs(user_id_be);
+    request->session_name     = username;
+    request->session_name_len = user_len;
 
     printf("session_id %d\n", *request->session_id);
 
     dbm_close(userDB.db);
     dbm_close(index_userDB.db);
-    free(existing);
-    free(copy);
+    pthread_mutex_unlock(&db_lock);
     return 0;
 
 error:
     dbm_close(userDB.db);
     dbm_close(index_userDB.db);
-    free(copy);
+    pthread_mutex_unlock(&db_lock);
     return -1;
 }
 
@@ -296,7 +271,8 @@ ssize_t account_logout(request_t *request)
 {
     printf("in account_logout %d \n", *request->client_fd);
 
-    request->response_len = 0;
+    response_reset(&request->response);
+    *request->session_id = -1;
 
     request->err = 0;
     return -1;
@@ -0,0 +1,138 @@
+#include "arena.h"
+#include "mem.h"
+#include <errno.h>
+#include <string.h>
+
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void free_spills(arena_t *arena);
+
+void arena_init(arena_t *arena)
+{
+    arena->base    = NULL;
+    arena->cap     = 0;
+    arena->used    = 0;
+    arena->spilled = 0;
+    arena->spills  = NULL;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    free_spills(arena);
+    mem_free(arena->base);
+    arena_init(arena);
+}
+
+static void free_spills(arena_t *arena)
+{
+    while(arena->spills != NULL)
+    {
+        arena_spill_t *next = arena->spills->next;
+
+        mem_free(arena->spills);
+        arena->spills = next;
+    }
+}
+
+/*
+ * Makes sure the next `size` bytes fit in the block, growing it only when it is empty (nothing
+ * handed out may move). Meant to be called at the start of a request with its payload length.
+ */
+int arena_reserve(arena_t *arena, size_t size, int *err)
+{
+    uint8_t *base;
+    size_t   cap;
+
+    if(arena->used != 0 || arena->cap >= size)
+    {
+        return 0;
+    }
+
+    cap = arena->cap ? arena->cap : ARENA_MIN;
+    while(cap < size)
+    {
+        cap *= 2;
+    }
+
+    base = (uint8_t *)mem_alloc(cap);
+    if(base == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    mem_free(arena->base);
+    arena->base = base;
+    arena->cap  = cap;
+    return 0;
+}
+
+/* Returns `size` bytes valid until the next reset, or NULL when out of memory. */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_spill_t *spill;
+
+    size = ARENA_ROUND(size);
+    if(arena->cap - arena->used >= size)
+    {
+        void *ptr = arena->base + arena->used;
+
+        arena->used += size;
+        return ptr;
+    }
+
+    // too big for the block this time; the next reset grows it to fit
+    spill = (arena_spill_t *)mem_alloc(sizeof(arena_spill_t) + size);
+    if(spill == NULL)
+    {
+        return NULL;
+    }
+
+    spill->next   = arena->spills;
+    arena->spills = spill;
+    arena->spilled += size;
+    return spill->data;
+}
+
+void *arena_memdup(arena_t *arena, const void *data, size_t size)
+{
+    void *copy;
+
+    copy = arena_alloc(arena, size);
+    if(copy != NULL)
+    {
+        memcpy(copy, data, size);
+    }
+    return copy;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+    char *copy;
+
+    copy = (char *)arena_alloc(arena, len + 1);
+    if(copy != NULL)
+    {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/* Releases everything allocated since the last reset. */
+void arena_reset(arena_t *arena)
+{
+    size_t want;
+    int    err;
+
+    want = arena->used + arena->spilled;
+    free_spills(arena);
+    arena->used    = 0;
+    arena->spilled = 0;
+
+    if(want > arena->cap)
+    {
+        err = 0;
+        arena_reserve(arena, want, &err);
+    }
+}
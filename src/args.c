@@ -1,10 +1,17 @@
 #include "args.h"
 #include "networking.h"
+#include "ratelimit.h"
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <p101_c/p101_stdio.h>
 #include <p101_c/p101_stdlib.h>
+#include <stdint.h>
 
 #define UNKNOWN_OPTION_MESSAGE_LEN 22
+#define MAX_THREADS 256
+
+static int convert_size(const char *str, size_t *value);
 
 _Noreturn void usage(const char *binary_name, int exit_code, const char *message)
 {
@@ -20,23 +27,42 @@ _Noreturn void usage(const char *binary_name, int exit_code, const char *message
     fputs("  -p <port>,    --port <port>        The server port to use.\n", stderr);
     fputs("  -A <sm address>, --sm address <sm address>  The address of server manager.\n", stderr);
     fputs("  -P <sm port>,    --sm port <sm port>        The server manager port.\n", stderr);
+    fputs("  -m <count>,   --max-clients <count>  Maximum number of concurrent clients.\n", stderr);
+    fputs("  -t <count>,   --threads <count>      Number of event loops, each with its own listener.\n", stderr);
+    fputs("  -w <count>,   --workers <count>      Number of database worker threads, 0 to run inline.\n", stderr);
+    fputs("  -u,           --io-uring             Drive sockets through io_uring instead of epoll.\n", stderr);
+    fputs("  -b <count>,   --backlog <count>      Length of the kernel's pending connection queue.\n", stderr);
+    fputs("  -H <bytes>,   --high-watermark <bytes>  Unsent bytes at which a client stops being read.\n", stderr);
+    fputs("  -L <bytes>,   --low-watermark <bytes>   Unsent bytes at which reading resumes.\n", stderr);
+    fputs("  -D <dir>,     --history-dir <dir>    Where the chat history log is kept.\n", stderr);
+    fputs("  -R <type>:<rate>[:<burst>], --rate   Messages of a type allowed a second, per user; 0 for no limit.\n", stderr);
     exit(exit_code);
 }
 
 void get_arguments(args_t *args, int argc, char *argv[])
 {
-    int opt;
+    int    opt;
+    size_t value;
 
     static struct option long_options[] = {
-        {"address",    required_argument, NULL, 'a'},
-        {"port",       required_argument, NULL, 'p'},
-        {"sm address", required_argument, NULL, 'A'},
-        {"sm_port",    required_argument, NULL, 'P'},
-        {"help",       no_argument,       NULL, 'h'},
-        {NULL,         0,                 NULL, 0  }
+        {"address",        required_argument, NULL, 'a'},
+        {"port",           required_argument, NULL, 'p'},
+        {"sm address",     required_argument, NULL, 'A'},
+        {"sm_port",        required_argument, NULL, 'P'},
+        {"max-clients",    required_argument, NULL, 'm'},
+        {"threads",        required_argument, NULL, 't'},
+        {"workers",        required_argument, NULL, 'w'},
+        {"io-uring",       no_argument,       NULL, 'u'},
+        {"backlog",        required_argument, NULL, 'b'},
+        {"high-watermark", required_argument, NULL, 'H'},
+        {"low-watermark",  required_argument, NULL, 'L'},
+        {"history-dir",    required_argument, NULL, 'D'},
+        {"rate",           required_argument, NULL, 'R'},
+        {"help",           no_argument,       NULL, 'h'},
+        {NULL,             0,                 NULL, 0  }
     };
 
-    while((opt = getopt_long(argc, argv, "ha:p:A:P:", long_options, NULL)) != -1)
+    while((opt = getopt_long(argc, argv, "ha:p:A:P:m:t:w:ub:H:L:D:R:", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -58,10 +84,59 @@ void get_arguments(args_t *args, int argc, char *argv[])
                     usage(argv[0], EXIT_FAILURE, "Port must be between 1 and 65535");
                 }
                 break;
+            case 'm':
+                if(convert_size(optarg, &args->max_clients) != 0 || args->max_clients == 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Max clients must be a positive number");
+                }
+                break;
+            case 't':
+                if(convert_size(optarg, &args->threads) != 0 || args->threads == 0 || args->threads > MAX_THREADS)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Threads must be between 1 and 256");
+                }
+                break;
+            case 'w':
+                if(convert_size(optarg, &args->workers) != 0 || args->workers > MAX_THREADS)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Workers must be between 0 and 256");
+                }
+                break;
+            case 'u':
+                args->io_uring = 1;
+                break;
+            case 'b':
+                if(convert_size(optarg, &value) != 0 || value == 0 || value > INT_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Backlog must be a positive number");
+                }
+                args->backlog = (int)value;
+                break;
+            case 'H':
+                if(convert_size(optarg, &args->out_high) != 0 || args->out_high == 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "High watermark must be a positive number");
+                }
+                break;
+            case 'L':
+                if(convert_size(optarg, &args->out_low) != 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Low watermark must be a number");
+                }
+                break;
+            case 'D':
+                args->history_dir = optarg;
+                break;
+            case 'R':
+                if(rate_parse(optarg) != 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Rate must be <type>:<per second>[:<burst>], with at most 8 types limited");
+                }
+                break;
             case 'h':
                 usage(argv[0], EXIT_SUCCESS, NULL);
             case '?':
-                if(optopt != 'a' && optopt != 'p' && optopt != 'A' && optopt != 'P')
+                if(optopt != 'a' && optopt != 'p' && optopt != 'A' && optopt != 'P' && optopt != 'm' && optopt != 't' && optopt != 'w' && optopt != 'b' && optopt != 'H' && optopt != 'L' && optopt != 'D' && optopt != 'R')
                 {
                     char message[UNKNOWN_OPTION_MESSAGE_LEN];
 
@@ -73,4 +148,30 @@ void get_arguments(args_t *args, int argc, char *argv[])
                 usage(argv[0], EXIT_FAILURE, NULL);
         }
     }
+
+    if(args->out_low > args->out_high)
+    {
+        usage(argv[0], EXIT_FAILURE, "Low watermark must not exceed the high watermark");
+    }
+}
+
+static int convert_size(const char *str, size_t *value)
+{
+    char              *endptr;
+    unsigned long long val;
+
+    if(*str == '-')
+    {
+        return -1;
+    }
+
+    errno = 0;
+    val   = strtoull(str, &endptr, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    if(endptr == str || *endptr != '\0' || errno == ERANGE || val > SIZE_MAX)
+    {
+        return -1;
+    }
+
+    *value = (size_t)val;
+    return 0;
 }
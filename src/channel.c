@@ -0,0 +1,404 @@
+#include "channel.h"
+#include "connection.h"
+#include "mem.h"
+#include <p101_c/p101_stdio.h>
+#include <pthread.h>
+#include <string.h>
+
+#define CHANNEL_SLOT_BITS 16
+#define CHANNEL_SLOT_MASK ((1U << CHANNEL_SLOT_BITS) - 1)
+#define CHANNEL_MEMBERS_INITIAL 8
+
+_Static_assert(CHANNEL_MAX <= CHANNEL_SLOT_MASK, "channel slots must fit below the generation bits");
+_Static_assert((CHANNEL_BUCKETS & (CHANNEL_BUCKETS - 1)) == 0, "CHANNEL_BUCKETS must be a power of two");
+
+/* A name in use. Its id carries a generation, so mail for a channel that closed meanwhile finds nobody. */
+typedef struct channel_slot_t
+{
+    uint32_t id;         // generation << CHANNEL_SLOT_BITS | slot, CHANNEL_ALL while free
+    uint32_t members;    // connections in the channel, on every reactor
+    uint16_t gen;
+    uint16_t next;       // bucket chain or free list, as slot + 1
+    uint8_t  name_len;
+    char     name[CHANNEL_NAME_MAX];
+} channel_slot_t;
+
+/* Every open channel by name. Taken for writing by joins and leaves, for reading by sends. */
+typedef struct channel_registry_t
+{
+    pthread_rwlock_t lock;
+    uint16_t         buckets[CHANNEL_BUCKETS];    // slot + 1 of the first in each chain
+    uint16_t         free;                        // slot + 1 of the first reusable slot
+    uint16_t         used;                        // slots ever handed out
+    channel_slot_t   slots[CHANNEL_MAX];
+} channel_registry_t;
+
+static channel_registry_t registry = {.lock = PTHREAD_RWLOCK_INITIALIZER};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* FNV-1a, folded onto the buckets. */
+static size_t bucket_of(const char *name, uint8_t len)
+{
+    uint32_t hash;
+
+    hash = 2166136261U;
+    for(uint8_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    return hash & (CHANNEL_BUCKETS - 1);
+}
+
+/* Slot + 1 of the named channel, 0 when it is not open. Called with the lock held. */
+static uint16_t find_slot(const char *name, uint8_t len)
+{
+    uint16_t link;
+
+    for(link = registry.buckets[bucket_of(name, len)]; link != 0; link = registry.slots[link - 1].next)
+    {
+        const channel_slot_t *slot = &registry.slots[link - 1];
+
+        if(slot->name_len == len && memcmp(slot->name, name, len) == 0)
+        {
+            return link;
+        }
+    }
+    return 0;
+}
+
+/* Counts one more member of the named channel, opening it if it is new. */
+static int open_channel(const char *name, uint8_t len, uint32_t *id)
+{
+    channel_slot_t *slot;
+    uint16_t        link;
+    size_t          bucket;
+
+    pthread_rwlock_wrlock(&registry.lock);
+
+    link = find_slot(name, len);
+    if(link != 0)
+    {
+        slot = &registry.slots[link - 1];
+        slot->members++;
+        *id = slot->id;
+        pthread_rwlock_unlock(&registry.lock);
+        return 0;
+    }
+
+    if(registry.free != 0)
+    {
+        link          = registry.free;
+        registry.free = registry.slots[link - 1].next;
+    }
+    else if(registry.used < CHANNEL_MAX)
+    {
+        link = ++registry.used;
+    }
+    else
+    {
+        pthread_rwlock_unlock(&registry.lock);
+        fprintf(stderr, "channel: all %d channels are open\n", CHANNEL_MAX);
+        return -1;
+    }
+
+    slot = &registry.slots[link - 1];
+    if(++slot->gen == 0)
+    {
+        slot->gen = 1;
+    }
+    slot->id       = ((uint32_t)slot->gen << CHANNEL_SLOT_BITS) | (uint32_t)(link - 1);
+    slot->members  = 1;
+    slot->name_len = len;
+    memcpy(slot->name, name, len);
+
+    bucket                   = bucket_of(name, len);
+    slot->next               = registry.buckets[bucket];
+    registry.buckets[bucket] = link;
+
+    *id = slot->id;
+    pthread_rwlock_unlock(&registry.lock);
+    return 0;
+}
+
+/* Counts one member fewer, closing the channel and freeing its name with the last. */
+static void close_channel(uint32_t id)
+{
+    channel_slot_t *slot;
+    uint16_t       *link;
+
+    pthread_rwlock_wrlock(&registry.lock);
+
+    slot = &registry.slots[id & CHANNEL_SLOT_MASK];
+    if(slot->id != id || --slot->members > 0)
+    {
+        pthread_rwlock_unlock(&registry.lock);
+        return;
+    }
+
+    link = &registry.buckets[bucket_of(slot->name, slot->name_len)];
+    while(*link != (id & CHANNEL_SLOT_MASK) + 1)
+    {
+        link = &registry.slots[*link - 1].next;
+    }
+    *link = slot->next;
+
+    slot->id      = CHANNEL_ALL;
+    slot->next    = registry.free;
+    registry.free = (uint16_t)((id & CHANNEL_SLOT_MASK) + 1);
+
+    pthread_rwlock_unlock(&registry.lock);
+}
+
+/* A membership list for a connection's first join, from the table's pool when it has one. */
+static conn_channel_t *take_joins(conn_table_t *table)
+{
+    conn_channel_t *joins;
+
+    if(table->spare_joins == NULL)
+    {
+        joins = (conn_channel_t *)mem_alloc(CHANNEL_PER_CONN * sizeof(conn_channel_t));
+        if(joins == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+        }
+        return joins;
+    }
+
+    joins = (conn_channel_t *)table->spare_joins;
+    memcpy(&table->spare_joins, (void *)joins, sizeof(table->spare_joins));
+    table->nspare_joins--;
+    return joins;
+}
+
+/* Gives back the list of a connection that has left its last channel. */
+static void put_joins(conn_table_t *table, conn_t *conn)
+{
+    void *joins = conn->channels;
+
+    conn->channels = NULL;
+    if(table->nspare_joins >= CONN_SPARE_MAX)
+    {
+        mem_free(joins);
+        return;
+    }
+
+    memcpy(joins, (void *)&table->spare_joins, sizeof(table->spare_joins));
+    table->spare_joins = joins;
+    table->nspare_joins++;
+}
+
+/* Position of channel `id` in the connection's list, or -1. */
+static int find_membership(const conn_t *conn, uint32_t id)
+{
+    for(int i = 0; i < conn->nchannels; i++)
+    {
+        if(conn->channels[i].id == id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Takes the connection out of this reactor's member list for its `index`th channel. */
+static void drop_membership(conn_table_t *table, conn_t *conn, int index)
+{
+    channel_members_t *members;
+    conn_t            *last;
+    uint32_t           id;
+    uint32_t           pos;
+    int                moved;
+
+    id      = conn->channels[index].id;
+    pos     = conn->channels[index].pos;
+    members = &table->channels[id & CHANNEL_SLOT_MASK];
+
+    // the last member takes the leaver's place
+    last                = members->conns[--members->count];
+    members->conns[pos] = last;
+    moved               = find_membership(last, id);
+
+    last->channels[moved].pos = pos;
+
+    conn->channels[index] = conn->channels[--conn->nchannels];
+    if(conn->nchannels == 0)
+    {
+        put_joins(table, conn);
+    }
+}
+
+/*
+ * Adds the connection to the named channel. Returns 1 when it already was a member and -1 when
+ * it cannot join, because it is in CHANNEL_PER_CONN channels already or the registry is full.
+ */
+int channel_join(conn_table_t *table, conn_t *conn, const char *name, uint8_t len)
+{
+    channel_members_t *members;
+    uint32_t           id;
+
+    if(channel_lookup(conn, name, len) != CHANNEL_ALL)
+    {
+        return 1;
+    }
+    if(conn->nchannels == CHANNEL_PER_CONN)
+    {
+        return -1;
+    }
+
+    if(table->channels == NULL)
+    {
+        table->channels = (channel_members_t *)mem_alloc(CHANNEL_MAX * sizeof(channel_members_t));
+        if(table->channels == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return -1;
+        }
+        memset(table->channels, 0, CHANNEL_MAX * sizeof(channel_members_t));
+    }
+
+    // idle connections carry no membership list, so they stay small
+    if(conn->channels == NULL)
+    {
+        conn->channels = take_joins(table);
+        if(conn->channels == NULL)
+        {
+            return -1;
+        }
+    }
+
+    if(open_channel(name, len, &id) < 0)
+    {
+        goto error;
+    }
+
+    // a slot left over from a channel that has closed since starts again empty
+    members = &table->channels[id & CHANNEL_SLOT_MASK];
+    if(members->id != id)
+    {
+        members->id    = id;
+        members->count = 0;
+    }
+
+    if(members->count == members->cap)
+    {
+        uint32_t cap   = (members->cap == 0) ? CHANNEL_MEMBERS_INITIAL : members->cap * 2;
+        conn_t **conns = (conn_t **)mem_realloc((void *)members->conns, cap * sizeof(*conns));
+
+        if(conns == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            close_channel(id);
+            goto error;
+        }
+        members->conns = conns;
+        members->cap   = cap;
+    }
+
+    conn->channels[conn->nchannels].id  = id;
+    conn->channels[conn->nchannels].pos = members->count;
+    conn->nchannels++;
+    members->conns[members->count++] = conn;
+    return 0;
+
+error:
+    if(conn->nchannels == 0)
+    {
+        put_joins(table, conn);
+    }
+    return -1;
+}
+
+/* Takes the connection out of the named channel. Returns 1 when it was not a member. */
+int channel_leave(conn_table_t *table, conn_t *conn, const char *name, uint8_t len)
+{
+    uint32_t id;
+
+    id = channel_lookup(conn, name, len);
+    if(id == CHANNEL_ALL)
+    {
+        return 1;
+    }
+
+    drop_membership(table, conn, find_membership(conn, id));
+    close_channel(id);
+    return 0;
+}
+
+/* Takes the connection out of every channel it is in, as its session ends. */
+void channel_leave_all(conn_table_t *table, conn_t *conn)
+{
+    while(conn->nchannels > 0)
+    {
+        uint32_t id = conn->channels[conn->nchannels - 1].id;
+
+        drop_membership(table, conn, conn->nchannels - 1);
+        close_channel(id);
+    }
+}
+
+/* Id of the named channel when the connection is in it, CHANNEL_ALL otherwise. */
+uint32_t channel_lookup(const conn_t *conn, const char *name, uint8_t len)
+{
+    uint32_t id;
+    uint16_t link;
+
+    if(conn->nchannels == 0)
+    {
+        return CHANNEL_ALL;
+    }
+
+    pthread_rwlock_rdlock(&registry.lock);
+    link = find_slot(name, len);
+    id   = (link != 0) ? registry.slots[link - 1].id : CHANNEL_ALL;
+    pthread_rwlock_unlock(&registry.lock);
+
+    if(id == CHANNEL_ALL || find_membership(conn, id) < 0)
+    {
+        return CHANNEL_ALL;
+    }
+    return id;
+}
+
+/* This reactor's members of channel `id`, or NULL when it has none. */
+const channel_members_t *channel_members(const conn_table_t *table, uint32_t id)
+{
+    const channel_members_t *members;
+
+    if(table->channels == NULL)
+    {
+        return NULL;
+    }
+
+    members = &table->channels[id & CHANNEL_SLOT_MASK];
+    if(members->id != id || members->count == 0)
+    {
+        return NULL;
+    }
+    return members;
+}
+
+/* Frees a table's member lists. Called once its connections are closed. */
+void channel_table_destroy(conn_table_t *table)
+{
+    while(table->spare_joins != NULL)
+    {
+        void *next;
+
+        memcpy((void *)&next, table->spare_joins, sizeof(next));
+        mem_free(table->spare_joins);
+        table->spare_joins = next;
+    }
+    table->nspare_joins = 0;
+
+    if(table->channels == NULL)
+    {
+        return;
+    }
+
+    for(size_t i = 0; i < CHANNEL_MAX; i++)
+    {
+        mem_free((void *)table->channels[i].conns);
+    }
+    mem_free(table->channels);
+    table->channels = NULL;
+}
@@ -1,98 +1,272 @@
 #include "chat.h"
-#include "io.h"
+#include "dispatch.h"
+#include "fanout.h"
+#include "history.h"
+#include "schema.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <p101_c/p101_stdio.h>
 #include <p101_c/p101_stdlib.h>
 #include <string.h>
 
-const funcMapping chat_func[] = {
-    {CHT_Send,    chat_broadcast},
-    {SYS_Success, NULL          }  // Null termination for safety
+static const funcMapping chat_func[] = {
+    {CHT_Send,    chat_broadcast,    0, 1, &schema_chat        },
+    {CHN_Join,    chat_join,         0, 1, &schema_channel     },
+    {CHN_Leave,   chat_leave,        0, 1, &schema_channel     },
+    {CHN_Send,    chat_channel_send, 0, 1, &schema_channel_chat},
+    {DM_Send,     chat_direct,       0, 1, &schema_direct      },
+    {HIS_Get,     chat_history,      0, 1, &schema_history_get },
+    {SYS_Success, NULL,              0, 0, NULL                }  // Null termination for safety
 };
 
-ssize_t chat_broadcast(request_t *request)
+static int forward(request_t *request, uint32_t channel, const uint8_t *name, uint8_t name_len);
+
+int chat_register(void)
 {
-    char       *ptr;
-    const char *timestamp;
-    const char *content;
-    const char *username;
-    uint8_t     time_len;
-    uint8_t     content_len;
-    uint8_t     user_len;
+    return dispatch_register(chat_func);
+}
 
-    // server default to 0
-    uint16_t sender_id = SERVER_ID;
+ssize_t chat_broadcast(request_t *request)
+{
+    codec_view_t fields[CHAT_FIELDS];
 
     printf("in chat_broadcast %d \n", *request->client_fd);
 
-    ptr = (char *)request->response;
-    // tag
-    *ptr++ = SYS_Success;
-    // version
-    *ptr++ = TWO;
+    // a malformed message is refused before anyone sees it
+    if(codec_decode(&schema_chat, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+
+    printf("timestamp: %.*s\n", (int)fields[CHAT_TIME].len, (const char *)fields[CHAT_TIME].ptr);
+    printf("content: %.*s\n", (int)fields[CHAT_CONTENT].len, (const char *)fields[CHAT_CONTENT].ptr);
+    printf("username: %.*s\n", (int)fields[CHAT_USER].len, (const char *)fields[CHAT_USER].ptr);
+
+    return forward(request, CHANNEL_ALL, (const uint8_t *)"", 0);
+}
 
-    // sender_id
-    sender_id = htons(sender_id);
-    memcpy(ptr, &sender_id, sizeof(sender_id));
-    ptr += sizeof(sender_id);
+/*
+ * Acks a chat message and forwards the inbound frame as is to everyone in `channel`: copied
+ * once, then queued by reference for every recipient and kept in the history of the channel
+ * called `name`, the room when it is empty. The copy is made before the ack, so a sender is
+ * only told its message was taken once it can be delivered.
+ */
+static int forward(request_t *request, uint32_t channel, const uint8_t *name, uint8_t name_len)
+{
+    struct iovec    iov[RESPONSE_IOV_MAX];
+    int             iovcnt;
+    size_t          frame_len;
+    fanout_frame_t *frame;
 
-    request->response_len = htons(request->response_len);
-    memcpy(ptr, &request->response_len, sizeof(request->response_len));
-    ptr += sizeof(request->response_len);
+    frame_len = HEADER_SIZE + request->len;
+    printf("response_len: %zu\n", frame_len);
 
-    *ptr++ = ENUMERATED;
-    *ptr++ = sizeof(uint8_t);
-    *ptr++ = CHT_Send;
+    frame = fanout_create(request->content, frame_len);
+    if(frame == NULL)
+    {
+        request->err  = errno;
+        request->code = SERVER_ERROR;
+        return -1;
+    }
 
-    request->response_len = (uint16_t)(HEADER_SIZE + ntohs(request->response_len));
-    printf("response_len: %d\n", (request->response_len));
+    ack_response(request);
 
-    // send ack
-    write_fully(*request->client_fd, request->response, request->response_len, &request->err);
+    // a v2 sender gets its ack ahead of its own message coming back; a batch collects it for its reply
+    if(!request->batching)
+    {
+        iovcnt = response_iov(&request->response, iov);
+        printf("response_len: %zu\n", response_size(&request->response));
+
+        // send ack
+        reactor_sendv(request->reactor, request->conn, iov, iovcnt, &request->err);
+        response_reset(&request->response);
+    }
+
+    // sequenced before anyone sees it, so a client catching up never misses what it was just sent
+    history_append((const char *)name, name_len, frame);
+    reactor_broadcast(request->reactor, channel, frame, &request->err);
+    fanout_release(frame);
+    return 0;
+}
 
-    // broadcast
+ssize_t chat_join(request_t *request)
+{
+    codec_view_t fields[CHANNEL_FIELDS];
 
-    // start from timestamp len
-    ptr = (char *)request->content + HEADER_SIZE + 1;
+    if(codec_decode(&schema_channel, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
 
-    memcpy(&time_len, ptr, sizeof(time_len));
-    ptr += sizeof(time_len);
+    if(channel_join(&request->reactor->conns, request->conn, (const char *)fields[CHANNEL_NAME].ptr, fields[CHANNEL_NAME].len) < 0)
+    {
+        request->code = (request->conn->nchannels == CHANNEL_PER_CONN) ? TOO_MANY_CHANNELS : SERVER_ERROR;
+        return -1;
+    }
 
-    timestamp = ptr;
+    ack_response(request);
+    return 0;
+}
 
-    // start from content len
-    ptr += time_len + 1;
-    memcpy(&content_len, ptr, sizeof(content_len));
-    ptr += sizeof(content_len);
+ssize_t chat_leave(request_t *request)
+{
+    codec_view_t fields[CHANNEL_FIELDS];
 
-    content = ptr;
+    if(codec_decode(&schema_channel, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
 
-    // start from user len
-    ptr += content_len + 1;
-    memcpy(&user_len, ptr, sizeof(user_len));
-    ptr += sizeof(user_len);
+    // leaving a channel the client is not in is as good as done
+    channel_leave(&request->reactor->conns, request->conn, (const char *)fields[CHANNEL_NAME].ptr, fields[CHANNEL_NAME].len);
 
-    username = ptr;
+    ack_response(request);
+    return 0;
+}
 
-    printf("timestamp: %.*s\n", (int)time_len, timestamp);
-    printf("content: %.*s\n", (int)content_len, content);
-    printf("username: %.*s\n", (int)user_len, username);
+/* Like chat_broadcast, but only to the members of a channel the sender is in itself. */
+ssize_t chat_channel_send(request_t *request)
+{
+    codec_view_t fields[CHANNEL_CHAT_FIELDS];
+    uint32_t     channel;
 
-    request->response_len = (uint16_t)(HEADER_SIZE + request->len);
-    printf("response_len: %d\n", request->response_len);
-    memcpy(request->response, request->content, request->response_len);
+    if(codec_decode(&schema_channel_chat, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
 
-    for(int i = 1; i < MAX_FDS; i++)
+    channel = channel_lookup(request->conn, (const char *)fields[CHANNEL_CHAT_NAME].ptr, fields[CHANNEL_CHAT_NAME].len);
+    if(channel == CHANNEL_ALL)
     {
-        if(request->fds[i].fd != -1)
-        {
-            printf("broadcasting... %d\n", request->fds[i].fd);
-            write_fully(request->fds[i].fd, request->response, request->response_len, &request->err);
-        }
+        request->code = NOT_IN_CHANNEL;
+        return -1;
     }
 
-    request->response_len = 0;
+    return forward(request, channel, fields[CHANNEL_CHAT_NAME].ptr, fields[CHANNEL_CHAT_NAME].len);
+}
 
+/*
+ * Forwards the inbound frame as is to the connections of one user, found through the route map
+ * rather than by walking the clients. A recipient who is not logged in gets it on their next
+ * login; one with a full mailbox does not.
+ */
+ssize_t chat_direct(request_t *request)
+{
+    codec_view_t    fields[DIRECT_FIELDS];
+    route_t         routes[ROUTE_CONNS];
+    fanout_frame_t *frame;
+    uint16_t        recipient;
+    int             nroutes;
+
+    if(codec_decode(&schema_direct, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+    memcpy(&recipient, fields[DIRECT_TO].ptr, sizeof(recipient));
+    recipient = ntohs(recipient);
+
+    // session ids are handed out in order from 1, so anything past the count is nobody
+    if(recipient == 0 || recipient > atomic_load(request->user_count))
+    {
+        request->code = INVALID_USER_ID;
+        return -1;
+    }
+
+    frame = fanout_create(request->content, HEADER_SIZE + request->len);
+    if(frame == NULL)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+
+    nroutes = route_message(recipient, frame, routes);
+    for(int i = 0; i < nroutes; i++)
+    {
+        reactor_send_route(request->reactor, &routes[i], frame, &request->err);
+    }
+    fanout_release(frame);
+
+    if(nroutes < 0)
+    {
+        request->code = MAILBOX_FULL;
+        return -1;
+    }
+
+    ack_response(request);
+    return 0;
+}
+
+/*
+ * Answers with the messages of a channel, or of the room when the name is empty, sent after
+ * sequence `since`: one batch per request, with `last` as the `since` of the next one while
+ * `more` is set. Any client may ask, as any client may join a channel to read it anyway.
+ */
+ssize_t chat_history(request_t *request)
+{
+    codec_view_t   fields[HISTORY_GET_FIELDS];
+    codec_view_t   head[HISTORY_PAGE_FIELDS];
+    history_page_t page;
+    uint32_t       since;
+    uint8_t        limit;
+    uint32_t       last_be;
+    uint32_t       oldest_be;
+    uint8_t        count;
+    uint8_t        more;
+    uint8_t       *body;
+    size_t         head_len;
+
+    if(codec_decode(&schema_history_get, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+    memcpy(&since, fields[HISTORY_SINCE].ptr, sizeof(since));
+    since = ntohl(since);
+    limit = fields[HISTORY_LIMIT].ptr[0];
+    if(limit == 0 || limit > HISTORY_BATCH)
+    {
+        limit = HISTORY_BATCH;
+    }
+
+    // the head is all fixed-size fields, so the messages can be copied in behind it first
+    head_len = CODEC_TL_SIZE * HISTORY_PAGE_FIELDS + sizeof(last_be) + sizeof(oldest_be) + sizeof(count) + sizeof(more);
+    body     = (uint8_t *)arena_alloc(request->arena, head_len + HISTORY_PAGE_BYTES);
+    if(body == NULL)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+    history_page((const char *)fields[HISTORY_CHANNEL].ptr, fields[HISTORY_CHANNEL].len, since, limit, body + head_len, HISTORY_PAGE_BYTES, &page);
+
+    last_be   = htonl(page.last);
+    oldest_be = htonl(page.oldest);
+    count     = (uint8_t)page.count;
+    more      = (uint8_t)page.more;
+
+    head[HISTORY_LAST].ptr   = (const uint8_t *)&last_be;
+    head[HISTORY_LAST].len   = sizeof(last_be);
+    head[HISTORY_OLDEST].ptr = (const uint8_t *)&oldest_be;
+    head[HISTORY_OLDEST].len = sizeof(oldest_be);
+    head[HISTORY_COUNT].ptr  = &count;
+    head[HISTORY_COUNT].len  = sizeof(count);
+    head[HISTORY_MORE].ptr   = &more;
+    head[HISTORY_MORE].len   = sizeof(more);
+    if(codec_encode_buf(&schema_history_page, head, body, head_len) != (ssize_t)head_len)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+
+    response_start(&request->response, HIS_Response, TWO, SERVER_ID);
+    if(response_ref(&request->response, body, head_len + page.used) < 0)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
     return 0;
 }
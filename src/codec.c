@@ -0,0 +1,139 @@
+#include "codec.h"
+#include "utf8.h"
+#include <p101_c/p101_stdio.h>
+#include <string.h>
+
+static int check_value(const codec_field_t *field, const codec_view_t *value);
+
+/*
+ * Walks `body` once against the schema, filling one view per field. Every TLV must carry the
+ * expected tag, a length within the field's bounds and fit in what is left of the body, and
+ * nothing may follow the last field. CODEC_UTF8 values must also be well-formed UTF-8.
+ * Returns 0, or -1 on the first violation.
+ *
+ * Tag and length are checked with one compare: read as a 16-bit number, tag high, the header
+ * minus the expected tag and minimum length is at most max - min only when the tag matches and
+ * the length is in range. A value running past the end shows up as the next header, or the end
+ * of the body, not fitting.
+ */
+int codec_decode(const codec_schema_t *schema, const uint8_t *body, size_t len, codec_view_t *views)
+{
+    const uint8_t       *end;
+    const codec_field_t *field;
+    const codec_field_t *last;
+
+    end   = body + len;
+    field = schema->fields;
+    last  = field + schema->nfields;
+    for(; field < last; field++, views++)
+    {
+        uint16_t header;
+        uint8_t  vlen;
+
+        if(end - body < CODEC_TL_SIZE)
+        {
+            return -1;
+        }
+
+        vlen   = body[1];
+        header = (uint16_t)(body[0] << 8 | vlen);
+        if((uint16_t)(header - (field->tag << 8 | field->min_len)) > (uint8_t)(field->max_len - field->min_len))
+        {
+            return -1;
+        }
+
+        if((field->flags & CODEC_UTF8) && (end - body < CODEC_TL_SIZE + vlen || !utf8_valid(body + CODEC_TL_SIZE, vlen)))
+        {
+            return -1;
+        }
+
+        views->ptr = body + CODEC_TL_SIZE;
+        views->len = vlen;
+        body += CODEC_TL_SIZE + vlen;
+    }
+
+    return (body == end) ? 0 : -1;
+}
+
+static int check_value(const codec_field_t *field, const codec_view_t *value)
+{
+    if(value->len < field->min_len || value->len > field->max_len)
+    {
+        fprintf(stderr, "codec: %s is %u bytes, outside %u..%u\n", field->name, value->len, field->min_len, field->max_len);
+        return -1;
+    }
+    return 0;
+}
+
+/* Shortest and longest body the schema accepts. */
+void codec_bounds(const codec_schema_t *schema, size_t *min_len, size_t *max_len)
+{
+    *min_len = 0;
+    *max_len = 0;
+    for(size_t i = 0; i < schema->nfields; i++)
+    {
+        *min_len += CODEC_TL_SIZE + schema->fields[i].min_len;
+        *max_len += CODEC_TL_SIZE + schema->fields[i].max_len;
+    }
+}
+
+/* Bytes the encoded body of `values` takes. */
+size_t codec_size(const codec_schema_t *schema, const codec_view_t *values)
+{
+    size_t size;
+
+    size = 0;
+    for(size_t i = 0; i < schema->nfields; i++)
+    {
+        size += CODEC_TL_SIZE + values[i].len;
+    }
+    return size;
+}
+
+/* Encodes one view per field into `buf`. Returns the bytes written, or -1 when a value breaks the schema or does not fit. */
+ssize_t codec_encode_buf(const codec_schema_t *schema, const codec_view_t *values, uint8_t *buf, size_t cap)
+{
+    uint8_t *out;
+
+    if(codec_size(schema, values) > cap)
+    {
+        return -1;
+    }
+
+    out = buf;
+    for(size_t i = 0; i < schema->nfields; i++)
+    {
+        if(check_value(&schema->fields[i], &values[i]) < 0)
+        {
+            return -1;
+        }
+
+        out[0] = schema->fields[i].tag;
+        out[1] = values[i].len;
+        memcpy(out + CODEC_TL_SIZE, values[i].ptr, values[i].len);
+        out += CODEC_TL_SIZE + values[i].len;
+    }
+
+    return out - buf;
+}
+
+/* Encodes the body straight into the response's own bytes, behind whatever it already holds. */
+int codec_encode(const codec_schema_t *schema, const codec_view_t *values, response_t *res)
+{
+    uint8_t *dst;
+    size_t   size;
+
+    size = codec_size(schema, values);
+    dst  = response_reserve(res, size);
+    if(dst == NULL)
+    {
+        return -1;
+    }
+
+    if(codec_encode_buf(schema, values, dst, size) < 0)
+    {
+        response_unreserve(res, size);
+        return -1;
+    }
+    return 0;
+}
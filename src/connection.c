@@ -0,0 +1,796 @@
+#include "connection.h"
+#include "fanout.h"
+#include "mem.h"
+#include "online.h"
+#include "route.h"
+#include <errno.h>
+#include <p101_c/p101_stdio.h>
+#include <p101_c/p101_stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+_Static_assert(offsetof(conn_t, out_head) + sizeof(out_chunk_t *) <= CONN_CACHE_LINE, "conn_t hot fields must fit in one cache line");
+_Static_assert(sizeof(conn_t) <= 4 * CONN_CACHE_LINE, "an idle connection must stay within 256 bytes");
+
+static int          grow_slots(conn_table_t *table, size_t min_cap, int *err);
+static int          grow_active(conn_table_t *table, int *err);
+static conn_t      *take_conn(conn_table_t *table);
+static void         put_conn(conn_table_t *table, conn_t *conn);
+static int          reserve_rbuf(conn_table_t *table, conn_t *conn, size_t need, int *err);
+static void        *take_buf(conn_table_t *table);
+static void         put_buf(conn_table_t *table, void *buf);
+static out_chunk_t *take_chunk(conn_table_t *table, size_t len);
+static out_chunk_t *take_ref(conn_table_t *table);
+static void         link_chunk(conn_t *conn, out_chunk_t *chunk);
+
+int conn_table_init(conn_table_t *table, size_t max_clients, int *err)
+{
+    memset(table, 0, sizeof(*table));
+    table->max_clients = max_clients;
+
+    if(grow_slots(table, CONN_TABLE_INITIAL, err) < 0)
+    {
+        return -1;
+    }
+
+    if(grow_active(table, err) < 0)
+    {
+        conn_table_destroy(table);
+        return -1;
+    }
+
+    return 0;
+}
+
+void conn_table_destroy(conn_table_t *table)
+{
+    while(table->count > 0)
+    {
+        conn_close(table, table->active[table->count - 1]);
+    }
+    channel_table_destroy(table);
+
+    while(table->spare_bufs != NULL)
+    {
+        void *next;
+
+        memcpy((void *)&next, table->spare_bufs, sizeof(next));
+        mem_free(table->spare_bufs);
+        table->spare_bufs = next;
+    }
+
+    while(table->spare_chunks != NULL)
+    {
+        out_chunk_t *next = table->spare_chunks->next;
+
+        mem_free(table->spare_chunks);
+        table->spare_chunks = next;
+    }
+
+    while(table->spare_refs != NULL)
+    {
+        out_chunk_t *next = table->spare_refs->next;
+
+        mem_free(table->spare_refs);
+        table->spare_refs = next;
+    }
+
+    while(table->slabs != NULL)
+    {
+        conn_slab_t *next = table->slabs->next;
+
+        mem_free(table->slabs);
+        table->slabs = next;
+    }
+
+    mem_free((void *)table->slots);
+    mem_free((void *)table->active);
+    memset(table, 0, sizeof(*table));
+}
+
+/* Doubles the fd-indexed slot array until it can hold `min_cap` entries. */
+static int grow_slots(conn_table_t *table, size_t min_cap, int *err)
+{
+    conn_t **slots;
+    size_t   cap;
+
+    cap = table->slots_cap ? table->slots_cap : CONN_TABLE_INITIAL;
+    while(cap < min_cap)
+    {
+        cap *= 2;
+    }
+
+    slots = (conn_t **)mem_realloc((void *)table->slots, cap * sizeof(conn_t *));
+    if(slots == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    memset((void *)(slots + table->slots_cap), 0, (cap - table->slots_cap) * sizeof(conn_t *));
+    table->slots     = slots;
+    table->slots_cap = cap;
+    return 0;
+}
+
+/* Doubles the dense active list, never past the runtime client limit. */
+static int grow_active(conn_table_t *table, int *err)
+{
+    conn_t **active;
+    size_t   cap;
+
+    cap = table->active_cap ? table->active_cap * 2 : CONN_TABLE_INITIAL;
+    if(cap > table->max_clients)
+    {
+        cap = table->max_clients;
+    }
+
+    active = (conn_t **)mem_realloc((void *)table->active, cap * sizeof(conn_t *));
+    if(active == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    table->active     = active;
+    table->active_cap = cap;
+    return 0;
+}
+
+/* A free connection struct, carving a new slab when the free list is empty. */
+static conn_t *take_conn(conn_table_t *table)
+{
+    conn_t *conn;
+
+    if(table->spare_conns == NULL)
+    {
+        conn_slab_t *slab;
+
+        slab = (conn_slab_t *)mem_alloc_aligned(CONN_CACHE_LINE, sizeof(conn_slab_t));
+        if(slab == NULL)
+        {
+            return NULL;
+        }
+
+        slab->next   = table->slabs;
+        table->slabs = slab;
+        table->nslabs++;
+        for(size_t i = CONN_SLAB_SIZE; i > 0; i--)
+        {
+            put_conn(table, &slab->conns[i - 1]);
+        }
+    }
+
+    conn = table->spare_conns;
+    memcpy((void *)&table->spare_conns, (void *)conn, sizeof(table->spare_conns));
+    return conn;
+}
+
+static void put_conn(conn_table_t *table, conn_t *conn)
+{
+    memcpy((void *)conn, (void *)&table->spare_conns, sizeof(table->spare_conns));
+    table->spare_conns = conn;
+}
+
+conn_t *conn_add(conn_table_t *table, int fd, int *err)
+{
+    conn_t *conn;
+
+    if(fd < 0 || table->count >= table->max_clients)
+    {
+        *err = EMFILE;
+        return NULL;
+    }
+
+    if((size_t)fd >= table->slots_cap && grow_slots(table, (size_t)fd + 1, err) < 0)
+    {
+        return NULL;
+    }
+
+    if(table->count == table->active_cap && grow_active(table, err) < 0)
+    {
+        return NULL;
+    }
+
+    conn = take_conn(table);
+    if(conn == NULL)
+    {
+        *err = errno;
+        return NULL;
+    }
+
+    conn->fd           = fd;
+    conn->session_id   = -1;
+    conn->id           = ++table->next_id;
+    conn->pending      = 0;
+    conn->index        = table->count;
+    conn->from_id      = START;
+    conn->to_id        = REQUEST_HANDLER;
+    conn->request      = NULL;
+    conn->rbuf         = NULL;
+    conn->rcap         = 0;
+    conn->batch        = NULL;
+    conn->rlen         = 0;
+    conn->rpos         = 0;
+    conn->ring_fed     = 0;
+    conn->recv_armed   = 0;
+    conn->closing      = 0;
+    conn->read_paused  = 0;
+    conn->flush_queued = 0;
+    conn->read_closed  = 0;
+    conn->channels     = NULL;
+    conn->nchannels    = 0;
+    conn->out_head     = NULL;
+    conn->out_tail     = NULL;
+    conn->out_bytes    = 0;
+    timer_init(&conn->idle, NULL, conn);
+    timer_init(&conn->deadline, NULL, conn);
+
+    table->slots[fd]              = conn;
+    table->active[table->count++] = conn;
+    return conn;
+}
+
+conn_t *conn_get(const conn_table_t *table, int fd)
+{
+    if(fd < 0 || (size_t)fd >= table->slots_cap)
+    {
+        return NULL;
+    }
+    return table->slots[fd];
+}
+
+/*
+ * Closes the socket (which also drops it from any epoll set) and frees the slot.
+ * A chunk still owned by an io_uring send is left for its completion to free.
+ */
+void conn_close(conn_table_t *table, conn_t *conn)
+{
+    conn_t      *last;
+    out_chunk_t *chunk;
+
+    last                       = table->active[--table->count];
+    last->index                = conn->index;
+    table->active[conn->index] = last;
+
+    table->slots[conn->fd] = NULL;
+    timer_cancel(&conn->idle);
+    timer_cancel(&conn->deadline);
+    close(conn->fd);
+    if(conn->session_id >= 0)
+    {
+        online_leave((uint16_t)conn->session_id);
+        route_leave((uint16_t)conn->session_id, conn->fd, conn->id);
+    }
+    channel_leave_all(table, conn);
+    mem_free(conn->request);
+    conn_batch_done(table, conn);
+    if(conn->rcap == CONN_BUF_SIZE)
+    {
+        put_buf(table, conn->rbuf);
+    }
+    else
+    {
+        mem_free(conn->rbuf);
+    }
+
+    chunk = conn->out_head;
+    while(chunk != NULL)
+    {
+        out_chunk_t *next = chunk->next;
+
+        chunk->next = NULL;
+        if(!chunk->in_flight)
+        {
+            conn_free_chunk(table, chunk);
+        }
+        chunk = next;
+    }
+
+    put_conn(table, conn);
+}
+
+static void *take_buf(conn_table_t *table)
+{
+    void *buf;
+
+    if(table->spare_bufs == NULL)
+    {
+        return mem_alloc(CONN_BUF_SIZE);
+    }
+
+    buf = table->spare_bufs;
+    memcpy(&table->spare_bufs, buf, sizeof(table->spare_bufs));
+    table->nspare_bufs--;
+    return buf;
+}
+
+static void put_buf(conn_table_t *table, void *buf)
+{
+    if(table->nspare_bufs >= CONN_SPARE_MAX)
+    {
+        mem_free(buf);
+        return;
+    }
+
+    memcpy(buf, (void *)&table->spare_bufs, sizeof(table->spare_bufs));
+    table->spare_bufs = buf;
+    table->nspare_bufs++;
+}
+
+/* A chunk with room for `len` bytes; the common small ones come from the pool. */
+static out_chunk_t *take_chunk(conn_table_t *table, size_t len)
+{
+    out_chunk_t *chunk;
+    size_t       cap;
+
+    if(len <= CONN_BUF_SIZE && table->spare_chunks != NULL)
+    {
+        chunk               = table->spare_chunks;
+        table->spare_chunks = chunk->next;
+        table->nspare_chunks--;
+        return chunk;
+    }
+
+    cap   = (len <= CONN_BUF_SIZE) ? CONN_BUF_SIZE : len;
+    chunk = (out_chunk_t *)mem_alloc(sizeof(out_chunk_t) + cap);
+    if(chunk != NULL)
+    {
+        chunk->cap = cap;
+    }
+    return chunk;
+}
+
+/* A chunk that only points at a shared frame, so it needs no room of its own. */
+static out_chunk_t *take_ref(conn_table_t *table)
+{
+    out_chunk_t *chunk;
+
+    if(table->spare_refs != NULL)
+    {
+        chunk             = table->spare_refs;
+        table->spare_refs = chunk->next;
+        table->nspare_refs--;
+        return chunk;
+    }
+
+    chunk = (out_chunk_t *)mem_alloc(sizeof(out_chunk_t));
+    if(chunk != NULL)
+    {
+        chunk->cap = 0;
+    }
+    return chunk;
+}
+
+/*
+ * Returns a chunk to the pool, or to the heap when it is oversized or the pool is full.
+ * One that referenced a shared frame lets go of it.
+ */
+void conn_free_chunk(conn_table_t *table, out_chunk_t *chunk)
+{
+    if(chunk->frame != NULL)
+    {
+        fanout_release(chunk->frame);
+        chunk->frame = NULL;
+    }
+
+    if(chunk->cap == 0)
+    {
+        if(table->nspare_refs >= CONN_SPARE_MAX)
+        {
+            mem_free(chunk);
+            return;
+        }
+        chunk->next       = table->spare_refs;
+        table->spare_refs = chunk;
+        table->nspare_refs++;
+        return;
+    }
+
+    if(chunk->cap != CONN_BUF_SIZE || table->nspare_chunks >= CONN_SPARE_MAX)
+    {
+        mem_free(chunk);
+        return;
+    }
+
+    chunk->next         = table->spare_chunks;
+    table->spare_chunks = chunk;
+    table->nspare_chunks++;
+}
+
+/* Makes room for `need` bytes starting at the current frame, compacting before growing. */
+static int reserve_rbuf(conn_table_t *table, conn_t *conn, size_t need, int *err)
+{
+    uint8_t *buf;
+    size_t   cap;
+
+    if(conn->rcap - conn->rpos >= need)
+    {
+        return 0;
+    }
+
+    if(conn->rpos > 0)
+    {
+        memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+        conn->rlen -= conn->rpos;
+        conn->rpos  = 0;
+        if(conn->rcap >= need)
+        {
+            return 0;
+        }
+    }
+
+    if(conn->rbuf == NULL && need <= CONN_BUF_SIZE)
+    {
+        conn->rbuf = (uint8_t *)take_buf(table);
+        if(conn->rbuf == NULL)
+        {
+            *err = errno;
+            return -1;
+        }
+        conn->rcap = CONN_BUF_SIZE;
+        return 0;
+    }
+
+    // frames bigger than a pooled buffer get a private one, kept for as long as the connection
+    cap = conn->rcap ? conn->rcap : CONN_BUF_SIZE;
+    while(cap < need)
+    {
+        cap *= 2;
+    }
+
+    buf = (uint8_t *)mem_realloc(conn->rbuf, cap);
+    if(buf == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    conn->rbuf = buf;
+    conn->rcap = cap;
+    return 0;
+}
+
+/*
+ * Reads whatever the socket has until `need` bytes of the current frame are buffered.
+ * Returns 1 when they are, 0 when the socket ran dry first and -1 on EOF (err left as 0) or error.
+ */
+int conn_fill(conn_table_t *table, conn_t *conn, size_t need, int *err)
+{
+    if(conn->ring_fed)
+    {
+        return (conn->rlen - conn->rpos >= need) ? 1 : 0;
+    }
+
+    while(conn->rlen - conn->rpos < need)
+    {
+        ssize_t nread;
+
+        if(reserve_rbuf(table, conn, need, err) < 0)
+        {
+            return -1;
+        }
+
+        errno = 0;
+        nread = recv(conn->fd, conn->rbuf + conn->rlen, conn->rcap - conn->rlen, 0);
+        if(nread > 0)
+        {
+            conn->rlen += (size_t)nread;
+            continue;
+        }
+        if(nread == 0)
+        {
+            return -1;
+        }
+        if(errno == EINTR)
+        {
+            continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        *err = errno;
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Drops a fully handled frame from the front of the receive buffer, pooling the buffer once it is empty. */
+void conn_consume(conn_table_t *table, conn_t *conn, size_t size)
+{
+    conn->rpos += size;
+    if(conn->rpos >= conn->rlen)
+    {
+        conn->rpos = 0;
+        conn->rlen = 0;
+        if(conn->rcap == CONN_BUF_SIZE)
+        {
+            put_buf(table, conn->rbuf);
+            conn->rbuf = NULL;
+            conn->rcap = 0;
+        }
+    }
+}
+
+/* A CONN_BUF_SIZE buffer for the replies to a v3 envelope, kept until conn_batch_done. */
+uint8_t *conn_batch_buf(conn_table_t *table, conn_t *conn)
+{
+    if(conn->batch == NULL)
+    {
+        conn->batch = (uint8_t *)take_buf(table);
+    }
+    return conn->batch;
+}
+
+void conn_batch_done(conn_table_t *table, conn_t *conn)
+{
+    if(conn->batch != NULL)
+    {
+        put_buf(table, conn->batch);
+        conn->batch = NULL;
+    }
+}
+
+/* Appends bytes delivered by an io_uring receive behind whatever is already buffered. */
+int conn_append(conn_table_t *table, conn_t *conn, const void *data, size_t len, int *err)
+{
+    if(reserve_rbuf(table, conn, conn->rlen - conn->rpos + len, err) < 0)
+    {
+        return -1;
+    }
+
+    memcpy(conn->rbuf + conn->rlen, data, len);
+    conn->rlen += len;
+    return 0;
+}
+
+/*
+ * Gathers everything in `iov` past its first `skip` bytes onto the end of the outbound queue:
+ * into the tail chunk when it has room and is not being sent, otherwise into a new one.
+ */
+out_chunk_t *conn_queue(conn_table_t *table, conn_t *conn, const struct iovec *iov, int iovcnt, size_t skip)
+{
+    out_chunk_t *chunk;
+    size_t       len;
+
+    len = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+    len -= skip;
+
+    chunk = conn->out_tail;
+    if(chunk == NULL || chunk->in_flight || chunk->frame != NULL || chunk->cap - chunk->len < len)
+    {
+        chunk = take_chunk(table, len);
+        if(chunk == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return NULL;
+        }
+
+        chunk->frame = NULL;
+        chunk->len   = 0;
+        link_chunk(conn, chunk);
+    }
+
+    for(int i = 0; i < iovcnt; i++)
+    {
+        size_t part = iov[i].iov_len;
+
+        if(skip >= part)
+        {
+            skip -= part;
+            continue;
+        }
+        memcpy(chunk->data + chunk->len, (const uint8_t *)iov[i].iov_base + skip, part - skip);
+        chunk->len += part - skip;
+        skip = 0;
+    }
+
+    conn->out_bytes += len;
+    return chunk;
+}
+
+/*
+ * Queues `frame` by reference instead of copying it. The queue takes a reference of its own,
+ * dropped once the bytes are written or the connection closes.
+ */
+out_chunk_t *conn_queue_frame(conn_table_t *table, conn_t *conn, struct fanout_frame_t *frame)
+{
+    out_chunk_t *chunk;
+
+    chunk = take_ref(table);
+    if(chunk == NULL)
+    {
+        perror("Malloc failed to allocate memory\n");
+        return NULL;
+    }
+
+    fanout_hold(frame);
+    chunk->frame = frame;
+    chunk->len   = frame->len;
+    link_chunk(conn, chunk);
+
+    conn->out_bytes += frame->len;
+    return chunk;
+}
+
+/* Appends a fresh chunk to the outbound queue. */
+static void link_chunk(conn_t *conn, out_chunk_t *chunk)
+{
+    chunk->next      = NULL;
+    chunk->fd        = conn->fd;
+    chunk->conn_id   = conn->id;
+    chunk->in_flight = 0;
+    chunk->off       = 0;
+
+    if(conn->out_tail != NULL)
+    {
+        conn->out_tail->next = chunk;
+    }
+    else
+    {
+        conn->out_head = chunk;
+    }
+    conn->out_tail = chunk;
+}
+
+/* Where a chunk's bytes are: in the chunk itself or in the frame it shares. */
+const uint8_t *conn_chunk_bytes(const out_chunk_t *chunk)
+{
+    return (chunk->frame != NULL) ? chunk->frame->data : chunk->data;
+}
+
+/* Accounts for `size` bytes from the front of the queue having been written, freeing the chunks completed. */
+void conn_sent(conn_table_t *table, conn_t *conn, size_t size)
+{
+    conn->out_bytes -= size;
+    while(size > 0)
+    {
+        out_chunk_t *chunk = conn->out_head;
+        size_t       part  = chunk->len - chunk->off;
+
+        if(size < part)
+        {
+            chunk->off += size;
+            return;
+        }
+
+        size -= part;
+        conn->out_head = chunk->next;
+        if(conn->out_head == NULL)
+        {
+            conn->out_tail = NULL;
+        }
+        conn_free_chunk(table, chunk);
+    }
+}
+
+/* Writes as much of `iov` as the socket takes right now in one sendmsg and queues the rest behind it. */
+int conn_writev(conn_table_t *table, conn_t *conn, const struct iovec *iov, int iovcnt, int *err)
+{
+    struct msghdr msg;
+    ssize_t       nwrote;
+    size_t        total;
+
+    total = 0;
+    for(int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    nwrote = 0;
+    if(conn->out_head == NULL)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = (struct iovec *)(uintptr_t)iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+
+        do
+        {
+            nwrote = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while(nwrote < 0 && errno == EINTR);
+
+        if(nwrote < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                *err = errno;
+                return -1;
+            }
+            nwrote = 0;
+        }
+    }
+
+    // a short write leaves the tail for EPOLLOUT
+    if((size_t)nwrote < total && conn_queue(table, conn, iov, iovcnt, (size_t)nwrote) == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes queued bytes until the queue is empty or the socket is full, up to CONN_FLUSH_IOV
+ * chunks per sendmsg so that a client behind on broadcasts catches up in few calls.
+ * Returns 1 once drained, 0 when the socket would block and -1 on error.
+ */
+int conn_flush(conn_table_t *table, conn_t *conn, int *err)
+{
+    while(conn->out_head != NULL)
+    {
+        struct iovec  iov[CONN_FLUSH_IOV];
+        struct msghdr msg;
+        size_t        iovcnt;
+        ssize_t       nwrote;
+
+        iovcnt = 0;
+        for(const out_chunk_t *chunk = conn->out_head; chunk != NULL && iovcnt < CONN_FLUSH_IOV; chunk = chunk->next)
+        {
+            iov[iovcnt].iov_base = (void *)(uintptr_t)(conn_chunk_bytes(chunk) + chunk->off);
+            iov[iovcnt].iov_len  = chunk->len - chunk->off;
+            iovcnt++;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iovcnt;
+
+        nwrote = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(nwrote >= 0)
+        {
+            conn_sent(table, conn, (size_t)nwrote);
+            continue;
+        }
+        if(errno == EINTR)
+        {
+            continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        *err = errno;
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Walks the table to see what its connections hold. O(open connections), meant for on-demand dumps. */
+void conn_table_stats(const conn_table_t *table, conn_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->open         = table->count;
+    stats->slab_slots   = table->nslabs * CONN_SLAB_SIZE;
+    stats->slab_bytes   = table->nslabs * sizeof(conn_slab_t);
+    stats->spare_bufs   = table->nspare_bufs;
+    stats->spare_chunks = table->nspare_chunks;
+    stats->spare_refs   = table->nspare_refs;
+    stats->spare_bytes  = table->nspare_bufs * CONN_BUF_SIZE + table->nspare_chunks * (sizeof(out_chunk_t) + CONN_BUF_SIZE) + table->nspare_refs * sizeof(out_chunk_t);
+    stats->spare_bytes += table->nspare_joins * CHANNEL_PER_CONN * sizeof(conn_channel_t);
+
+    for(size_t i = 0; i < table->count; i++)
+    {
+        const conn_t *conn = table->active[i];
+
+        if(conn->request != NULL)
+        {
+            stats->busy++;
+        }
+        if(conn->rbuf != NULL)
+        {
+            stats->rbufs++;
+            stats->rbuf_bytes += conn->rcap;
+        }
+        stats->queued_bytes += conn->out_bytes;
+    }
+}
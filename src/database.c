@@ -129,6 +129,25 @@ void *retrieve_byte(DBM *db, const void *key, size_t size)
     return retrieved_str;
 }
 
+/* Like retrieve_byte, but the copy lives in the request's arena instead of on the heap; `len` gets its size. */
+void *retrieve_byte_arena(DBM *db, const void *key, size_t size, arena_t *arena, size_t *len)
+{
+    const_datum key_datum;
+    datum       result;
+
+    key_datum = MAKE_CONST_DATUM_BYTE(key, size);
+
+    result = dbm_fetch(db, *(datum *)&key_datum);
+
+    if(result.dptr == NULL)
+    {
+        return NULL;
+    }
+
+    *len = TO_SIZE_T(result.dsize);
+    return arena_memdup(arena, result.dptr, *len);
+}
+
 ssize_t init_pk(DBO *dbo, const char *pk_name, int *pk)
 {
     int err;
@@ -0,0 +1,50 @@
+#include "dispatch.h"
+#include "codec.h"
+#include <p101_c/p101_stdio.h>
+
+// filled by the modules' register calls before any reactor starts, read-only afterwards
+static dispatch_t dispatch_table[DISPATCH_TYPES];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Installs a module's handlers, up to its SYS_Success terminator. The payload bounds come from
+ * each entry's schema. Entries without a function are skipped, so their type stays unknown.
+ */
+int dispatch_register(const funcMapping functions[])
+{
+    for(size_t i = 0; functions[i].type != SYS_Success; i++)
+    {
+        const funcMapping *entry = &functions[i];
+        dispatch_t        *slot  = &dispatch_table[(uint8_t)entry->type];
+
+        if(entry->func == NULL)
+        {
+            continue;
+        }
+
+        if(slot->func != NULL)
+        {
+            fprintf(stderr, "dispatch: type %d registered twice\n", (int)entry->type);
+            return -1;
+        }
+
+        slot->func     = entry->func;
+        slot->blocking = entry->blocking;
+        slot->auth     = entry->auth;
+        slot->min_len  = 0;
+        slot->max_len  = 0;
+        if(entry->schema != NULL)
+        {
+            codec_bounds(entry->schema, &slot->min_len, &slot->max_len);
+        }
+    }
+
+    return 0;
+}
+
+const dispatch_t *dispatch_lookup(uint8_t type)
+{
+    const dispatch_t *slot;
+
+    slot = &dispatch_table[type];
+    return (slot->func != NULL) ? slot : NULL;
+}
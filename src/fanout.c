@@ -0,0 +1,94 @@
+#include "fanout.h"
+#include "mem.h"
+#include <p101_c/p101_stdio.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Released frames kept for the next broadcasts. Only creation and the last release take the lock. */
+typedef struct fanout_pool_t
+{
+    pthread_mutex_t lock;
+    fanout_frame_t *spares;
+    size_t          nspares;
+} fanout_pool_t;
+
+static fanout_pool_t pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Copies `data` into a frame holding one reference, which belongs to the caller. */
+fanout_frame_t *fanout_create(const void *data, size_t len)
+{
+    fanout_frame_t *frame;
+
+    frame = NULL;
+    if(len <= FANOUT_SIZE)
+    {
+        pthread_mutex_lock(&pool.lock);
+        frame = pool.spares;
+        if(frame != NULL)
+        {
+            pool.spares = frame->next;
+            pool.nspares--;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    if(frame == NULL)
+    {
+        size_t cap = (len <= FANOUT_SIZE) ? FANOUT_SIZE : len;
+
+        frame = (fanout_frame_t *)mem_alloc(sizeof(fanout_frame_t) + cap);
+        if(frame == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return NULL;
+        }
+        frame->cap = cap;
+    }
+
+    frame->next = NULL;
+    atomic_init(&frame->refs, 1);
+    frame->len = len;
+    memcpy(frame->data, data, len);
+    return frame;
+}
+
+void fanout_hold(fanout_frame_t *frame)
+{
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+
+/* Drops one reference; the last one puts the frame back in the pool. */
+void fanout_release(fanout_frame_t *frame)
+{
+    if(atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if(frame->cap == FANOUT_SIZE && pool.nspares < FANOUT_SPARE_MAX)
+    {
+        frame->next = pool.spares;
+        pool.spares = frame;
+        pool.nspares++;
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    mem_free(frame);
+}
+
+/* Frees the pool. Called once every reactor, and so every queue, is gone. */
+void fanout_destroy(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    while(pool.spares != NULL)
+    {
+        fanout_frame_t *next = pool.spares->next;
+
+        mem_free(pool.spares);
+        pool.spares = next;
+    }
+    pool.nspares = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,139 @@
+#include "frames.h"
+#include "messaging.h"
+#include "schema.h"
+#include <p101_c/p101_stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Every constant frame, laid out behind the two indexes that point into it. */
+typedef struct frame_store_t
+{
+    frame_t errors[FRAME_VALUES];    // SYS_Error for each code
+    frame_t acks[FRAME_VALUES];      // SYS_Success for each request type
+    uint8_t bytes[];
+} frame_store_t;
+
+typedef int (*frame_encoder)(response_t *res, uint8_t value);
+
+// written once by frames_init before any reactor starts, then mapped read-only
+static const frame_store_t *frames;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static int encode_error(response_t *res, uint8_t code)
+{
+    code_t       status;
+    const char  *msg;
+    codec_view_t fields[ERROR_FIELDS];
+
+    // server default to 0
+    response_start(res, SYS_Error, TWO, SERVER_ID);
+
+    status                 = (code_t)code;
+    msg                    = code_to_string(&status);
+    fields[ERROR_CODE].ptr = &code;
+    fields[ERROR_CODE].len = sizeof(code);
+    fields[ERROR_MSG].ptr  = (const uint8_t *)msg;
+    fields[ERROR_MSG].len  = (uint8_t)strlen(msg);
+    return codec_encode(&schema_error, fields, res);
+}
+
+static int encode_ack(response_t *res, uint8_t type)
+{
+    codec_view_t reply;
+
+    // server default to 0
+    response_start(res, SYS_Success, TWO, SERVER_ID);
+    reply.ptr = &type;
+    reply.len = sizeof(type);
+    return codec_encode(&schema_ack, &reply, res);
+}
+
+/*
+ * Encodes the frame for every byte value into `bytes` and indexes it, or only adds up the space
+ * they need when `bytes` is NULL. Returns the bytes used, or -1.
+ */
+static ssize_t encode_all(frame_encoder encode, frame_t *index, uint8_t *bytes)
+{
+    response_t   res;
+    struct iovec iov[RESPONSE_IOV_MAX];
+    size_t       used;
+
+    used = 0;
+    for(size_t value = 0; value < FRAME_VALUES; value++)
+    {
+        int iovcnt;
+
+        if(encode(&res, (uint8_t)value) < 0)
+        {
+            fprintf(stderr, "frames: cannot encode frame %zu\n", value);
+            return -1;
+        }
+
+        if(bytes != NULL)
+        {
+            index[value].data = bytes + used;
+            index[value].len  = response_size(&res);
+        }
+
+        iovcnt = response_iov(&res, iov);
+        for(int i = 0; i < iovcnt; i++)
+        {
+            if(bytes != NULL)
+            {
+                memcpy(bytes + used, iov[i].iov_base, iov[i].iov_len);
+            }
+            used += iov[i].iov_len;
+        }
+    }
+
+    return (ssize_t)used;
+}
+
+/*
+ * Encodes every error and acknowledgement frame the server can send into one mapping and makes
+ * it read-only, so handlers answer with a pointer and a length.
+ */
+int frames_init(void)
+{
+    frame_store_t *store;
+    ssize_t        errors_len;
+    ssize_t        acks_len;
+    size_t         size;
+
+    errors_len = encode_all(encode_error, NULL, NULL);
+    acks_len   = encode_all(encode_ack, NULL, NULL);
+    if(errors_len < 0 || acks_len < 0)
+    {
+        return -1;
+    }
+
+    size  = sizeof(*store) + (size_t)errors_len + (size_t)acks_len;
+    store = (frame_store_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(store == MAP_FAILED)
+    {
+        perror("mmap error");
+        return -1;
+    }
+
+    encode_all(encode_error, store->errors, store->bytes);
+    encode_all(encode_ack, store->acks, store->bytes + errors_len);
+
+    if(mprotect(store, size, PROT_READ) < 0)
+    {
+        perror("mprotect error");
+        munmap(store, size);
+        return -1;
+    }
+
+    frames = store;
+    return 0;
+}
+
+const frame_t *frame_error(uint8_t code)
+{
+    return &frames->errors[code];
+}
+
+const frame_t *frame_ack(uint8_t type)
+{
+    return &frames->acks[type];
+}
@@ -1,20 +1,149 @@
 #include "fsm.h"
+#include <inttypes.h>
 #include <stdio.h>
+#include <time.h>
 
-fsm_state_func fsm_transition(fsm_state_t from_id, fsm_state_t to_id, const struct fsm_transition transitions[], size_t transitions_size)
+#define FSM_HIST_SUB (1U << FSM_HIST_SUB_BITS)
+
+static size_t   bucket_of(uint64_t ns);
+static uint64_t bucket_top(size_t bucket);
+
+static const char *const state_names[FSM_STATES] = {
+    [START]            = "start",
+    [REQUEST_HANDLER]  = "request",
+    [HEADER_HANDLER]   = "header",
+    [BODY_HANDLER]     = "body",
+    [PROCESS_HANDLER]  = "process",
+    [RESPONSE_HANDLER] = "response",
+    [ERROR_HANDLER]    = "error",
+    [BATCH_HANDLER]    = "batch",
+    [YIELD]            = "yield",
+    [END]              = "end",
+};
+
+/* One lookup instead of a scan; anything outside the table is not a transition. */
+fsm_state_func fsm_transition(fsm_state_t from_id, fsm_state_t to_id, const fsm_table_t table)
+{
+    if((unsigned)from_id >= FSM_STATES || (unsigned)to_id >= FSM_STATES)
+    {
+        return NULL;
+    }
+
+    return table[from_id][to_id];
+}
+
+uint64_t fsm_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Below FSM_HIST_SUB the bucket is the value itself. Above it, each power of two is split into
+ * FSM_HIST_SUB buckets by the bits just under the leading one.
+ */
+static size_t bucket_of(uint64_t ns)
 {
-    fsm_state_func transition_func;
+    unsigned shift;
 
-    transition_func = NULL;
+    if(ns < FSM_HIST_SUB)
+    {
+        return (size_t)ns;
+    }
+
+    shift = (unsigned)(63 - __builtin_clzll(ns)) - FSM_HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << FSM_HIST_SUB_BITS) | (size_t)((ns >> shift) & (FSM_HIST_SUB - 1));
+}
+
+/* Largest value that lands in `bucket`. */
+static uint64_t bucket_top(size_t bucket)
+{
+    size_t   group;
+    uint64_t sub;
+
+    group = bucket >> FSM_HIST_SUB_BITS;
+    sub   = bucket & (FSM_HIST_SUB - 1);
+    if(group == 0)
+    {
+        return sub;
+    }
+
+    return ((((uint64_t)FSM_HIST_SUB | sub) + 1) << (group - 1)) - 1;
+}
+
+void fsm_record(fsm_stats_t *stats, fsm_state_t state, uint64_t ns)
+{
+    fsm_hist_t *hist;
 
-    for(size_t i = 0; i < transitions_size / sizeof(transitions[0]); i++)
+    if((unsigned)state >= FSM_STATES)
     {
-        if(transitions[i].from_id == from_id && transitions[i].to_id == to_id)
+        return;
+    }
+
+    hist = &stats->states[state];
+    hist->count++;
+    hist->total_ns += ns;
+    if(ns > hist->max_ns)
+    {
+        hist->max_ns = ns;
+    }
+    hist->buckets[bucket_of(ns)]++;
+}
+
+/* Upper bound of the bucket holding the pct-th percentile, never above the largest sample. */
+uint64_t fsm_percentile(const fsm_hist_t *hist, double pct)
+{
+    uint64_t rank;
+    uint64_t seen;
+
+    if(hist->count == 0)
+    {
+        return 0;
+    }
+
+    rank = (uint64_t)((double)hist->count * pct / 100.0);
+    if(rank >= hist->count)
+    {
+        rank = hist->count - 1;
+    }
+
+    seen = 0;
+    for(size_t i = 0; i < FSM_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if(seen > rank)
         {
-            transition_func = transitions[i].perform;
-            break;
+            uint64_t top = bucket_top(i);
+
+            return (top < hist->max_ns) ? top : hist->max_ns;
         }
     }
 
-    return transition_func;
+    return hist->max_ns;
+}
+
+/* One line per state that has run, prefixed like the reactor's other stats. */
+void fsm_print_stats(const fsm_stats_t *stats, size_t owner)
+{
+    for(int state = 0; state < FSM_STATES; state++)
+    {
+        const fsm_hist_t *hist = &stats->states[state];
+
+        if(hist->count == 0)
+        {
+            continue;
+        }
+
+        printf("reactor %zu: state %-8s n=%" PRIu64 " mean=%" PRIu64 "ns p50=%" PRIu64 "ns p99=%" PRIu64 "ns p99.9=%" PRIu64 "ns max=%" PRIu64 "ns\n",
+               owner,
+               state_names[state],
+               hist->count,
+               hist->total_ns / hist->count,
+               fsm_percentile(hist, 50.0),
+               fsm_percentile(hist, 99.0),
+               fsm_percentile(hist, 99.9),
+               hist->max_ns);
+    }
 }
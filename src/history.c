@@ -0,0 +1,762 @@
+#include "history.h"
+#include "channel.h"
+#include "fanout.h"
+#include "mem.h"
+#include "response.h"
+#include "threads.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <p101_c/p101_stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define HISTORY_BUCKETS 256
+#define HISTORY_PATH_MAX 4096
+#define HISTORY_WRITE_BATCH 64    // records gathered into one writev at most
+#define RECORD_HEAD 9             // sequence, frame length, name length
+
+_Static_assert(HISTORY_BATCH <= UINT8_MAX, "a page counts its messages in one byte");
+_Static_assert(HISTORY_PAGE_BYTES + 64 <= UINT16_MAX, "a page and its head must fit in one frame");
+_Static_assert((HISTORY_BUCKETS & (HISTORY_BUCKETS - 1)) == 0, "HISTORY_BUCKETS must be a power of two");
+
+/* A message as the channel's members were sent it. */
+typedef struct history_entry_t
+{
+    uint32_t               seq;
+    struct fanout_frame_t *frame;
+} history_entry_t;
+
+/* The last HISTORY_RING messages of one channel, oldest first from `head`. */
+typedef struct history_ring_t
+{
+    uint16_t        next;      // bucket chain, as slot + 1
+    uint16_t        head;
+    uint16_t        count;
+    uint8_t         name_len;
+    char            name[CHANNEL_NAME_MAX];
+    history_entry_t entries[HISTORY_RING];
+} history_ring_t;
+
+/*
+ * Every ring by channel name. Rings are kept by name rather than by channel id, as a channel
+ * closes with its last member and its history must outlive that.
+ */
+typedef struct history_t
+{
+    pthread_mutex_t lock;
+    uint16_t        buckets[HISTORY_BUCKETS];    // slot + 1 of the first ring in each chain
+    history_ring_t *rings[HISTORY_CHANNELS];
+    uint16_t        nrings;
+    uint32_t        seq;                         // last sequence handed out
+} history_t;
+
+/* A message waiting to be logged; holds a reference to its frame. */
+typedef struct history_record_t
+{
+    uint32_t               seq;
+    uint8_t                name_len;
+    char                   name[CHANNEL_NAME_MAX];
+    struct fanout_frame_t *frame;
+} history_record_t;
+
+/*
+ * The log and the queue feeding it. Appending only queues a record, so no reactor waits on the
+ * disk: one writer thread owns the segments and writes the records out in batches. Records are
+ * queued under the history lock, so they reach the log in sequence order.
+ */
+typedef struct history_log_t
+{
+    pthread_mutex_t  lock;                          // covers the queue, not the segments
+    pthread_cond_t   ready;
+    history_record_t queue[HISTORY_QUEUE];
+    size_t           head;
+    size_t           count;
+    size_t           dropped;                       // records the queue had no room for, not yet reported
+    int              stopping;
+    int              started;
+    pthread_t        thread;
+    const char      *dir;
+    int              fd;                            // segment being written, -1 until the first message
+    size_t           size;                          // and its length
+    uint32_t         segments[HISTORY_SEGMENTS];    // first sequence of each segment on disk, oldest first
+    size_t           nsegments;
+    int              failing;                       // a failure was reported; cleared by the next good write
+} history_log_t;
+
+static history_t history = {.lock = PTHREAD_MUTEX_INITIALIZER};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static history_log_t writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .fd = -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* FNV-1a, folded onto the buckets. */
+static size_t bucket_of(const char *name, uint8_t len)
+{
+    uint32_t hash;
+
+    hash = 2166136261U;
+    for(uint8_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    return hash & (HISTORY_BUCKETS - 1);
+}
+
+/* The named channel's ring, or NULL. Called with the lock held. */
+static history_ring_t *find_ring(const char *name, uint8_t len)
+{
+    for(uint16_t link = history.buckets[bucket_of(name, len)]; link != 0; link = history.rings[link - 1]->next)
+    {
+        history_ring_t *ring = history.rings[link - 1];
+
+        if(ring->name_len == len && memcmp(ring->name, name, len) == 0)
+        {
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+static uint32_t newest_seq(const history_ring_t *ring)
+{
+    return (ring->count == 0) ? 0 : ring->entries[(ring->head + ring->count - 1) % HISTORY_RING].seq;
+}
+
+/* Empties the ring that has gone quiet the longest and takes it off its chain, to be renamed. */
+static uint16_t reclaim_ring(void)
+{
+    history_ring_t *ring;
+    uint16_t       *link;
+    uint16_t        slot;
+
+    slot = 0;
+    for(uint16_t i = 1; i < history.nrings; i++)
+    {
+        if(newest_seq(history.rings[i]) < newest_seq(history.rings[slot]))
+        {
+            slot = i;
+        }
+    }
+
+    ring = history.rings[slot];
+    link = &history.buckets[bucket_of(ring->name, ring->name_len)];
+    while(*link != slot + 1)
+    {
+        link = &history.rings[*link - 1]->next;
+    }
+    *link = ring->next;
+
+    for(uint16_t i = 0; i < ring->count; i++)
+    {
+        fanout_release(ring->entries[(ring->head + i) % HISTORY_RING].frame);
+    }
+    return slot;
+}
+
+/* The named channel's ring, started empty if it has none. Called with the lock held. */
+static history_ring_t *add_ring(const char *name, uint8_t len)
+{
+    history_ring_t *ring;
+    uint16_t        slot;
+    size_t          bucket;
+
+    ring = find_ring(name, len);
+    if(ring != NULL)
+    {
+        return ring;
+    }
+
+    if(history.nrings < HISTORY_CHANNELS)
+    {
+        ring = (history_ring_t *)mem_alloc(sizeof(history_ring_t));
+        if(ring == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return NULL;
+        }
+        slot                = history.nrings++;
+        history.rings[slot] = ring;
+    }
+    else
+    {
+        slot = reclaim_ring();
+        ring = history.rings[slot];
+    }
+
+    ring->head     = 0;
+    ring->count    = 0;
+    ring->name_len = len;
+    memcpy(ring->name, name, len);
+
+    bucket                  = bucket_of(name, len);
+    ring->next              = history.buckets[bucket];
+    history.buckets[bucket] = (uint16_t)(slot + 1);
+    return ring;
+}
+
+/* Keeps a reference to the frame as the channel's newest message, letting go of its oldest when full. */
+static void push(history_ring_t *ring, uint32_t seq, struct fanout_frame_t *frame)
+{
+    history_entry_t *entry;
+
+    if(ring->count == HISTORY_RING)
+    {
+        fanout_release(ring->entries[ring->head].frame);
+        ring->head = (uint16_t)((ring->head + 1) % HISTORY_RING);
+        ring->count--;
+    }
+
+    fanout_hold(frame);
+    entry        = &ring->entries[(ring->head + ring->count) % HISTORY_RING];
+    entry->seq   = seq;
+    entry->frame = frame;
+    ring->count++;
+}
+
+static void segment_path(char *path, uint32_t first)
+{
+    snprintf(path, HISTORY_PATH_MAX, "%s/%010u.log", writer.dir, first);
+}
+
+/* Reports a failing log once, rather than for every message it loses. */
+static void log_failed(const char *what)
+{
+    if(!writer.failing)
+    {
+        perror(what);
+        writer.failing = 1;
+    }
+}
+
+/* Closes the segment being written and starts one named for `first`, deleting the oldest past HISTORY_SEGMENTS. */
+static int rotate(uint32_t first)
+{
+    char path[HISTORY_PATH_MAX];
+    int  fd;
+
+    segment_path(path, first);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd < 0)
+    {
+        log_failed("history: open segment");
+        return -1;
+    }
+
+    if(writer.fd >= 0)
+    {
+        close(writer.fd);
+    }
+    writer.fd   = fd;
+    writer.size = 0;
+
+    if(writer.nsegments == HISTORY_SEGMENTS)
+    {
+        segment_path(path, writer.segments[0]);
+        if(unlink(path) < 0)
+        {
+            perror("history: unlink segment");
+        }
+        memmove(writer.segments, writer.segments + 1, (HISTORY_SEGMENTS - 1) * sizeof(*writer.segments));
+        writer.nsegments--;
+    }
+    writer.segments[writer.nsegments++] = first;
+    return 0;
+}
+
+/*
+ * Writes out the records gathered in `iov`. The write goes to the page cache, not to the disk,
+ * so it costs a copy; records cut short are taken back out so the segment stays readable.
+ */
+static void flush(const struct iovec *iov, size_t niov, size_t bytes)
+{
+    ssize_t written;
+
+    if(niov == 0)
+    {
+        return;
+    }
+
+    written = writev(writer.fd, iov, (int)niov);
+    if(written == (ssize_t)bytes)
+    {
+        writer.size    += bytes;
+        writer.failing  = 0;
+        return;
+    }
+
+    if(written >= 0)
+    {
+        errno = ENOSPC;    // a file only comes up short when its disk is full
+    }
+    log_failed("history: write");
+    if(written > 0 && ftruncate(writer.fd, (off_t)writer.size) < 0)
+    {
+        perror("history: ftruncate");
+    }
+}
+
+/*
+ * Logs a batch of records, as few writes as the segments allow. Each record is its sequence
+ * and frame length big-endian, then the channel name behind its length byte, then the frame.
+ */
+static void write_batch(const history_record_t *batch, size_t n)
+{
+    uint8_t      heads[HISTORY_WRITE_BATCH][RECORD_HEAD + CHANNEL_NAME_MAX];
+    struct iovec iov[HISTORY_WRITE_BATCH * 2];
+    size_t       niov;
+    size_t       bytes;
+
+    niov  = 0;
+    bytes = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        const history_record_t *record = &batch[i];
+        size_t                  size   = RECORD_HEAD + record->name_len + record->frame->len;
+        uint32_t                seq_be;
+        uint32_t                len_be;
+
+        if(writer.fd < 0 || (writer.size + bytes > 0 && writer.size + bytes + size > HISTORY_SEGMENT_SIZE))
+        {
+            flush(iov, niov, bytes);
+            niov  = 0;
+            bytes = 0;
+            if(rotate(record->seq) < 0)
+            {
+                continue;
+            }
+        }
+
+        seq_be = htonl(record->seq);
+        len_be = htonl((uint32_t)record->frame->len);
+        memcpy(heads[i], &seq_be, sizeof(seq_be));
+        memcpy(heads[i] + sizeof(seq_be), &len_be, sizeof(len_be));
+        heads[i][RECORD_HEAD - 1] = record->name_len;
+        memcpy(heads[i] + RECORD_HEAD, record->name, record->name_len);
+
+        iov[niov].iov_base = heads[i];
+        iov[niov].iov_len  = RECORD_HEAD + record->name_len;
+        niov++;
+        iov[niov].iov_base = record->frame->data;
+        iov[niov].iov_len  = record->frame->len;
+        niov++;
+        bytes += size;
+    }
+    flush(iov, niov, bytes);
+}
+
+/* The writer thread: takes the queued records a batch at a time until stopped and drained. */
+static void *log_main(void *args)
+{
+    history_record_t batch[HISTORY_WRITE_BATCH];
+
+    (void)args;
+    while(1)
+    {
+        size_t n;
+        size_t dropped;
+
+        pthread_mutex_lock(&writer.lock);
+        while(writer.count == 0 && !writer.stopping)
+        {
+            pthread_cond_wait(&writer.ready, &writer.lock);
+        }
+        if(writer.count == 0)
+        {
+            pthread_mutex_unlock(&writer.lock);
+            break;
+        }
+
+        n = (writer.count < HISTORY_WRITE_BATCH) ? writer.count : HISTORY_WRITE_BATCH;
+        for(size_t i = 0; i < n; i++)
+        {
+            batch[i] = writer.queue[(writer.head + i) % HISTORY_QUEUE];
+        }
+        writer.head   = (writer.head + n) % HISTORY_QUEUE;
+        writer.count -= n;
+
+        // what the queue dropped is told once it has caught up, in one line
+        dropped = 0;
+        if(writer.count == 0)
+        {
+            dropped        = writer.dropped;
+            writer.dropped = 0;
+        }
+        pthread_mutex_unlock(&writer.lock);
+
+        write_batch(batch, n);
+        for(size_t i = 0; i < n; i++)
+        {
+            fanout_release(batch[i].frame);
+        }
+
+        if(dropped > 0)
+        {
+            fprintf(stderr, "history: %zu messages were not logged, the log fell behind\n", dropped);
+        }
+    }
+
+    return NULL;
+}
+
+/* Hands the message to the writer. A full queue leaves it out of the log; the ring still has it. */
+static void queue_record(uint32_t seq, const char *name, uint8_t len, struct fanout_frame_t *frame)
+{
+    history_record_t *record;
+
+    pthread_mutex_lock(&writer.lock);
+    if(writer.count == HISTORY_QUEUE || writer.stopping)
+    {
+        writer.dropped++;
+        pthread_mutex_unlock(&writer.lock);
+        return;
+    }
+
+    fanout_hold(frame);
+    record           = &writer.queue[(writer.head + writer.count) % HISTORY_QUEUE];
+    record->seq      = seq;
+    record->name_len = len;
+    record->frame    = frame;
+    memcpy(record->name, name, len);
+
+    // the writer only waits on an empty queue
+    if(writer.count++ == 0)
+    {
+        pthread_cond_signal(&writer.ready);
+    }
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/*
+ * Gives the message the next sequence and records it for the named channel, "" being the
+ * room: in the ring, by reference, and queued for the log. Returns the sequence, 0 when it
+ * could not be kept.
+ */
+uint32_t history_append(const char *name, uint8_t len, struct fanout_frame_t *frame)
+{
+    history_ring_t *ring;
+    uint32_t        seq;
+
+    pthread_mutex_lock(&history.lock);
+
+    ring = add_ring(name, len);
+    if(ring == NULL)
+    {
+        pthread_mutex_unlock(&history.lock);
+        return 0;
+    }
+
+    seq = ++history.seq;
+    push(ring, seq, frame);
+    queue_record(seq, name, len, frame);
+
+    pthread_mutex_unlock(&history.lock);
+    return seq;
+}
+
+/*
+ * Copies the channel's messages after `since` into `buf`, as the frames were sent, until
+ * `limit` messages or `cap` bytes. Messages older than the ring are gone: `oldest` above
+ * `since` + 1 tells the client it missed some.
+ */
+void history_page(const char *name, uint8_t len, uint32_t since, size_t limit, uint8_t *buf, size_t cap, history_page_t *page)
+{
+    const history_ring_t *ring;
+    uint16_t              low;
+    uint16_t              high;
+
+    page->count  = 0;
+    page->used   = 0;
+    page->last   = since;
+    page->oldest = 0;
+    page->more   = 0;
+
+    pthread_mutex_lock(&history.lock);
+
+    ring = find_ring(name, len);
+    if(ring == NULL || ring->count == 0)
+    {
+        pthread_mutex_unlock(&history.lock);
+        return;
+    }
+    page->oldest = ring->entries[ring->head].seq;
+
+    // sequences only grow along the ring, so the first one after `since` is found by halving
+    low  = 0;
+    high = ring->count;
+    while(low < high)
+    {
+        uint16_t mid = (uint16_t)((low + high) / 2);
+
+        if(ring->entries[(ring->head + mid) % HISTORY_RING].seq <= since)
+        {
+            low = (uint16_t)(mid + 1);
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for(; low < ring->count; low++)
+    {
+        const history_entry_t *entry = &ring->entries[(ring->head + low) % HISTORY_RING];
+
+        if(page->count == limit || page->used + entry->frame->len > cap)
+        {
+            page->more = 1;
+            break;
+        }
+        memcpy(buf + page->used, entry->frame->data, entry->frame->len);
+        page->used += entry->frame->len;
+        page->last = entry->seq;
+        page->count++;
+    }
+
+    pthread_mutex_unlock(&history.lock);
+}
+
+/*
+ * Reads back one segment into the rings. Returns the length of its readable records, which
+ * stop at the first one cut short by a crash, or -1 when it cannot be read.
+ */
+static ssize_t replay_segment(uint32_t first)
+{
+    char        path[HISTORY_PATH_MAX];
+    struct stat st;
+    uint8_t    *data;
+    size_t      off;
+    int         fd;
+
+    segment_path(path, first);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("history: open segment");
+        goto error;
+    }
+
+    data = (uint8_t *)mem_alloc((size_t)st.st_size + 1);
+    if(data == NULL)
+    {
+        perror("Malloc failed to allocate memory\n");
+        goto error;
+    }
+    if(read(fd, data, (size_t)st.st_size) != st.st_size)
+    {
+        perror("history: read segment");
+        mem_free(data);
+        goto error;
+    }
+    close(fd);
+
+    for(off = 0; off + RECORD_HEAD <= (size_t)st.st_size;)
+    {
+        struct fanout_frame_t *frame;
+        history_ring_t        *ring;
+        uint32_t               seq;
+        uint32_t               frame_len;
+        uint8_t                name_len;
+
+        memcpy(&seq, data + off, sizeof(seq));
+        memcpy(&frame_len, data + off + sizeof(seq), sizeof(frame_len));
+        seq       = ntohl(seq);
+        frame_len = ntohl(frame_len);
+        name_len  = data[off + RECORD_HEAD - 1];
+        if(seq <= history.seq || name_len > CHANNEL_NAME_MAX || frame_len < HEADER_SIZE || RECORD_HEAD + name_len + (size_t)frame_len > (size_t)st.st_size - off)
+        {
+            break;
+        }
+
+        // running out of memory is no reason to cut the log short, but it is to stop
+        ring  = add_ring((const char *)data + off + RECORD_HEAD, name_len);
+        frame = (ring == NULL) ? NULL : fanout_create(data + off + RECORD_HEAD + name_len, frame_len);
+        if(frame == NULL)
+        {
+            mem_free(data);
+            return -1;
+        }
+        push(ring, seq, frame);
+        fanout_release(frame);
+
+        history.seq  = seq;
+        off         += RECORD_HEAD + name_len + frame_len;
+    }
+
+    mem_free(data);
+    return (ssize_t)off;
+
+error:
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    return -1;
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Opens the log in `dir`, creating the directory if need be, and fills the rings back from
+ * the segments on disk, so a restart does not lose what clients may still ask for. The newest
+ * segment is written on, cut back to its last whole record.
+ */
+int history_init(const char *dir)
+{
+    uint32_t      *firsts;
+    size_t         nfirsts;
+    size_t         cap;
+    DIR           *dp;
+    struct dirent *ent;
+    ssize_t        good;
+
+    writer.dir = dir;
+    if(mkdir(dir, S_IRWXU) < 0 && errno != EEXIST)
+    {
+        perror("history: mkdir");
+        return -1;
+    }
+
+    dp = opendir(dir);
+    if(dp == NULL)
+    {
+        perror("history: opendir");
+        return -1;
+    }
+
+    firsts  = NULL;
+    nfirsts = 0;
+    cap     = 0;
+    while((ent = readdir(dp)) != NULL)
+    {
+        char         *end;
+        unsigned long first;
+
+        first = strtoul(ent->d_name, &end, 10);
+        if(end == ent->d_name || strcmp(end, ".log") != 0 || first == 0 || first > UINT32_MAX)
+        {
+            continue;
+        }
+
+        if(nfirsts == cap)
+        {
+            size_t    grown = (cap == 0) ? HISTORY_SEGMENTS : cap * 2;
+            uint32_t *more  = (uint32_t *)mem_realloc(firsts, grown * sizeof(*firsts));
+
+            if(more == NULL)
+            {
+                perror("Malloc failed to allocate memory\n");
+                mem_free(firsts);
+                closedir(dp);
+                return -1;
+            }
+            firsts = more;
+            cap    = grown;
+        }
+        firsts[nfirsts++] = (uint32_t)first;
+    }
+    closedir(dp);
+
+    if(nfirsts > 0)
+    {
+        qsort(firsts, nfirsts, sizeof(*firsts), compare_seq);
+    }
+
+    // segments past the newest HISTORY_SEGMENTS would have been deleted already, had the server run on
+    for(size_t i = 0; i < nfirsts; i++)
+    {
+        char path[HISTORY_PATH_MAX];
+
+        if(i + HISTORY_SEGMENTS < nfirsts)
+        {
+            segment_path(path, firsts[i]);
+            unlink(path);
+            continue;
+        }
+        writer.segments[writer.nsegments++] = firsts[i];
+    }
+    mem_free(firsts);
+
+    good = 0;
+    for(size_t i = 0; i < writer.nsegments; i++)
+    {
+        good = replay_segment(writer.segments[i]);
+        if(good < 0)
+        {
+            return -1;
+        }
+    }
+
+    if(writer.nsegments > 0)
+    {
+        char path[HISTORY_PATH_MAX];
+
+        segment_path(path, writer.segments[writer.nsegments - 1]);
+        writer.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if(writer.fd < 0 || ftruncate(writer.fd, (off_t)good) < 0)
+        {
+            perror("history: reopen segment");
+            return -1;
+        }
+        writer.size = (size_t)good;
+    }
+
+    if(start_thread(log_main, NULL, 0, &writer.thread) != 0)
+    {
+        return -1;
+    }
+    writer.started = 1;
+
+    printf("history: %u messages so far, %zu segments in %s\n", history.seq, writer.nsegments, dir);
+    return 0;
+}
+
+/* Lets the writer finish what is queued, then closes the log and lets go of the rings. Called once no reactor is left to append. */
+void history_destroy(void)
+{
+    if(writer.started)
+    {
+        pthread_mutex_lock(&writer.lock);
+        writer.stopping = 1;
+        pthread_cond_signal(&writer.ready);
+        pthread_mutex_unlock(&writer.lock);
+
+        errno = pthread_join(writer.thread, NULL);
+        if(errno != 0)
+        {
+            perror("history_destroy::pthread_join");
+        }
+        writer.started = 0;
+    }
+
+    for(uint16_t i = 0; i < history.nrings; i++)
+    {
+        history_ring_t *ring = history.rings[i];
+
+        for(uint16_t k = 0; k < ring->count; k++)
+        {
+            fanout_release(ring->entries[(ring->head + k) % HISTORY_RING].frame);
+        }
+        mem_free(ring);
+        history.rings[i] = NULL;
+    }
+    history.nrings = 0;
+    memset(history.buckets, 0, sizeof(history.buckets));
+
+    if(writer.fd >= 0)
+    {
+        close(writer.fd);
+        writer.fd = -1;
+    }
+    writer.nsegments = 0;
+}
@@ -1,77 +1,169 @@
 #include "io.h"
+#include "timer.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <p101_c/p101_stdio.h>
 #include <p101_c/p101_stdlib.h>
+#include <poll.h>
+#include <stdint.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 
-#define TIMEOUT 10000
-#define MILLI_SEC 1000
+#define TIMEOUT 10000    // 10s
 
-ssize_t read_fully(int fd, char *buf, size_t size, int *err)
+uint64_t io_deadline(int timeout_ms)
 {
-    ssize_t nread;
-    time_t  current;
-    time_t  end;
+    return timer_now_ms() + (uint64_t)timeout_ms;
+}
 
-    current = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
-    end     = current + TIMEOUT;
-    do
+/*
+ * Sleeps until fd is ready for events or the deadline passes. Returns 1 when ready, 0 on
+ * timeout and -1 on error. Errors and hangups count as ready: the next read or write reports them.
+ */
+int io_wait(int fd, short events, uint64_t deadline, int *err)
+{
+    struct pollfd pfd;
+
+    pfd.fd     = fd;
+    pfd.events = events;
+    while(1)
+    {
+        int timeout;
+        int ready;
+
+        timeout = -1;
+        if(deadline != IO_NO_DEADLINE)
+        {
+            uint64_t now;
+
+            now = timer_now_ms();
+            if(now >= deadline)
+            {
+                return 0;
+            }
+            timeout = deadline - now > INT_MAX ? INT_MAX : (int)(deadline - now);
+        }
+
+        pfd.revents = 0;
+        ready       = poll(&pfd, 1, timeout);
+        if(ready > 0)
+        {
+            return 1;
+        }
+        if(ready < 0 && errno != EINTR)
+        {
+            *err = errno;
+            return -1;
+        }
+    }
+}
+
+/*
+ * Reads until size bytes arrived or the peer closed, waiting for readiness before each attempt.
+ * Returns the bytes read, or IO_TIMEOUT with *err set to ETIMEDOUT once the deadline passes.
+ */
+ssize_t read_deadline(int fd, void *buf, size_t size, uint64_t deadline, int *err)
+{
+    uint8_t *ptr;
+    size_t   total;
+
+    ptr   = (uint8_t *)buf;
+    total = 0;
+    while(total < size)
     {
-        errno   = 0;
-        current = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
-        nread   = read(fd, buf, size);
+        ssize_t nread;
+        int     ready;
+
+        ready = io_wait(fd, POLLIN, deadline, err);
+        if(ready < 0)
+        {
+            return -1;
+        }
+        if(ready == 0)
+        {
+            *err = ETIMEDOUT;
+            return IO_TIMEOUT;
+        }
+
+        errno = 0;
+        nread = read(fd, ptr + total, size - total);
         if(nread == 0)
         {
             break;
         }
-        if(nread == -1)
+        if(nread < 0)
         {
-            if(errno == EINTR || errno == EAGAIN)
+            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                errno = 0;
                 continue;
             }
-            perror("read_fully error");
             *err = errno;
             return -1;
         }
-    } while(nread < (ssize_t)size && current <= end);
+        total += (size_t)nread;
+    }
 
-    return nread;
+    return (ssize_t)total;
 }
 
-ssize_t write_fully(int fd, void *buf, ssize_t size, int *err)
+/* Writes all of buf, waiting for room before each attempt; same results as read_deadline. */
+ssize_t write_deadline(int fd, const void *buf, size_t size, uint64_t deadline, int *err)
 {
-    time_t      current;
-    time_t      end;
-    ssize_t     bytes_wrote;
-    const char *ptr;
-
-    ptr         = (char *)buf;
-    bytes_wrote = 0;
-    current     = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
-    end         = current + TIMEOUT;
-    do
+    const uint8_t *ptr;
+    size_t         total;
+
+    ptr   = (const uint8_t *)buf;
+    total = 0;
+    while(total < size)
     {
-        ssize_t result;
-        current = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
+        ssize_t nwrote;
+        int     ready;
 
-        result = write(fd, ptr + bytes_wrote, (size_t)(size - bytes_wrote));
-        if(result == 0)
+        ready = io_wait(fd, POLLOUT, deadline, err);
+        if(ready < 0)
         {
-            break;
+            return -1;
+        }
+        if(ready == 0)
+        {
+            *err = ETIMEDOUT;
+            return IO_TIMEOUT;
         }
-        if(result == -1)
+
+        errno  = 0;
+        nwrote = write(fd, ptr + total, size - total);
+        if(nwrote < 0)
         {
+            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                continue;
+            }
             *err = errno;
             return -1;
         }
-        bytes_wrote += result;
-    } while(bytes_wrote < size && current <= end);
-    return bytes_wrote;
+        total += (size_t)nwrote;
+    }
+
+    return (ssize_t)total;
+}
+
+ssize_t read_fully(int fd, char *buf, size_t size, int *err)
+{
+    ssize_t nread;
+
+    nread = read_deadline(fd, buf, size, io_deadline(TIMEOUT), err);
+    if(nread == -1)
+    {
+        perror("read_fully error");
+    }
+
+    return nread;
+}
+
+ssize_t write_fully(int fd, void *buf, ssize_t size, int *err)
+{
+    return write_deadline(fd, buf, (size_t)size, io_deadline(TIMEOUT), err);
 }
 
 ssize_t copy(int from, int to, int *err)
@@ -96,7 +188,7 @@ ssize_t copy(int from, int to, int *err)
         }
         if(nread < 0)
         {
-            if(errno == EAGAIN)
+            if(errno == EAGAIN && io_wait(from, POLLIN, IO_NO_DEADLINE, err) == 1)
             {
                 continue;
             }
@@ -115,7 +207,7 @@ ssize_t copy(int from, int to, int *err)
             twrote    = write(to, buf + bytes_wrote, remaining);
             if(twrote < 0)
             {
-                if(errno == EAGAIN)
+                if(errno == EAGAIN && io_wait(to, POLLOUT, IO_NO_DEADLINE, err) == 1)
                 {
                     errno = 0;
                     continue;
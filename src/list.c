@@ -0,0 +1,115 @@
+#include "list.h"
+#include "dispatch.h"
+#include "online.h"
+#include "schema.h"
+#include <arpa/inet.h>
+#include <p101_c/p101_stdio.h>
+#include <string.h>
+
+static const funcMapping list_func[] = {
+    {LST_Get,     list_get, 0, 1, &schema_list_get},
+    {SYS_Success, NULL,     0, 0, NULL            }  // Null termination for safety
+};
+
+int list_register(void)
+{
+    return dispatch_register(list_func);
+}
+
+/*
+ * Answers with one page of the online users, starting at the first session id at or after
+ * `start`. The page is copied out of the index in one pass under its lock, so it is a consistent
+ * snapshot; `next` is where the following page starts and `generation` shows whether the list
+ * changed in between.
+ */
+ssize_t list_get(request_t *request)
+{
+    codec_view_t   fields[LIST_GET_FIELDS];
+    codec_view_t   head[LIST_PAGE_FIELDS];
+    online_user_t *users;
+    online_page_t  page;
+    uint16_t       start;
+    uint8_t        limit;
+    uint32_t       generation_be;
+    uint16_t       total_be;
+    uint16_t       next_be;
+    uint8_t        more;
+    uint8_t       *body;
+    size_t         cap;
+    ssize_t        used;
+
+    if(codec_decode(&schema_list_get, (const uint8_t *)request->content + HEADER_SIZE, request->len, fields) < 0)
+    {
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+    memcpy(&start, fields[LIST_START].ptr, sizeof(start));
+    start = ntohs(start);
+    limit = fields[LIST_LIMIT].ptr[0];
+    if(limit == 0 || limit > LIST_PAGE_MAX)
+    {
+        limit = LIST_PAGE_MAX;
+    }
+
+    users = (online_user_t *)arena_alloc(request->arena, limit * sizeof(*users));
+    if(users == NULL)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+    online_page(start, users, limit, &page);
+
+    // the whole page is referenced from scratch memory, which lasts until the reply is sent
+    cap  = CODEC_TL_SIZE * LIST_PAGE_FIELDS + sizeof(generation_be) + sizeof(total_be) + sizeof(next_be) + sizeof(more);
+    cap += page.count * (CODEC_TL_SIZE * LIST_USER_FIELDS + sizeof(uint16_t) + ONLINE_NAME_MAX);
+    body = (uint8_t *)arena_alloc(request->arena, cap);
+    if(body == NULL)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+
+    generation_be = htonl(page.generation);
+    total_be      = htons((uint16_t)page.total);
+    next_be       = htons((page.count > 0 && page.more) ? (uint16_t)(users[page.count - 1].id + 1) : 0);
+    more          = (uint8_t)page.more;
+
+    head[LIST_GENERATION].ptr = (const uint8_t *)&generation_be;
+    head[LIST_GENERATION].len = sizeof(generation_be);
+    head[LIST_TOTAL].ptr      = (const uint8_t *)&total_be;
+    head[LIST_TOTAL].len      = sizeof(total_be);
+    head[LIST_NEXT].ptr       = (const uint8_t *)&next_be;
+    head[LIST_NEXT].len       = sizeof(next_be);
+    head[LIST_MORE].ptr       = &more;
+    head[LIST_MORE].len       = sizeof(more);
+    used                      = codec_encode_buf(&schema_list_page, head, body, cap);
+
+    for(size_t i = 0; i < page.count && used >= 0; i++)
+    {
+        codec_view_t user[LIST_USER_FIELDS];
+        uint16_t     id_be = htons(users[i].id);
+        ssize_t      size;
+
+        user[LIST_USER_ID].ptr   = (const uint8_t *)&id_be;
+        user[LIST_USER_ID].len   = sizeof(id_be);
+        user[LIST_USER_NAME].ptr = (const uint8_t *)users[i].name;
+        user[LIST_USER_NAME].len = users[i].name_len;
+
+        size = codec_encode_buf(&schema_list_user, user, body + used, cap - (size_t)used);
+        used = (size < 0) ? -1 : used + size;
+    }
+
+    if(used < 0)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+
+    response_start(&request->response, LST_Response, TWO, SERVER_ID);
+    if(response_ref(&request->response, body, (size_t)used) < 0)
+    {
+        request->code = SERVER_ERROR;
+        return -1;
+    }
+    return 0;
+}
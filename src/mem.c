@@ -0,0 +1,60 @@
+#include "mem.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static atomic_size_t allocs;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static atomic_size_t frees;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static atomic_size_t messages;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+void *mem_alloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+/* `size` must be a multiple of `align`. */
+void *mem_alloc_aligned(size_t align, size_t size)
+{
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return aligned_alloc(align, size);
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    if(ptr != NULL)
+    {
+        atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+    }
+    return realloc(ptr, size);
+}
+
+void mem_free(void *ptr)
+{
+    if(ptr != NULL)
+    {
+        atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+        free(ptr);
+    }
+}
+
+void mem_count_message(void)
+{
+    atomic_fetch_add_explicit(&messages, 1, memory_order_relaxed);
+}
+
+void mem_get_stats(mem_stats_t *stats)
+{
+    stats->allocs   = atomic_load_explicit(&allocs, memory_order_relaxed);
+    stats->frees    = atomic_load_explicit(&frees, memory_order_relaxed);
+    stats->messages = atomic_load_explicit(&messages, memory_order_relaxed);
+}
+
+void mem_print_stats(void)
+{
+    mem_stats_t stats;
+
+    mem_get_stats(&stats);
+    printf("allocations: %zu (%zu freed, %zu live) over %zu messages\n", stats.allocs, stats.frees, stats.allocs - stats.frees, stats.messages);
+}
@@ -2,331 +2,1336 @@
 #include "account.h"
 #include "chat.h"
 #include "database.h"
+#include "dispatch.h"
+#include "fanout.h"
+#include "frames.h"
 #include "io.h"
+#include "mem.h"
+#include "networking.h"
+#include "online.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "route.h"
+#include "uring.h"
 #include "utils.h"
+#include "workers.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <memory.h>
-#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define TIMEOUT 3000    // 3s
+#define MAX_EVENTS 64
+#define ACCEPT_BUDGET 64    // connections taken per listener wakeup before other clients get a turn
+#define USER_COUNT_FLUSH_INTERVAL 5000    // 5s
+#define REQUEST_SPARE_MAX 256    // requests a reactor keeps for connections that start a frame
+#define REJECT_TIMEOUT 50    // ms the "too many clients" notice gets before the socket is closed
+
+// io_uring user_data: the operation in the low bits, the rest identifies its target
+#define URING_TAG_MASK 0xFULL
+#define URING_TAG_ACCEPT 0x1ULL
+#define URING_TAG_WAKE 0x2ULL
+#define URING_TAG_RECV 0x3ULL
+#define URING_TAG_SEND 0x4ULL
+#define URING_TAG_CANCEL 0x5ULL
+#define URING_ID_MASK 0x0FFFFFFFULL
+
+static ssize_t  offload_function(request_t *request);
+static void     close_client(reactor_t *reactor, conn_t *conn);
+static void     drop_client(conn_t *conn);
+static void     reject_client(int client_fd);
+static int      check_backlog(reactor_t *reactor, conn_t *conn);
+static int      uring_send_head(reactor_t *reactor, conn_t *conn);
+static int      uring_arm_recv(reactor_t *reactor, conn_t *conn);
+static uint64_t uring_recv_tag(const conn_t *conn);
+static void     uring_loop(reactor_t *reactor, int *err);
+static void     batch_add(request_t *request);
+static void     send_to_channel(reactor_t *reactor, uint32_t channel, fanout_frame_t *frame, int *err);
+static void     send_direct(reactor_t *reactor, int fd, uint64_t conn_id, fanout_frame_t *frame, int *err);
+
+// indexed by code; NULL for values that are not a code_t
+static const char *const code_map[UINT8_MAX + 1] = {
+    [OK]                = "",
+    [INVALID_USER_ID]   = "Invalid User ID",
+    [INVALID_AUTH]      = "Invalid Authentication Information",
+    [USER_EXISTS]       = "User Already exist",
+    [SERVER_ERROR]      = "Server Error",
+    [INVALID_REQUEST]   = "Invalid Request",
+    [REQUEST_TIMEOUT]   = "Request Timeout",
+    [RATE_LIMITED]      = "Rate Limited",
+    [NOT_IN_CHANNEL]    = "Not In Channel",
+    [TOO_MANY_CHANNELS] = "Too Many Channels",
+    [MAILBOX_FULL]      = "Mailbox Full",
+};
+
+const char *code_to_string(const code_t *code)
+{
+    if((unsigned)*code <= UINT8_MAX && code_map[*code] != NULL)
+    {
+        return code_map[*code];
+    }
+    return "UNKNOWN_STATUS";
+}
 
-static ssize_t execute_functions(request_t *request, const funcMapping functions[]);
+/* Maps the result of an io.h transfer onto the status a client would be sent for it. */
+code_t io_result_code(ssize_t result)
+{
+    if(result == IO_TIMEOUT)
+    {
+        return REQUEST_TIMEOUT;
+    }
+    if(result < 0)
+    {
+        return SERVER_ERROR;
+    }
+    return OK;
+}
 
-static const codeMapping code_map[] = {
-    {OK,              ""                                  },
-    {INVALID_USER_ID, "Invalid User ID"                   },
-    {INVALID_AUTH,    "Invalid Authentication Information"},
-    {USER_EXISTS,     "User Already exist"                },
-    {SERVER_ERROR,    "Server Error"                      },
-    {INVALID_REQUEST, "Invalid Request"                   },
-    {REQUEST_TIMEOUT, "Request Timeout"                   }
+// [from][to]: what runs on entering `to`; the edges into YIELD and END only end the walk
+static const fsm_table_t transitions = {
+    [START][REQUEST_HANDLER]            = request_handler,
+    [REQUEST_HANDLER][HEADER_HANDLER]   = header_handler,
+    [HEADER_HANDLER][BODY_HANDLER]      = body_handler,
+    [BODY_HANDLER][PROCESS_HANDLER]     = process_handler,
+    [PROCESS_HANDLER][RESPONSE_HANDLER] = response_handler,
+    [REQUEST_HANDLER][ERROR_HANDLER]    = error_handler,
+    [HEADER_HANDLER][ERROR_HANDLER]     = error_handler,
+    [BODY_HANDLER][ERROR_HANDLER]       = error_handler,
+    [PROCESS_HANDLER][ERROR_HANDLER]    = error_handler,
+    [BODY_HANDLER][BATCH_HANDLER]       = batch_handler,
+    [BATCH_HANDLER][PROCESS_HANDLER]    = process_handler,
+    [BATCH_HANDLER][ERROR_HANDLER]      = error_handler,
+    [RESPONSE_HANDLER][BATCH_HANDLER]   = batch_handler,
+    [ERROR_HANDLER][BATCH_HANDLER]      = batch_handler,
 };
 
-const char *code_to_string(const code_t *code)
-{
-    for(size_t i = 0; i < sizeof(code_map) / sizeof(code_map[0]); i++)
+/* Hands a blocking handler to the worker pool. Returns 1 when the request should run inline instead. */
+static ssize_t offload_function(request_t *request)
+{
+    job_t *job;
+
+    if(request->reactor->pool == NULL || !request->handler->blocking)
+    {
+        return 1;
+    }
+
+    job = job_create(request, request->handler->func);
+    if(job == NULL)
+    {
+        return -1;
+    }
+
+    if(worker_pool_submit(request->reactor->pool, job) < 0)
+    {
+        printf("worker queue full, rejecting request %d\n", request->type);
+        job_release(job);
+        return -1;
+    }
+
+    request->conn->pending = 1;
+    return 0;
+}
+
+/* Answers with the SYS_Error frame for request->code, encoded once at startup. */
+void error_response(request_t *request)
+{
+    const frame_t *frame;
+
+    frame = frame_error((uint8_t)request->code);
+    response_frame(&request->response, frame->data, frame->len);
+}
+
+/* Answers with the SYS_Success frame acknowledging the request's type. */
+void ack_response(request_t *request)
+{
+    const frame_t *frame;
+
+    frame = frame_ack(request->type);
+    response_frame(&request->response, frame->data, frame->len);
+}
+
+/*
+ * Keeps the online index and the direct message routes in step with a connection whose session
+ * went from `before` to what it is now, after `request` ran; the channels joined in a session
+ * end with it. Connections that close take their session with them in conn_close.
+ */
+static void session_changed(reactor_t *reactor, conn_t *conn, int before, const request_t *request)
+{
+    fanout_frame_t *queued[ROUTE_MAILBOX];
+    size_t          nqueued;
+    route_t         route;
+
+    if(before >= 0)
+    {
+        online_leave((uint16_t)before);
+        route_leave((uint16_t)before, conn->fd, conn->id);
+        channel_leave_all(&reactor->conns, conn);
+    }
+
+    if(conn->session_id < 0)
+    {
+        return;
+    }
+
+    if(online_join((uint16_t)conn->session_id, request->session_name, request->session_name_len) < 0)
+    {
+        fprintf(stderr, "online: cannot list user %d\n", conn->session_id);
+    }
+
+    route.reactor = reactor->id;
+    route.fd      = conn->fd;
+    route.conn_id = conn->id;
+    if(route_join((uint16_t)conn->session_id, &route, queued, &nqueued) < 0)
+    {
+        fprintf(stderr, "route: cannot route to user %d\n", conn->session_id);
+        return;
+    }
+
+    // what waited for the user goes out as mail to ourselves, so it follows the login reply
+    for(size_t i = 0; i < nqueued; i++)
+    {
+        reactor_post_direct(reactor, conn->fd, conn->id, queued[i]);
+        fanout_release(queued[i]);
+    }
+}
+
+/* Resets a request for the frame a connection is starting. */
+static void begin_frame(request_t *request, conn_t *conn, reactor_t *reactor)
+{
+    request->err              = 0;
+    request->disconnect       = 0;
+    request->type             = 0;
+    request->conn             = conn;
+    request->client_fd        = &conn->fd;
+    // user_id
+    request->session_id       = &conn->session_id;
+    request->user_count       = reactor->user_count;
+    request->len              = HEADER_SIZE;
+    request->reactor          = reactor;
+    request->content          = NULL;
+    request->code             = OK;
+    request->arena            = &reactor->arena;
+    request->handler          = NULL;
+    request->version          = 0;
+    request->frame_len        = 0;
+    request->batching         = 0;
+    request->batch_left       = 0;
+    request->session_name     = NULL;
+    request->session_name_len = 0;
+
+    // nothing outlives the handler that allocated it, so one arena serves every connection
+    arena_reset(&reactor->arena);
+    response_reset(&request->response);
+}
+
+/* Lends a connection one of the reactor's spare requests for the frame it is starting. */
+static request_t *lend_request(reactor_t *reactor, conn_t *conn)
+{
+    request_t *request;
+
+    if(conn->request != NULL)
+    {
+        return conn->request;
+    }
+
+    if(reactor->spare_reqs != NULL)
+    {
+        request = (request_t *)reactor->spare_reqs;
+        memcpy(&reactor->spare_reqs, (void *)request, sizeof(reactor->spare_reqs));
+        reactor->nspare_reqs--;
+    }
+    else
+    {
+        request = (request_t *)mem_alloc(sizeof(request_t));
+        if(request == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return NULL;
+        }
+    }
+
+    conn->request = request;
+    begin_frame(request, conn, reactor);
+    return request;
+}
+
+/* Keeps a request for the next connection that starts a frame. */
+static void stash_request(reactor_t *reactor, request_t *request)
+{
+    if(reactor->nspare_reqs >= REQUEST_SPARE_MAX)
+    {
+        mem_free(request);
+        return;
+    }
+
+    memcpy((void *)request, &reactor->spare_reqs, sizeof(reactor->spare_reqs));
+    reactor->spare_reqs = request;
+    reactor->nspare_reqs++;
+}
+
+/* Takes the request back once the connection has no frame in progress, so idle clients hold none. */
+static void return_request(reactor_t *reactor, conn_t *conn)
+{
+    if(conn->request == NULL || conn->pending || conn->from_id != START)
+    {
+        return;
+    }
+
+    stash_request(reactor, conn->request);
+    conn->request = NULL;
+}
+
+/* Serves every complete frame the client has sent and parks a partial one until more data arrives. Returns -1 when the connection should be closed. */
+static int serve_frames(conn_t *conn, reactor_t *reactor)
+{
+    request_t *request;
+
+    // the frame in flight is on a worker; the rest waits in the socket until it completes
+    if(conn->pending)
+    {
+        return 0;
+    }
+
+    // backpressure: leave further frames unread until the client catches up on its replies
+    if((conn->read_paused || conn->closing) && conn->from_id == START)
+    {
+        return 0;
+    }
+
+    request = lend_request(reactor, conn);
+    if(request == NULL)
+    {
+        return -1;
+    }
+
+    while(1)
+    {
+        fsm_state_func perform;
+        fsm_state_t    from_id;
+        fsm_state_t    to_id;
+
+        from_id = conn->from_id;
+        to_id   = conn->to_id;
+
+        if(from_id == START && (conn->read_paused || conn->closing))
+        {
+            return 0;
+        }
+
+        // fresh frame
+        if(from_id == START)
+        {
+            begin_frame(request, conn, reactor);
+        }
+
+        do
+        {
+            fsm_state_t next_id;
+            uint64_t    started;
+
+            perform = fsm_transition(from_id, to_id, transitions);
+            if(perform == NULL)
+            {
+                printf("illegal state %d, %d \n", from_id, to_id);
+                return -1;
+            }
+            started = fsm_now_ns();
+            next_id = perform(request);
+            fsm_record(&reactor->fsm_stats, to_id, fsm_now_ns() - started);
+            if(next_id == YIELD)
+            {
+                // partial frame: pick up from here on the next readiness event
+                conn->from_id = from_id;
+                conn->to_id   = to_id;
+                return 0;
+            }
+            from_id = to_id;
+            to_id   = next_id;
+        } while(to_id != END);
+
+        if(request->disconnect)
+        {
+            return -1;
+        }
+
+        conn_consume(&reactor->conns, conn, HEADER_SIZE + request->frame_len);
+        mem_count_message();
+        conn->from_id = START;
+        conn->to_id   = REQUEST_HANDLER;
+    }
+}
+
+/*
+ * Runs the FSM for a client and keeps its timers current: any activity pushes back the idle
+ * eviction, and a frame left half received gets CONN_READ_TIMEOUT to arrive in full.
+ */
+static int handle_client(conn_t *conn, reactor_t *reactor)
+{
+    timer_schedule(&reactor->timers, &conn->idle, (uint64_t)CONN_IDLE_TIMEOUT * 1000);
+
+    if(serve_frames(conn, reactor) < 0)
+    {
+        return -1;
+    }
+    return_request(reactor, conn);
+
+    // whatever is still buffered after a normal return is an incomplete frame
+    if(conn->rlen > conn->rpos && !conn->pending && !conn->read_paused && !conn->closing)
+    {
+        if(!conn->deadline.active)
+        {
+            timer_schedule(&reactor->timers, &conn->deadline, (uint64_t)CONN_READ_TIMEOUT * 1000);
+        }
+    }
+    else
+    {
+        timer_cancel(&conn->deadline);
+    }
+
+    // a client that hung up while a frame was on a worker or paused is closed once it is answered
+    if(conn->read_closed && !conn->pending && !conn->read_paused)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void idle_expired(void *owner, void *arg)
+{
+    conn_t *conn = (conn_t *)arg;
+
+    printf("evicting idle client %d\n", conn->fd);
+    close_client((reactor_t *)owner, conn);
+}
+
+/* The client started a frame and never finished it: say so and hang up. */
+static void read_deadline_expired(void *owner, void *arg)
+{
+    reactor_t *reactor = (reactor_t *)owner;
+    conn_t    *conn    = (conn_t *)arg;
+    request_t *request;
+
+    printf("request timeout on client %d\n", conn->fd);
+    request = lend_request(reactor, conn);
+    if(request != NULL)
+    {
+        request->code = REQUEST_TIMEOUT;
+        error_handler(request);
+    }
+    close_client(reactor, conn);
+}
+
+static void flush_user_count(void *owner, void *arg)
+{
+    reactor_t *reactor = (reactor_t *)owner;
+
+    (void)arg;
+    printf("syncing meta_user...\n");
+    // update user index
+    if(store_int(reactor->meta_userDB->db, USER_PK, atomic_load(reactor->user_count)) != 0)
+    {
+        perror("update user_index");
+    }
+    timer_schedule(&reactor->timers, &reactor->flush_timer, USER_COUNT_FLUSH_INTERVAL);
+}
+
+/* Starts the timers of a freshly accepted client and notes where it connects from. */
+static void watch_client(reactor_t *reactor, conn_t *conn)
+{
+    conn->peer = rate_peer(conn->fd);
+    timer_init(&conn->idle, idle_expired, conn);
+    timer_init(&conn->deadline, read_deadline_expired, conn);
+    timer_schedule(&reactor->timers, &conn->idle, (uint64_t)CONN_IDLE_TIMEOUT * 1000);
+}
+
+/* Prints the stats dump once per SIGUSR1, on the first pass of each loop after the signal. */
+static void answer_stats(reactor_t *reactor)
+{
+    if(reactor->stats_seen == stats_requested)
+    {
+        return;
+    }
+
+    reactor->stats_seen = stats_requested;
+    reactor_print_stats(reactor);
+    fsm_print_stats(&reactor->fsm_stats, reactor->id);
+    if(reactor->id == 0)
+    {
+        mem_print_stats();
+    }
+}
+
+/* Arms the periodic work every loop flavour shares. */
+static void start_timers(reactor_t *reactor)
+{
+    if(reactor->meta_userDB != NULL)
+    {
+        timer_init(&reactor->flush_timer, flush_user_count, NULL);
+        timer_schedule(&reactor->timers, &reactor->flush_timer, USER_COUNT_FLUSH_INTERVAL);
+    }
+}
+
+/* Resumes each connection whose blocking request finished on a worker. */
+static void deliver_completed(reactor_t *reactor)
+{
+    job_t *job;
+
+    job = reactor_take_completed(reactor);
+    while(job != NULL)
+    {
+        job_t     *next = job->next;
+        conn_t    *conn;
+        request_t *request;
+        int        before;
+
+        // the client may have gone (and its fd been reused) while the job ran
+        conn = conn_get(&reactor->conns, job->fd);
+        if(conn != NULL && conn->id == job->conn_id && conn->pending)
+        {
+            request = conn->request;
+
+            request->response = job->request.response;
+            request->code     = job->request.code;
+            request->err      = job->request.err;
+
+            // a failed handler starts no session, whatever it left in the job
+            before = conn->session_id;
+            if(job->result >= 0 && job->session_id != before)
+            {
+                conn->session_id = job->session_id;
+                session_changed(reactor, conn, before, &job->request);
+            }
+
+            conn->pending = 0;
+            conn->from_id = PROCESS_HANDLER;
+            conn->to_id   = (job->result < 0) ? ERROR_HANDLER : RESPONSE_HANDLER;
+
+            if(handle_client(conn, reactor) < 0)
+            {
+                close_client(reactor, conn);
+            }
+        }
+
+        job_release(job);
+        job = next;
+    }
+}
+
+/* Writes frames posted by other reactors to every connection this reactor owns. */
+static void deliver_mail(reactor_t *reactor)
+{
+    uint64_t count;
+    mail_t  *batch;
+    mail_t  *mail;
+    int      err;
+
+    // reset the eventfd before draining so a concurrent post is never missed
+    if(read(reactor->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("eventfd read error");
+    }
+
+    err   = 0;
+    batch = reactor_take_mail(reactor);
+    for(mail = batch; mail != NULL; mail = mail->next)
+    {
+        if(mail->fd >= 0)
+        {
+            send_direct(reactor, mail->fd, mail->conn_id, mail->frame, &err);
+            continue;
+        }
+        send_to_channel(reactor, mail->channel, mail->frame, &err);
+    }
+    reactor_recycle_mail(reactor, batch);
+}
+
+/*
+ * Queues a scattered frame for the client without ever blocking the reactor. Under epoll whatever
+ * the socket takes is written at once straight from `iov` and the rest waits for EPOLLOUT; under
+ * io_uring it is gathered into a send.
+ */
+int reactor_sendv(reactor_t *reactor, conn_t *conn, const struct iovec *iov, int iovcnt, int *err)
+{
+    if(conn->closing)
+    {
+        return 0;
+    }
+
+    if(reactor->ring == NULL)
+    {
+        if(conn_writev(&reactor->conns, conn, iov, iovcnt, err) < 0)
+        {
+            drop_client(conn);
+            return -1;
+        }
+    }
+    else
+    {
+        const out_chunk_t *chunk;
+
+        chunk = conn_queue(&reactor->conns, conn, iov, iovcnt, 0);
+        if(chunk == NULL)
+        {
+            *err = errno;
+            drop_client(conn);
+            return -1;
+        }
+
+        // one send in flight per connection keeps the bytes in order
+        if(chunk == conn->out_head && !chunk->in_flight && uring_send_head(reactor, conn) < 0)
+        {
+            *err = EIO;
+            drop_client(conn);
+            return -1;
+        }
+    }
+
+    return check_backlog(reactor, conn);
+}
+
+/*
+ * Queues a shared frame for the client by reference. Under epoll it is written when the loop
+ * pass ends, in one sendmsg with everything else the client was sent during the pass; under
+ * io_uring it goes out as a send of its own.
+ */
+int reactor_send_frame(reactor_t *reactor, conn_t *conn, fanout_frame_t *frame, int *err)
+{
+    const out_chunk_t *chunk;
+
+    if(conn->closing)
+    {
+        return 0;
+    }
+
+    chunk = conn_queue_frame(&reactor->conns, conn, frame);
+    if(chunk == NULL)
+    {
+        *err = errno;
+        drop_client(conn);
+        return -1;
+    }
+
+    if(reactor->ring == NULL)
+    {
+        conn->flush_queued     = 1;
+        reactor->flush_pending = 1;
+    }
+    else if(chunk == conn->out_head && uring_send_head(reactor, conn) < 0)
+    {
+        *err = EIO;
+        drop_client(conn);
+        return -1;
+    }
+
+    return check_backlog(reactor, conn);
+}
+
+/* Queues a shared frame for this reactor's clients in `channel`, or for all of them. */
+static void send_to_channel(reactor_t *reactor, uint32_t channel, fanout_frame_t *frame, int *err)
+{
+    const channel_members_t *members;
+
+    if(channel == CHANNEL_ALL)
+    {
+        for(size_t i = 0; i < reactor->conns.count; i++)
+        {
+            reactor_send_frame(reactor, reactor->conns.active[i], frame, err);
+        }
+        return;
+    }
+
+    members = channel_members(&reactor->conns, channel);
+    for(uint32_t i = 0; members != NULL && i < members->count; i++)
+    {
+        reactor_send_frame(reactor, members->conns[i], frame, err);
+    }
+}
+
+/* Queues a shared frame for one of this reactor's clients, unless it has gone since. */
+static void send_direct(reactor_t *reactor, int fd, uint64_t conn_id, fanout_frame_t *frame, int *err)
+{
+    conn_t *conn;
+
+    conn = conn_get(&reactor->conns, fd);
+    if(conn != NULL && conn->id == conn_id)
+    {
+        reactor_send_frame(reactor, conn, frame, err);
+    }
+}
+
+/* Sends a shared frame to the connection `route` names, handing it to the reactor that owns it. */
+void reactor_send_route(reactor_t *reactor, const route_t *route, fanout_frame_t *frame, int *err)
+{
+    if(route->reactor == reactor->id)
+    {
+        send_direct(reactor, route->fd, route->conn_id, frame, err);
+        return;
+    }
+    reactor_post_direct(&reactor->group[route->reactor], route->fd, route->conn_id, frame);
+}
+
+/*
+ * Sends a shared frame to the clients in `channel` on every reactor, or to all clients with
+ * CHANNEL_ALL. Each client's queue, here or on another reactor, holds a reference to it; the
+ * caller keeps its own.
+ */
+void reactor_broadcast(reactor_t *reactor, uint32_t channel, fanout_frame_t *frame, int *err)
+{
+    send_to_channel(reactor, channel, frame, err);
+
+    // clients of the other reactors are written by their own threads
+    for(size_t i = 0; i < reactor->group_size; i++)
+    {
+        reactor_t *peer = &reactor->group[i];
+
+        if(peer != reactor)
+        {
+            reactor_post(peer, channel, frame);
+        }
+    }
+}
+
+/* Drops a client whose queue has grown past all reason and pauses reading from one over the high watermark. */
+static int check_backlog(reactor_t *reactor, conn_t *conn)
+{
+    if(conn->out_bytes > reactor->out_high * CONN_OUT_DROP_FACTOR)
+    {
+        printf("dropping slow client %d: %zu bytes unsent\n", conn->fd, conn->out_bytes);
+        drop_client(conn);
+        return -1;
+    }
+
+    if(conn->out_bytes > reactor->out_high && !conn->read_paused)
+    {
+        conn->read_paused = 1;
+        if(reactor->ring != NULL && conn->recv_armed)
+        {
+            uring_prep_cancel(reactor->ring, uring_recv_tag(conn), URING_TAG_CANCEL);
+        }
+    }
+
+    return 0;
+}
+
+int reactor_send(reactor_t *reactor, conn_t *conn, const void *buf, size_t len, int *err)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)(uintptr_t)buf;
+    iov.iov_len  = len;
+    return reactor_sendv(reactor, conn, &iov, 1, err);
+}
+
+/*
+ * Picks up reading again once a paused client's queue is down to the low watermark.
+ * Returns 1 when reading resumed.
+ */
+static int resume_client(const reactor_t *reactor, conn_t *conn)
+{
+    if(!conn->read_paused || conn->out_bytes > reactor->out_low)
+    {
+        return 0;
+    }
+
+    conn->read_paused = 0;
+    return 1;
+}
+
+/*
+ * Closes a client. One with replies still queued stops reading but stays open until they are
+ * written; under io_uring the receive still armed on it is cut short as well.
+ */
+static void close_client(reactor_t *reactor, conn_t *conn)
+{
+    if(conn->out_head != NULL && !conn->closing)
+    {
+        shutdown(conn->fd, SHUT_RD);
+        conn->closing = 1;
+        return;
+    }
+
+    if(reactor->ring != NULL)
+    {
+        shutdown(conn->fd, SHUT_RD);
+    }
+
+    // a job still running has its own copy of the request
+    if(conn->request != NULL)
+    {
+        stash_request(reactor, conn->request);
+        conn->request = NULL;
+    }
+    conn_close(&reactor->conns, conn);
+}
+
+/*
+ * Abandons a client that cannot keep up or whose socket failed. Safe while its own request is
+ * running: the hangup makes the event loop close it on a later pass.
+ */
+static void drop_client(conn_t *conn)
+{
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->closing = 1;
+}
+
+/* Turns away a client the connection table has no room for. */
+static void reject_client(int client_fd)
+{
+    char    too_many[] = "Too many clients, rejecting connection\n";
+    ssize_t result;
+    code_t  code;
+    int     err;
+
+    printf("%s", too_many);
+    err    = 0;
+    result = write_deadline(client_fd, too_many, strlen(too_many), io_deadline(REJECT_TIMEOUT), &err);
+    code   = io_result_code(result);
+    if(code != OK)
+    {
+        fprintf(stderr, "reject_client: %s: %s\n", code_to_string(&code), strerror(err));
+    }
+
+    close(client_fd);
+}
+
+static uint64_t uring_recv_tag(const conn_t *conn)
+{
+    return ((uint64_t)(uint32_t)conn->fd << 32) | ((conn->id & URING_ID_MASK) << 4) | URING_TAG_RECV;
+}
+
+/* Connection a receive completion belongs to, or NULL when it has been closed (and its fd maybe reused). */
+static conn_t *uring_recv_conn(const conn_table_t *conns, uint64_t user_data)
+{
+    conn_t *conn;
+
+    conn = conn_get(conns, (int)(user_data >> 32));
+    if(conn == NULL || (conn->id & URING_ID_MASK) != ((user_data >> 4) & URING_ID_MASK))
+    {
+        return NULL;
+    }
+    return conn;
+}
+
+static int uring_arm_recv(reactor_t *reactor, conn_t *conn)
+{
+    if(uring_prep_recv_multishot(reactor->ring, conn->fd, uring_recv_tag(conn)) < 0)
+    {
+        return -1;
+    }
+    conn->recv_armed = 1;
+    return 0;
+}
+
+static int uring_send_head(reactor_t *reactor, conn_t *conn)
+{
+    out_chunk_t *chunk;
+
+    chunk = conn->out_head;
+    if(uring_prep_send(reactor->ring, conn->fd, conn_chunk_bytes(chunk) + chunk->off, chunk->len - chunk->off, (uint64_t)(uintptr_t)chunk | URING_TAG_SEND) < 0)
+    {
+        return -1;
+    }
+    chunk->in_flight = 1;
+    return 0;
+}
+
+static void uring_accept(reactor_t *reactor, int client_fd)
+{
+    conn_t *conn;
+    int     err;
+
+    err  = 0;
+    conn = conn_add(&reactor->conns, client_fd, &err);
+    if(conn == NULL)
+    {
+        reject_client(client_fd);
+        return;
+    }
+
+    conn->ring_fed = 1;
+    watch_client(reactor, conn);
+    if(uring_arm_recv(reactor, conn) < 0)
+    {
+        conn_close(&reactor->conns, conn);
+    }
+}
+
+/* Copies what a multishot receive delivered into the connection and runs the FSM over it. */
+static void uring_recv(reactor_t *reactor, const struct io_uring_cqe *cqe)
+{
+    conn_t *conn;
+    int     err;
+
+    err  = 0;
+    conn = uring_recv_conn(&reactor->conns, cqe->user_data);
+
+    if(cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if(conn != NULL && cqe->res > 0 && conn_append(&reactor->conns, conn, uring_buffer(reactor->ring, bid), (size_t)cqe->res, &err) < 0)
+        {
+            perror("conn_append error");
+            close_client(reactor, conn);
+            conn = NULL;
+        }
+        uring_recycle(reactor->ring, bid);
+    }
+
+    if(conn == NULL)
+    {
+        return;
+    }
+
+    if(!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_armed = 0;
+    }
+
+    if(cqe->res > 0)
+    {
+        if(handle_client(conn, reactor) < 0)
+        {
+            close_client(reactor, conn);
+            return;
+        }
+    }
+    else if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED && !conn->closing)
+    {
+        // 0 is an orderly shutdown by the peer, which still gets its replies to what it sent
+        if(cqe->res == 0 && (conn->pending || conn->read_paused))
+        {
+            conn->read_closed = 1;
+            return;
+        }
+        close_client(reactor, conn);
+        return;
+    }
+
+    if(conn->closing)
+    {
+        // dropped with nothing left to send: nothing else will close it
+        if(conn->out_head == NULL)
+        {
+            conn_close(&reactor->conns, conn);
+        }
+        return;
+    }
+
+    // the kernel ends a multishot receive when it runs out of buffers or is cancelled by a pause
+    if(!conn->recv_armed && !conn->read_paused && !conn->read_closed && uring_arm_recv(reactor, conn) < 0)
+    {
+        close_client(reactor, conn);
+    }
+}
+
+static void uring_sent(reactor_t *reactor, const struct io_uring_cqe *cqe)
+{
+    out_chunk_t *chunk;
+    conn_t      *conn;
+
+    chunk            = (out_chunk_t *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+    chunk->in_flight = 0;
+
+    conn = conn_get(&reactor->conns, chunk->fd);
+    if(conn == NULL || conn->id != chunk->conn_id || conn->out_head != chunk)
+    {
+        // the connection closed while the send was in flight
+        conn_free_chunk(&reactor->conns, chunk);
+        return;
+    }
+
+    if(cqe->res < 0)
+    {
+        conn_close(&reactor->conns, conn);
+        return;
+    }
+
+    conn_sent(&reactor->conns, conn, (size_t)cqe->res);
+    if(conn->out_head == NULL && conn->closing)
+    {
+        conn_close(&reactor->conns, conn);
+        return;
+    }
+
+    if(conn->out_head != NULL && uring_send_head(reactor, conn) < 0)
+    {
+        conn_close(&reactor->conns, conn);
+        return;
+    }
+
+    if(resume_client(reactor, conn))
     {
-        if(code_map[i].code == *code)
+        if(!conn->recv_armed && !conn->read_closed && uring_arm_recv(reactor, conn) < 0)
         {
-            return code_map[i].msg;
+            close_client(reactor, conn);
+            return;
+        }
+        if(handle_client(conn, reactor) < 0)
+        {
+            close_client(reactor, conn);
         }
     }
-    return "UNKNOWN_STATUS";
 }
 
-static const struct fsm_transition transitions[] = {
-    {START,            REQUEST_HANDLER,  request_handler },
-    {REQUEST_HANDLER,  HEADER_HANDLER,   header_handler  },
-    {HEADER_HANDLER,   BODY_HANDLER,     body_handler    },
-    {BODY_HANDLER,     PROCESS_HANDLER,  process_handler },
-    {PROCESS_HANDLER,  RESPONSE_HANDLER, response_handler},
-    {RESPONSE_HANDLER, END,              NULL            },
-    {REQUEST_HANDLER,  ERROR_HANDLER,    error_handler   },
-    {HEADER_HANDLER,   ERROR_HANDLER,    error_handler   },
-    {BODY_HANDLER,     ERROR_HANDLER,    error_handler   },
-    {PROCESS_HANDLER,  ERROR_HANDLER,    error_handler   },
-    {ERROR_HANDLER,    END,              NULL            },
-};
-
-static ssize_t execute_functions(request_t *request, const funcMapping functions[])
+static void uring_dispatch(reactor_t *reactor, const struct io_uring_cqe *cqe)
 {
-    for(size_t i = 0; functions[i].type != SYS_Success; i++)
+    switch(cqe->user_data & URING_TAG_MASK)
     {
-        if(request->type == functions[i].type)
-        {
-            return functions[i].func(request);
-        }
+        case URING_TAG_ACCEPT:
+            if(cqe->res >= 0)
+            {
+                uring_accept(reactor, cqe->res);
+            }
+            else
+            {
+                errno = -cqe->res;
+                perror("Accept failed");
+            }
+            if(!(cqe->flags & IORING_CQE_F_MORE) && uring_prep_accept_multishot(reactor->ring, reactor->server_fd, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_TAG_ACCEPT) < 0)
+            {
+                running = 0;
+            }
+            break;
+        case URING_TAG_WAKE:
+            deliver_mail(reactor);
+            deliver_completed(reactor);
+            if(!(cqe->flags & IORING_CQE_F_MORE) && uring_prep_poll_multishot(reactor->ring, reactor->wakefd, URING_TAG_WAKE) < 0)
+            {
+                running = 0;
+            }
+            break;
+        case URING_TAG_RECV:
+            uring_recv(reactor, cqe);
+            break;
+        case URING_TAG_SEND:
+            uring_sent(reactor, cqe);
+            break;
+        default:
+            break;
     }
-    printf("Not builtin command: %d\n", *(uint8_t *)request->content);
-    return 1;
 }
 
-void error_response(request_t *request)
+/*
+ * The io_uring flavour of event_loop: a multishot accept on the listener, a multishot receive into
+ * provided buffers per client, and every send queued during one pass submitted with the next wait.
+ */
+static void uring_loop(reactor_t *reactor, int *err)
 {
-    char *ptr;
+    uring_t ring;
 
-    // server default to 0
-    uint16_t    sender_id = SERVER_ID;
-    const char *msg;
-    uint8_t     msg_len;
+    if(uring_init(&ring, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE, err) < 0)
+    {
+        fprintf(stderr, "uring_loop: io_uring is unavailable\n");
+        running = 0;
+        return;
+    }
+    reactor->ring = &ring;
 
-    ptr = (char *)request->response;
-    // tag
-    *ptr++ = SYS_Error;
-    // version
-    *ptr++ = TWO;
+    if(uring_prep_accept_multishot(&ring, reactor->server_fd, SOCK_NONBLOCK | SOCK_CLOEXEC, URING_TAG_ACCEPT) < 0 || uring_prep_poll_multishot(&ring, reactor->wakefd, URING_TAG_WAKE) < 0)
+    {
+        running = 0;
+    }
 
-    // sender_id
-    sender_id = htons(sender_id);
-    memcpy(ptr, &sender_id, sizeof(sender_id));
-    ptr += sizeof(sender_id);
+    start_timers(reactor);
 
-    msg     = code_to_string(&request->code);
-    msg_len = (uint8_t)strlen(msg);
+    while(running)
+    {
+        struct io_uring_cqe *cqe;
+        int                  wait_err;
 
-    request->response_len = (uint16_t)(request->response_len + (sizeof(uint8_t) + sizeof(uint8_t) + msg_len));
+        answer_stats(reactor);
+        wait_err = 0;
+        if(uring_submit_and_wait(&ring, timer_wheel_timeout(&reactor->timers, timer_now_ms(), TIMEOUT), &wait_err) < 0 && wait_err != ETIME)
+        {
+            if(wait_err == EINTR)
+            {
+                continue;
+            }
+            errno = wait_err;
+            perror("io_uring_enter error");
+            *err = wait_err;
+            break;
+        }
 
-    // payload len
-    request->response_len = htons(request->response_len);
-    memcpy(ptr, &request->response_len, sizeof(request->response_len));
-    ptr += sizeof(request->response_len);
+        // brought up to date before anything is handled, so timers armed meanwhile count from now
+        timer_wheel_advance(&reactor->timers, timer_now_ms());
 
-    *ptr++ = INTEGER;
-    *ptr++ = sizeof(uint8_t);
+        while((cqe = uring_peek(&ring)) != NULL)
+        {
+            struct io_uring_cqe done;
 
-    memcpy(ptr, &request->code, sizeof(uint8_t));
-    ptr += sizeof(uint8_t);
+            // release the slot first: handling may queue more work
+            done = *cqe;
+            uring_advance(&ring);
+            uring_dispatch(reactor, &done);
+        }
+    }
 
-    *ptr++ = UTF8STRING;
-    memcpy(ptr, &msg_len, sizeof(msg_len));
-    ptr += sizeof(msg_len);
+    // tearing the ring down cancels every send, so their chunks go back to the connections
+    uring_destroy(&ring);
+    reactor->ring = NULL;
+    for(size_t i = 0; i < reactor->conns.count; i++)
+    {
+        for(out_chunk_t *chunk = reactor->conns.active[i]->out_head; chunk != NULL; chunk = chunk->next)
+        {
+            chunk->in_flight = 0;
+        }
+    }
 
-    memcpy(ptr, msg, msg_len);
+    for(size_t i = 0; i < reactor->group_size; i++)
+    {
+        if(&reactor->group[i] != reactor)
+        {
+            reactor_wake(&reactor->group[i]);
+        }
+    }
 }
 
-void event_loop(int server_fd, int *err)
+/*
+ * Writes out what broadcasts queued during the loop pass. A client whose socket fills up is
+ * finished by EPOLLOUT as usual; one that drained below the low watermark starts reading again.
+ */
+static void flush_clients(reactor_t *reactor)
 {
-    struct pollfd fds[MAX_FDS];
-    int           sessions[MAX_FDS];
-    int           client_fd;
-    int           added;
-    int           user_count;
-    char          db_name[] = "meta_user";
-    DBO           meta_userDB;
-    ssize_t       result;
+    int err;
 
-    meta_userDB.name = db_name;
+    err                    = 0;
+    reactor->flush_pending = 0;
 
-    if(init_pk(&meta_userDB, USER_PK, &user_count) < 0)
+    // backwards, so a client closed here swaps in one that is already done
+    for(size_t i = reactor->conns.count; i-- > 0;)
     {
-        perror("init_pk error\n");
-        goto cleanup;
+        conn_t *conn = reactor->conns.active[i];
+
+        if(!conn->flush_queued)
+        {
+            continue;
+        }
+        conn->flush_queued = 0;
+
+        if(conn_flush(&reactor->conns, conn, &err) < 0)
+        {
+            drop_client(conn);
+            continue;
+        }
+
+        if(conn->closing)
+        {
+            if(conn->out_head == NULL)
+            {
+                close_client(reactor, conn);
+            }
+            continue;
+        }
+
+        if(resume_client(reactor, conn) && handle_client(conn, reactor) < 0)
+        {
+            close_client(reactor, conn);
+        }
     }
+}
+
+/*
+ * Drains the listen queue with accept4 until it is empty or ACCEPT_BUDGET connections have been
+ * taken; the listener is level-triggered, so whatever is left brings the next epoll_wait back here.
+ */
+static void accept_clients(reactor_t *reactor)
+{
+    struct epoll_event ev;
+    int                err;
 
-    if(database_open(&meta_userDB, err) < 0)
+    err = 0;
+    for(int accepted = 0; accepted < ACCEPT_BUDGET; accepted++)
     {
-        perror("database error");
-        goto cleanup;
+        conn_t *conn;
+        int     client_fd;
+
+        client_fd = accept4(reactor->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        conn = conn_add(&reactor->conns, client_fd, &err);
+        if(conn == NULL)
+        {
+            reject_client(client_fd);
+            continue;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events  = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_fd;
+        if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
+        {
+            perror("epoll_ctl error");
+            conn_close(&reactor->conns, conn);
+            continue;
+        }
+        watch_client(reactor, conn);
     }
+}
+
+void event_loop(reactor_t *reactor, int *err)
+{
+    struct epoll_event events[MAX_EVENTS];
+    conn_table_t      *conns;
+    int                nready;
 
-    fds[0].fd     = server_fd;
-    fds[0].events = POLLIN;
-    for(int i = 1; i < MAX_FDS; i++)
+    if(reactor->use_uring)
     {
-        fds[i].fd   = -1;
-        sessions[i] = -1;
+        uring_loop(reactor, err);
+        return;
     }
 
+    conns = &reactor->conns;
+    start_timers(reactor);
+
     while(running)
     {
+        // nothing a broadcast queued waits out an epoll_wait
+        while(reactor->flush_pending)
+        {
+            flush_clients(reactor);
+        }
+
+        answer_stats(reactor);
         errno  = 0;
-        result = poll(fds, MAX_FDS, TIMEOUT);
-        if(result == -1)
+        nready = epoll_wait(reactor->epfd, events, MAX_EVENTS, timer_wheel_timeout(&reactor->timers, timer_now_ms(), TIMEOUT));
+        if(nready == -1)
         {
             if(errno == EINTR)
             {
-                goto cleanup;
+                continue;
             }
-            perror("Poll error");
-            goto cleanup;
+            perror("epoll_wait error");
+            *err = errno;
+            break;
         }
-        if(result == 0)
+
+        // brought up to date before anything is handled, so timers armed meanwhile count from now
+        timer_wheel_advance(&reactor->timers, timer_now_ms());
+
+        for(int i = 0; i < nready; i++)
         {
-            printf("syncing meta_user...\n");
-            // update user index
-            if(store_int(meta_userDB.db, USER_PK, user_count) != 0)
+            conn_t *conn;
+
+            // Check for new connections
+            if(events[i].data.fd == reactor->server_fd)
             {
-                perror("update user_index");
-                goto cleanup;
+                accept_clients(reactor);
+                continue;
             }
-            continue;
-        }
 
-        // Check for new connection
-        if(fds[0].revents & POLLIN)
-        {
-            client_fd = accept(server_fd, NULL, 0);
-            if(client_fd < 0)
+            // Another reactor posted frames for our clients, or a worker finished a job
+            if(events[i].data.fd == reactor->wakefd)
             {
-                if(errno == EINTR)
-                {
-                    goto cleanup;
-                }
-                perror("Accept failed");
+                deliver_mail(reactor);
+                deliver_completed(reactor);
                 continue;
             }
 
-            // Add new client to poll list
-            added = 0;
-            for(int i = 1; i < MAX_FDS; i++)
+            // Existing client has data or room for more of its queue
+            conn = conn_get(conns, events[i].data.fd);
+            if(conn == NULL)
             {
-                if(fds[i].fd == -1)
-                {
-                    fds[i].fd     = client_fd;
-                    fds[i].events = POLLIN;
-                    added         = 1;
-                    break;
-                }
+                continue;
             }
-            if(!added)
-            {
-                char too_many[] = "Too many clients, rejecting connection\n";
 
-                printf("%s", too_many);
-                write_fully(client_fd, &too_many, (ssize_t)strlen(too_many), err);
-
-                close(client_fd);
+            if(conn->out_head != NULL && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && conn_flush(conns, conn, err) < 0)
+            {
+                conn_close(conns, conn);
                 continue;
             }
-        }
 
-        // Check existing clients for data
-        for(int i = 1; i < MAX_FDS; i++)
-        {
-            if(fds[i].fd != -1)
+            if(conn->closing)
             {
-                if(fds[i].revents & POLLIN)
+                if(conn->out_head == NULL || (events[i].events & (EPOLLHUP | EPOLLERR)))
                 {
-                    request_t      request;
-                    fsm_state_func perform;
-                    fsm_state_t    from_id;
-                    fsm_state_t    to_id;
-
-                    from_id = START;
-                    to_id   = REQUEST_HANDLER;
-
-                    request.err       = 0;
-                    request.client_fd = &fds[i].fd;
-                    // user_id
-                    request.session_id   = &sessions[i];
-                    request.user_count   = &user_count;
-                    request.len          = HEADER_SIZE;
-                    request.response_len = 3;
-                    request.fds          = fds;
-                    request.content      = malloc(HEADER_SIZE);
-                    if(request.content == NULL)
-                    {
-                        perror("Malloc failed to allocate memory\n");
-                        close(fds[i].fd);
-                        fds[i].fd   = -1;
-                        sessions[i] = -1;
-                        continue;
-                    }
-
-                    memset(request.response, 0, RESPONSE_SIZE);
-
-                    request.code = OK;
-
-                    printf("event_loop session_id %d\n", *request.session_id);
-
-                    do
-                    {
-                        perform = fsm_transition(from_id, to_id, transitions, sizeof(transitions));
-                        if(perform == NULL)
-                        {
-                            printf("illegal state %d, %d \n", from_id, to_id);
-                            free(request.content);
-                            close(*request.client_fd);
-                            *request.client_fd = -1;
-                            break;
-                        }
-                        // printf("from_id %d\n", from_id);
-                        from_id = to_id;
-                        to_id   = perform(&request);
-                    } while(to_id != END);
+                    conn_close(conns, conn);
                 }
-                if(fds[i].revents & (POLLHUP | POLLERR))
+                continue;
+            }
+
+            // edge-triggered: whatever arrived while paused is still waiting in the socket
+            if((events[i].events & EPOLLIN) || resume_client(reactor, conn))
+            {
+                if(handle_client(conn, reactor) < 0)
                 {
-                    // Client disconnected or error, close and clean up
-                    printf("oops...\n");
-                    close(fds[i].fd);
-                    fds[i].fd = -1;
-                    continue;
+                    close_client(reactor, conn);
                 }
+                continue;
+            }
+
+            if(events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+            {
+                // Client disconnected or error, close and clean up
+                printf("oops...\n");
+                close_client(reactor, conn);
             }
         }
     }
 
-    printf("syncing meta_user...\n");
-    // update user index
-    if(store_int(meta_userDB.db, USER_PK, user_count) != 0)
+    // let the other reactors see the shutdown without waiting for their timeout
+    for(size_t i = 0; i < reactor->group_size; i++)
     {
-        perror("update user_index");
-        goto cleanup;
+        if(&reactor->group[i] != reactor)
+        {
+            reactor_wake(&reactor->group[i]);
+        }
     }
-    dbm_close(meta_userDB.db);
-
-cleanup:
-    printf("syncing meta_user in cleanup...\n");
-    store_int(meta_userDB.db, USER_PK, user_count);
-    dbm_close(meta_userDB.db);
 }
 
 fsm_state_t request_handler(void *args)
 {
     request_t *request;
-    ssize_t    nread;
+    int        result;
 
     request = (request_t *)args;
     printf("in request_handler %d\n", *request->client_fd);
 
-    // Read first 6 bytes from fd
-    errno = 0;
-    nread = read_fully(*request->client_fd, (char *)request->content, request->len, &request->err);
-    printf("request_handler nread %d\n", (int)nread);
-    if(nread < 0)
+    // Buffer the first 6 bytes without blocking
+    result = conn_fill(&request->reactor->conns, request->conn, HEADER_SIZE, &request->err);
+    if(result == 0)
     {
-        perror("Read_fully error\n");
-        return ERROR_HANDLER;
+        return YIELD;
     }
-
-    if(nread < (ssize_t)request->len)
+    if(result < 0)
     {
-        request->code = INVALID_REQUEST;
-        return ERROR_HANDLER;
+        if(request->err != 0)
+        {
+            perror("conn_fill error\n");
+        }
+        request->disconnect = 1;
+        return END;
     }
+
+    request->content = request->conn->rbuf + request->conn->rpos;
     return HEADER_HANDLER;
 }
 
-fsm_state_t header_handler(void *args)
+/* Reads the frame header at `ptr` into the request: type, sender and payload length. */
+static void read_header(request_t *request, const uint8_t *ptr)
 {
-    request_t *request;
-
     uint16_t sender_id;
     uint16_t len;
-    char    *ptr;
-
-    request = (request_t *)args;
-
-    printf("in header_handler %d\n", *request->client_fd);
-
-    ptr = (char *)request->content;
 
     memcpy(&request->type, ptr, sizeof(request->type));
     ptr += sizeof(request->type) + sizeof(uint8_t);
@@ -341,91 +1346,166 @@ fsm_state_t header_handler(void *args)
     // printf("len size (before ntohs): %u\n", len);
     request->len = ntohs(len);
     printf("len size (after ntohs): %u\n", (uint16_t)request->len);
+}
 
-    return BODY_HANDLER;
+/* Looks up what serves the message just read. Unknown types and impossible lengths are refused. */
+static int find_handler(request_t *request)
+{
+    request->handler = dispatch_lookup(request->type);
+    if(request->handler == NULL || request->len < request->handler->min_len || request->len > request->handler->max_len)
+    {
+        printf("Not builtin command: %d, or bad length %zu\n", request->type, request->len);
+        request->code = INVALID_REQUEST;
+        return -1;
+    }
+
+    // size the request's scratch from its payload; failing only means the handler spills to the heap
+    arena_reserve(request->arena, request->len, &request->err);
+    return 0;
 }
 
-fsm_state_t body_handler(void *args)
+fsm_state_t header_handler(void *args)
 {
     request_t *request;
-    ssize_t    nread;
-    void      *buf;
 
     request = (request_t *)args;
+
     printf("in header_handler %d\n", *request->client_fd);
 
-    printf("len size: %u\n", (uint16_t)(request->len + HEADER_SIZE));
+    read_header(request, (const uint8_t *)request->content);
+    request->version   = ((const uint8_t *)request->content)[1];
+    request->frame_len = request->len;
 
-    buf = realloc(request->content, request->len + HEADER_SIZE);
-    if(!buf)
+    // an envelope is checked message by message once it is buffered; its type byte is their count
+    if(request->version == THREE)
     {
-        perror("Failed to realloc buf");
-        return ERROR_HANDLER;
+        request->batch_left = request->type;
+        request->type       = 0;
+        if(request->batch_left == 0 || request->len < (size_t)request->batch_left * HEADER_SIZE)
+        {
+            printf("bad batch: %u messages in %zu bytes\n", request->batch_left, request->len);
+            request->code = INVALID_REQUEST;
+            return ERROR_HANDLER;
+        }
+        return BODY_HANDLER;
     }
-    request->content = buf;
 
-    nread = read_fully(*request->client_fd, (char *)request->content + HEADER_SIZE, request->len, &request->err);
-    if(nread < 0)
+    // unknown types and impossible lengths are refused before the body is even buffered
+    if(find_handler(request) < 0)
     {
-        perror("Read_fully error\n");
         return ERROR_HANDLER;
     }
 
-    return PROCESS_HANDLER;
+    return BODY_HANDLER;
+}
+
+fsm_state_t body_handler(void *args)
+{
+    request_t *request;
+    int        result;
+
+    request = (request_t *)args;
+    printf("in body_handler %d\n", *request->client_fd);
+
+    printf("len size: %u\n", (uint16_t)(request->len + HEADER_SIZE));
+
+    result = conn_fill(&request->reactor->conns, request->conn, HEADER_SIZE + request->len, &request->err);
+    if(result == 0)
+    {
+        return YIELD;
+    }
+    if(result < 0)
+    {
+        if(request->err != 0)
+        {
+            perror("conn_fill error\n");
+        }
+        request->disconnect = 1;
+        return END;
+    }
+
+    // the buffer may have moved while filling
+    request->content = request->conn->rbuf + request->conn->rpos;
+    return (request->version == THREE) ? BATCH_HANDLER : PROCESS_HANDLER;
 }
 
 fsm_state_t process_handler(void *args)
 {
     request_t *request;
     ssize_t    result;
+    int        before;
 
     request = (request_t *)args;
 
     printf("in process_handler %d\n", *request->client_fd);
 
-    result = execute_functions(request, acc_func);
-    if(result <= 0)
+    if(request->handler->auth && *request->session_id < 0)
+    {
+        request->code = INVALID_AUTH;
+        return ERROR_HANDLER;
+    }
+
+    // over its rate a request never reaches its handler and is answered with a constant frame
+    if(!rate_allow(request->type, *request->session_id, request->conn->peer, timer_now_ms()))
     {
-        return (result < 0) ? ERROR_HANDLER : RESPONSE_HANDLER;
+        request->code = RATE_LIMITED;
+        return ERROR_HANDLER;
     }
 
-    result = execute_functions(request, chat_func);
-    if(result <= 0)
+    // blocking work touches the databases: finish it on a worker and resume on completion
+    result = offload_function(request);
+    if(result == 0)
+    {
+        return YIELD;
+    }
+    if(result < 0)
     {
-        return (result < 0) ? ERROR_HANDLER : RESPONSE_HANDLER;
+        request->code = SERVER_ERROR;
+        return ERROR_HANDLER;
     }
 
-    request->code = INVALID_REQUEST;
-    return ERROR_HANDLER;
+    before = *request->session_id;
+    result = request->handler->func(request);
+    if(*request->session_id != before)
+    {
+        session_changed(request->reactor, request->conn, before, request);
+    }
+    return (result < 0) ? ERROR_HANDLER : RESPONSE_HANDLER;
 }
 
 fsm_state_t response_handler(void *args)
 {
-    request_t *request;
+    request_t   *request;
+    struct iovec iov[RESPONSE_IOV_MAX];
+    int          iovcnt;
 
     request = (request_t *)args;
 
     printf("in response_handler %d\n", *request->client_fd);
 
-    if(request->type != CHT_Send)
+    if(request->batching)
     {
-        request->response_len = (uint16_t)(HEADER_SIZE + ntohs(request->response_len));
-        printf("response_len: %d\n", (request->response_len));
-
-        write_fully(*request->client_fd, request->response, request->response_len, &request->err);
+        batch_add(request);
+        return BATCH_HANDLER;
     }
 
-    free(request->content);
+    // handlers that already sent their reply, like the chat sends with their ack, leave it empty
+    iovcnt = response_iov(&request->response, iov);
+    printf("response_len: %zu\n", response_size(&request->response));
+
+    if(iovcnt > 0)
+    {
+        reactor_sendv(request->reactor, request->conn, iov, iovcnt, &request->err);
+    }
 
-    // for linux
-    close(*request->client_fd);
-    *request->client_fd = -1;
     return END;
 }
 
 fsm_state_t error_handler(void *args)
 {
-    request_t *request;
+    request_t   *request;
+    struct iovec iov[RESPONSE_IOV_MAX];
+    int          iovcnt;
 
     request = (request_t *)args;
     printf("in error_handler %d: %d\n", *request->client_fd, (int)request->code);
@@ -433,14 +1513,172 @@ fsm_state_t error_handler(void *args)
     if(request->type != ACC_Logout)
     {
         error_response(request);
-        request->response_len = (uint16_t)(HEADER_SIZE + ntohs(request->response_len));
     }
-    printf("response_len: %d\n", (request->response_len));
 
-    write_fully(*request->client_fd, request->response, request->response_len, &request->err);
+    // only logout and malformed frames end the connection
+    if(request->type == ACC_Logout || request->code == INVALID_REQUEST)
+    {
+        request->disconnect = 1;
+    }
+
+    if(request->batching)
+    {
+        batch_add(request);
+        return BATCH_HANDLER;
+    }
+
+    iovcnt = response_iov(&request->response, iov);
+    printf("response_len: %zu\n", response_size(&request->response));
+
+    if(iovcnt > 0)
+    {
+        reactor_sendv(request->reactor, request->conn, iov, iovcnt, &request->err);
+    }
 
-    free(request->content);
-    close(*request->client_fd);
-    *request->client_fd = -1;
     return END;
 }
+
+/* Checks that a v3 payload is exactly `count` frames back to back, none of them an envelope itself. */
+static int batch_layout_valid(const uint8_t *payload, size_t len, uint8_t count)
+{
+    size_t off;
+
+    off = 0;
+    for(uint8_t i = 0; i < count; i++)
+    {
+        uint16_t sub_len;
+
+        if(len - off < HEADER_SIZE || payload[off + 1] == THREE)
+        {
+            return 0;
+        }
+
+        memcpy(&sub_len, payload + off + 4, sizeof(sub_len));
+        off += HEADER_SIZE + ntohs(sub_len);
+        if(off > len)
+        {
+            return 0;
+        }
+    }
+
+    return off == len;
+}
+
+/* Sends the replies collected so far as one v3 frame. */
+static void batch_flush(request_t *request)
+{
+    response_t   envelope;
+    struct iovec iov[RESPONSE_IOV_MAX];
+    int          iovcnt;
+
+    if(request->batch_replies == 0)
+    {
+        return;
+    }
+
+    response_start(&envelope, request->batch_replies, THREE, SERVER_ID);
+    response_ref(&envelope, request->conn->batch, request->batch_len);
+    iovcnt = response_iov(&envelope, iov);
+    reactor_sendv(request->reactor, request->conn, iov, iovcnt, &request->err);
+
+    request->batch_len     = 0;
+    request->batch_replies = 0;
+}
+
+/*
+ * Collects the reply to the sub-message just served. One that does not fit behind the others
+ * starts the next v3 frame, and one too big for any goes out on its own as the v2 frame it is.
+ */
+static void batch_add(request_t *request)
+{
+    struct iovec iov[RESPONSE_IOV_MAX];
+    int          iovcnt;
+    size_t       size;
+
+    size = response_size(&request->response);
+    if(size == 0)
+    {
+        return;
+    }
+
+    iovcnt = response_iov(&request->response, iov);
+    if(request->batch_len + size > CONN_BUF_SIZE)
+    {
+        batch_flush(request);
+        if(size > CONN_BUF_SIZE)
+        {
+            reactor_sendv(request->reactor, request->conn, iov, iovcnt, &request->err);
+            return;
+        }
+    }
+
+    for(int i = 0; i < iovcnt; i++)
+    {
+        memcpy(request->conn->batch + request->batch_len, iov[i].iov_base, iov[i].iov_len);
+        request->batch_len += iov[i].iov_len;
+    }
+    request->batch_replies++;
+}
+
+/*
+ * Serves a v3 envelope one sub-message at a time. Each one goes through the same process and
+ * response states as a v2 frame, with its reply collected here instead of sent; the replies go
+ * out together once the last is in, or once a sub-message ends the connection.
+ */
+fsm_state_t batch_handler(void *args)
+{
+    request_t     *request;
+    const uint8_t *frame;
+
+    request = (request_t *)args;
+
+    // the buffer may have moved while a sub-message was on a worker
+    frame = request->conn->rbuf + request->conn->rpos;
+
+    if(!request->batching)
+    {
+        if(!batch_layout_valid(frame + HEADER_SIZE, request->frame_len, request->batch_left))
+        {
+            printf("bad batch: %u messages do not make up %zu bytes\n", request->batch_left, request->frame_len);
+            request->code = INVALID_REQUEST;
+            return ERROR_HANDLER;
+        }
+
+        if(conn_batch_buf(&request->reactor->conns, request->conn) == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            request->code = SERVER_ERROR;
+            return ERROR_HANDLER;
+        }
+
+        request->batching      = 1;
+        request->batch_off     = HEADER_SIZE;
+        request->batch_len     = 0;
+        request->batch_replies = 0;
+    }
+
+    if(request->batch_left == 0 || request->disconnect)
+    {
+        batch_flush(request);
+        conn_batch_done(&request->reactor->conns, request->conn);
+        request->batching = 0;
+        return END;
+    }
+
+    // each sub-message starts clean, the way a frame does
+    request->content = (void *)(uintptr_t)(frame + request->batch_off);
+    request->code    = OK;
+    arena_reset(request->arena);
+    response_reset(&request->response);
+
+    read_header(request, frame + request->batch_off);
+    request->batch_off += HEADER_SIZE + request->len;
+    request->batch_left--;
+
+    if(find_handler(request) < 0)
+    {
+        return ERROR_HANDLER;
+    }
+
+    return PROCESS_HANDLER;
+}
@@ -13,10 +13,10 @@
 #define ERR_INVALID_CHARS 3
 
 static void setup_network_address(struct sockaddr_storage *addr, socklen_t *addr_len, const char *address, in_port_t port, int *err);
-static int  setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err);
+static int  setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, size_t opts, int *err);
 static int  connect_to_server(struct sockaddr_storage *addr, socklen_t addr_len, int *err);
 
-int tcp_server(const char *address, in_port_t port, int backlog, int *err)
+int tcp_server(const char *address, in_port_t port, int backlog, size_t opts, int *err)
 {
     struct sockaddr_storage addr;
     socklen_t               addr_len;
@@ -30,7 +30,7 @@ int tcp_server(const char *address, in_port_t port, int backlog, int *err)
         goto done;
     }
 
-    fd = setup_tcp_server(&addr, addr_len, backlog, err);
+    fd = setup_tcp_server(&addr, addr_len, backlog, opts, err);
 
 done:
     return fd;
@@ -118,7 +118,20 @@ static int setSockReuse(int fd, int *err)
     return 0;
 }
 
-static int setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err)
+/* Lets several listeners bind the same address; the kernel spreads new connections across them. */
+static int setSockReusePort(int fd, int *err)
+{
+    int opt;
+    opt = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        *err = errno;
+        return -1;
+    }
+    return 0;
+}
+
+static int setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, size_t opts, int *err)
 {
     int fd;
     int result;
@@ -144,6 +157,16 @@ static int setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_
         goto done;
     }
 
+    if(opts & O_SOCK_REUSEPORT)
+    {
+        result = setSockReusePort(fd, err);
+
+        if(result == -1)
+        {
+            goto done;
+        }
+    }
+
     result = bind(fd, (const struct sockaddr *)addr, addr_len);
 
     if(result == -1)
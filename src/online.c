@@ -0,0 +1,206 @@
+#include "online.h"
+#include "mem.h"
+#include <p101_c/p101_stdio.h>
+#include <pthread.h>
+#include <string.h>
+
+#define ONLINE_INITIAL 64
+#define ONLINE_SPARE_MAX 256    // entries kept for the next logins
+
+/* A user and how many connections are logged in as them. */
+typedef struct online_entry_t
+{
+    online_user_t user;
+    size_t        conns;
+} online_entry_t;
+
+/* Everyone logged in on any reactor, sorted by session id. */
+typedef struct online_index_t
+{
+    pthread_rwlock_t lock;    // writers are logins and logouts, readers are list pages
+    online_entry_t **users;
+    size_t           count;
+    size_t           cap;
+    uint32_t         generation;
+    online_entry_t **spares;    // entries freed by logouts
+    size_t           nspares;
+} online_index_t;
+
+static online_index_t online = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0, NULL, 0};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Position of the first user with an id of at least `id`. Called with the lock held. */
+static size_t lower_bound(uint16_t id)
+{
+    size_t lo;
+    size_t hi;
+
+    lo = 0;
+    hi = online.count;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(online.users[mid]->user.id < id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* An entry for a new user, from the spares when there are any. Called with the write lock held. */
+static online_entry_t *take_entry(void)
+{
+    if(online.nspares > 0)
+    {
+        return online.spares[--online.nspares];
+    }
+    return (online_entry_t *)mem_alloc(sizeof(online_entry_t));
+}
+
+/* Called with the write lock held. */
+static void put_entry(online_entry_t *entry)
+{
+    if(online.nspares >= ONLINE_SPARE_MAX)
+    {
+        mem_free(entry);
+        return;
+    }
+
+    if(online.spares == NULL)
+    {
+        online.spares = (online_entry_t **)mem_alloc(ONLINE_SPARE_MAX * sizeof(*online.spares));
+        if(online.spares == NULL)
+        {
+            mem_free(entry);
+            return;
+        }
+    }
+    online.spares[online.nspares++] = entry;
+}
+
+/* Counts a connection logged in as `id`, adding the user if it is the first. */
+int online_join(uint16_t id, const char *name, uint8_t len)
+{
+    online_entry_t *entry;
+    size_t          pos;
+
+    pthread_rwlock_wrlock(&online.lock);
+
+    pos = lower_bound(id);
+    if(pos < online.count && online.users[pos]->user.id == id)
+    {
+        online.users[pos]->conns++;
+        pthread_rwlock_unlock(&online.lock);
+        return 0;
+    }
+
+    if(online.count == online.cap)
+    {
+        size_t           cap   = (online.cap == 0) ? ONLINE_INITIAL : online.cap * 2;
+        online_entry_t **users = (online_entry_t **)mem_realloc((void *)online.users, cap * sizeof(*users));
+
+        if(users == NULL)
+        {
+            pthread_rwlock_unlock(&online.lock);
+            return -1;
+        }
+        online.users = users;
+        online.cap   = cap;
+    }
+
+    entry = take_entry();
+    if(entry == NULL)
+    {
+        pthread_rwlock_unlock(&online.lock);
+        return -1;
+    }
+
+    entry->user.id       = id;
+    entry->user.name_len = len;
+    memcpy(entry->user.name, name, len);
+    entry->conns = 1;
+
+    memmove((void *)&online.users[pos + 1], (void *)&online.users[pos], (online.count - pos) * sizeof(*online.users));
+    online.users[pos] = entry;
+    online.count++;
+    online.generation++;
+
+    pthread_rwlock_unlock(&online.lock);
+    return 0;
+}
+
+/* Drops a connection logged in as `id`, and the user with their last one. */
+void online_leave(uint16_t id)
+{
+    online_entry_t *entry;
+    size_t          pos;
+
+    pthread_rwlock_wrlock(&online.lock);
+
+    pos = lower_bound(id);
+    if(pos == online.count || online.users[pos]->user.id != id)
+    {
+        fprintf(stderr, "online: user %u is not logged in\n", id);
+        pthread_rwlock_unlock(&online.lock);
+        return;
+    }
+
+    entry = online.users[pos];
+    if(--entry->conns == 0)
+    {
+        online.count--;
+        memmove((void *)&online.users[pos], (void *)&online.users[pos + 1], (online.count - pos) * sizeof(*online.users));
+        online.generation++;
+        put_entry(entry);
+    }
+
+    pthread_rwlock_unlock(&online.lock);
+}
+
+/*
+ * Copies up to `limit` users with ids from `start` on, in id order, in one read-locked pass: a
+ * binary search and the page itself, however many users are online.
+ */
+void online_page(uint16_t start, online_user_t *users, size_t limit, online_page_t *page)
+{
+    size_t pos;
+
+    pthread_rwlock_rdlock(&online.lock);
+
+    pos         = lower_bound(start);
+    page->count = 0;
+    while(page->count < limit && pos < online.count)
+    {
+        users[page->count++] = online.users[pos++]->user;
+    }
+    page->generation = online.generation;
+    page->total      = online.count;
+    page->more       = pos < online.count;
+
+    pthread_rwlock_unlock(&online.lock);
+}
+
+/* Frees the index once no reactor is left to use it. */
+void online_destroy(void)
+{
+    for(size_t i = 0; i < online.count; i++)
+    {
+        mem_free(online.users[i]);
+    }
+    for(size_t i = 0; i < online.nspares; i++)
+    {
+        mem_free(online.spares[i]);
+    }
+    mem_free((void *)online.users);
+    mem_free((void *)online.spares);
+    online.users   = NULL;
+    online.spares  = NULL;
+    online.count   = 0;
+    online.cap     = 0;
+    online.nspares = 0;
+}
@@ -0,0 +1,322 @@
+#include "ratelimit.h"
+#include "messaging.h"
+#include <netinet/in.h>
+#include <p101_c/p101_stdio.h>
+#include <p101_c/p101_stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#define RATE_MILLI 1000    // tokens are kept in thousandths, so slow rates still refill every millisecond
+
+_Static_assert((RATE_ADDR_SLOTS & (RATE_ADDR_SLOTS - 1)) == 0, "RATE_ADDR_SLOTS must be a power of two");
+_Static_assert((RATE_NAME_SLOTS & (RATE_NAME_SLOTS - 1)) == 0, "RATE_NAME_SLOTS must be a power of two");
+_Static_assert((uint64_t)RATE_BURST_MAX * RATE_HOST_FACTOR * RATE_MILLI <= UINT32_MAX, "a full bucket must fit in 32 bits");
+
+/*
+ * A bucket is one word, so it is taken from with a compare-and-swap whatever reactor the
+ * client is on: the millisecond it was last taken from in the high half, the thousandths of
+ * a token left then in the low half. 0 is a bucket nobody has used, which is full.
+ */
+typedef _Atomic uint64_t rate_bucket_t;
+
+/* The buckets of one user, address or name, a bucket per rule: 64 bytes, one cache line. */
+typedef struct rate_row_t
+{
+    rate_bucket_t buckets[RATE_RULES_MAX];
+} rate_row_t;
+
+_Static_assert(sizeof(rate_row_t) == 64, "a row of buckets should be one cache line");
+
+/* Rules and buckets. The rules are set before rate_init and only read once reactors run. */
+typedef struct rate_limits_t
+{
+    rate_rule_t rules[RATE_RULES_MAX];
+    size_t      nrules;
+    uint8_t     rule_of[UINT8_MAX + 1];    // rule + 1 for each type, 0 when it is not limited
+    rate_row_t *users;                     // by session id
+    rate_row_t *addrs;                     // by peer, for clients not logged in
+    rate_row_t *hosts;                     // by peer, shared by the users logged in from it
+    rate_row_t *names;                     // by the username a login is for
+    size_t      size;                      // bytes mapped for all of them
+    uint32_t    seed;                      // keys the hashes, so collisions cannot be aimed at
+} rate_limits_t;
+
+// the defaults: chat sends fan out to every client, logins and creates each open the databases
+static rate_limits_t limits = {    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+    .rules  = {{ACC_Login, 2, 10}, {ACC_Create, 1, 5}, {CHT_Send, 10, 50}, {CHN_Send, 10, 50}, {DM_Send, 10, 50}},
+    .nrules = 5,
+};
+
+/* Sets the rate of one message type, replacing its default. */
+int rate_set(uint8_t type, uint32_t per_sec, uint32_t burst)
+{
+    size_t i;
+
+    if(burst > RATE_BURST_MAX || (per_sec > 0 && burst == 0))
+    {
+        return -1;
+    }
+
+    for(i = 0; i < limits.nrules; i++)
+    {
+        if(limits.rules[i].type == type)
+        {
+            break;
+        }
+    }
+    if(i == limits.nrules)
+    {
+        if(limits.nrules == RATE_RULES_MAX)
+        {
+            return -1;
+        }
+        limits.nrules++;
+    }
+
+    limits.rules[i].type    = type;
+    limits.rules[i].per_sec = per_sec;
+    limits.rules[i].burst   = burst;
+    return 0;
+}
+
+/* Reads "<type>:<per second>[:<burst>]" as given to -R; the burst defaults to one second's worth. */
+int rate_parse(const char *spec)
+{
+    unsigned long type;
+    unsigned long per_sec;
+    unsigned long burst;
+    char         *end;
+
+    type = strtoul(spec, &end, 10);
+    if(end == spec || *end != ':' || type > UINT8_MAX)
+    {
+        return -1;
+    }
+
+    spec    = end + 1;
+    per_sec = strtoul(spec, &end, 10);
+    if(end == spec || per_sec > RATE_BURST_MAX)
+    {
+        return -1;
+    }
+
+    burst = per_sec;
+    if(*end == ':')
+    {
+        spec  = end + 1;
+        burst = strtoul(spec, &end, 10);
+        if(end == spec || burst > RATE_BURST_MAX)
+        {
+            return -1;
+        }
+    }
+    if(*end != '\0')
+    {
+        return -1;
+    }
+
+    return rate_set((uint8_t)type, (uint32_t)per_sec, (uint32_t)burst);
+}
+
+/*
+ * Maps the buckets of every possible session id, address and name slot. The pages are only backed
+ * once a user sends something limited, so the idle ids cost nothing, and nothing is allocated
+ * while checking.
+ */
+int rate_init(void)
+{
+    void *map;
+
+    memset(limits.rule_of, 0, sizeof(limits.rule_of));
+    for(size_t i = 0; i < limits.nrules; i++)
+    {
+        if(limits.rules[i].per_sec > 0)
+        {
+            limits.rule_of[limits.rules[i].type] = (uint8_t)(i + 1);
+        }
+    }
+
+    if(getrandom(&limits.seed, sizeof(limits.seed), 0) != (ssize_t)sizeof(limits.seed))
+    {
+        perror("getrandom error");
+        return -1;
+    }
+
+    limits.size = (RATE_USERS + 2 * RATE_ADDR_SLOTS + RATE_NAME_SLOTS) * sizeof(rate_row_t);
+    map         = mmap(NULL, limits.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap error");
+        return -1;
+    }
+    limits.users = (rate_row_t *)map;
+    limits.addrs = limits.users + RATE_USERS;
+    limits.hosts = limits.addrs + RATE_ADDR_SLOTS;
+    limits.names = limits.hosts + RATE_ADDR_SLOTS;
+    return 0;
+}
+
+/* A keyed FNV-1a. */
+static uint32_t keyed_hash(const uint8_t *bytes, size_t n)
+{
+    uint32_t hash;
+
+    hash = 2166136261U ^ limits.seed;
+    for(size_t i = 0; i < n; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* The address slot of the client on `fd`, from its address with the port left out. */
+uint32_t rate_peer(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len;
+    const uint8_t          *bytes;
+    size_t                  n;
+
+    len = sizeof(addr);
+    if(getpeername(fd, (struct sockaddr *)&addr, &len) < 0)
+    {
+        return 0;
+    }
+
+    if(addr.ss_family == AF_INET6)
+    {
+        bytes = (const uint8_t *)&((const struct sockaddr_in6 *)&addr)->sin6_addr;
+        n     = sizeof(struct in6_addr);
+    }
+    else
+    {
+        bytes = (const uint8_t *)&((const struct sockaddr_in *)&addr)->sin_addr;
+        n     = sizeof(struct in_addr);
+    }
+
+    return keyed_hash(bytes, n) & (RATE_ADDR_SLOTS - 1);
+}
+
+/*
+ * Takes a token from a bucket refilling `per_sec` a second up to `cap` thousandths. Returns 0
+ * when it is empty; a refused message leaves the bucket as it was, so a flood costs one load
+ * per message.
+ */
+static int take(rate_bucket_t *bucket, uint64_t per_sec, uint64_t cap, uint32_t now)
+{
+    uint64_t state;
+    uint64_t next;
+    uint64_t tokens;
+
+    state = atomic_load_explicit(bucket, memory_order_relaxed);
+    do
+    {
+        if(state == 0)
+        {
+            tokens = cap;
+        }
+        else
+        {
+            // per_sec tokens a second is per_sec thousandths a millisecond
+            tokens = (state & UINT32_MAX) + (uint64_t)(uint32_t)(now - (uint32_t)(state >> 32)) * per_sec;
+            tokens = (tokens < cap) ? tokens : cap;
+        }
+
+        if(tokens < RATE_MILLI)
+        {
+            return 0;
+        }
+
+        next = ((uint64_t)now << 32) | (tokens - RATE_MILLI);
+        if(next == 0)
+        {
+            next = 1;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(bucket, &state, next, memory_order_relaxed, memory_order_relaxed));
+
+    return 1;
+}
+
+/* Puts back a token taken for a message another bucket refused. It cannot carry: a token was taken below the cap. */
+static void refund(rate_bucket_t *bucket)
+{
+    atomic_fetch_add_explicit(bucket, RATE_MILLI, memory_order_relaxed);
+}
+
+/*
+ * Takes a token for a message of `type` from the sender's buckets. Before login that is its
+ * address's; after, both the user's and the one its address shares among the users logged in
+ * from it, which holds RATE_HOST_FACTOR times as many, so many accounts on one address do not
+ * multiply its rate. Returns 0 when either is empty, having taken from neither.
+ */
+int rate_allow(uint8_t type, int session_id, uint32_t peer, uint64_t now_ms)
+{
+    const rate_rule_t *rule;
+    rate_bucket_t     *user;
+    uint64_t           cap;
+    uint32_t           now;
+    uint8_t            index;
+
+    index = limits.rule_of[type];
+    if(index == 0)
+    {
+        return 1;
+    }
+    rule = &limits.rules[index - 1];
+    cap  = (uint64_t)rule->burst * RATE_MILLI;
+    now  = (uint32_t)now_ms;
+    peer &= RATE_ADDR_SLOTS - 1;
+
+    if(session_id < 0 || session_id >= RATE_USERS)
+    {
+        return take(&limits.addrs[peer].buckets[index - 1], rule->per_sec, cap, now);
+    }
+
+    user = &limits.users[session_id].buckets[index - 1];
+    if(!take(user, rule->per_sec, cap, now))
+    {
+        return 0;
+    }
+    if(!take(&limits.hosts[peer].buckets[index - 1], (uint64_t)rule->per_sec * RATE_HOST_FACTOR, cap * RATE_HOST_FACTOR, now))
+    {
+        refund(user);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Takes a token for a message of `type` about the named user, such as a login for it, so
+ * guessing one user's password from many addresses is held to the rate of one.
+ */
+int rate_allow_name(uint8_t type, const char *name, size_t len, uint64_t now_ms)
+{
+    const rate_rule_t *rule;
+    uint32_t           slot;
+    uint8_t            index;
+
+    index = limits.rule_of[type];
+    if(index == 0)
+    {
+        return 1;
+    }
+    rule = &limits.rules[index - 1];
+    slot = keyed_hash((const uint8_t *)name, len) & (RATE_NAME_SLOTS - 1);
+    return take(&limits.names[slot].buckets[index - 1], rule->per_sec, (uint64_t)rule->burst * RATE_MILLI, (uint32_t)now_ms);
+}
+
+void rate_destroy(void)
+{
+    if(limits.users != NULL)
+    {
+        munmap(limits.users, limits.size);
+        limits.users = NULL;
+        limits.addrs = NULL;
+        limits.hosts = NULL;
+        limits.names = NULL;
+    }
+}
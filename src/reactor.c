@@ -0,0 +1,364 @@
+#include "reactor.h"
+#include "fanout.h"
+#include "mem.h"
+#include "messaging.h"
+#include "threads.h"
+#include "utils.h"
+#include "workers.h"
+#include <errno.h>
+#include <p101_c/p101_stdio.h>
+#include <p101_c/p101_stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static void *reactor_thread(void *args);
+static int   post(reactor_t *reactor, fanout_frame_t *frame, uint32_t channel, int fd, uint64_t conn_id);
+
+int reactor_init(reactor_t *reactor, size_t id, int server_fd, size_t max_clients, int *err)
+{
+    struct epoll_event ev;
+
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->id        = id;
+    reactor->server_fd = server_fd;
+    reactor->epfd      = -1;
+    reactor->wakefd    = -1;
+    timer_wheel_init(&reactor->timers, timer_now_ms(), reactor);
+    arena_init(&reactor->arena);
+
+    if(conn_table_init(&reactor->conns, max_clients, err) < 0)
+    {
+        perror("conn_table_init error");
+        return -1;
+    }
+
+    errno = pthread_mutex_init(&reactor->mail_lock, NULL);
+    if(errno != 0)
+    {
+        perror("pthread_mutex_init error");
+        *err = errno;
+        conn_table_destroy(&reactor->conns);
+        return -1;
+    }
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(reactor->epfd < 0)
+    {
+        perror("epoll_create1 error");
+        goto error;
+    }
+
+    reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(reactor->wakefd < 0)
+    {
+        perror("eventfd error");
+        goto error;
+    }
+
+    // listener stays level-triggered, so a drain cut short by ACCEPT_BUDGET is woken again
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = server_fd;
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+    {
+        perror("epoll_ctl error");
+        goto error;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN;
+    ev.data.fd = reactor->wakefd;
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) < 0)
+    {
+        perror("epoll_ctl error");
+        goto error;
+    }
+
+    return 0;
+
+error:
+    *err = errno;
+    reactor_destroy(reactor);
+    return -1;
+}
+
+void reactor_destroy(reactor_t *reactor)
+{
+    mail_t *mail;
+    job_t  *job;
+
+    mail = reactor_take_mail(reactor);
+    while(mail != NULL)
+    {
+        mail_t *next = mail->next;
+
+        fanout_release(mail->frame);
+        mem_free(mail);
+        mail = next;
+    }
+
+    mail = reactor->spare_mail;
+    while(mail != NULL)
+    {
+        mail_t *next = mail->next;
+
+        mem_free(mail);
+        mail = next;
+    }
+    reactor->spare_mail = NULL;
+
+    job = reactor_take_completed(reactor);
+    while(job != NULL)
+    {
+        job_t *next = job->next;
+
+        job_destroy(job);
+        job = next;
+    }
+
+    job = reactor->spare_jobs;
+    while(job != NULL)
+    {
+        job_t *next = job->next;
+
+        job_destroy(job);
+        job = next;
+    }
+    reactor->spare_jobs = NULL;
+
+    conn_table_destroy(&reactor->conns);
+    pthread_mutex_destroy(&reactor->mail_lock);
+
+    while(reactor->spare_reqs != NULL)
+    {
+        void *next;
+
+        memcpy((void *)&next, reactor->spare_reqs, sizeof(next));
+        mem_free(reactor->spare_reqs);
+        reactor->spare_reqs = next;
+    }
+    arena_destroy(&reactor->arena);
+
+    if(reactor->wakefd >= 0)
+    {
+        close(reactor->wakefd);
+        reactor->wakefd = -1;
+    }
+    if(reactor->epfd >= 0)
+    {
+        close(reactor->epfd);
+        reactor->epfd = -1;
+    }
+}
+
+/* Hands `frame` to another reactor's thread for its clients in `channel`. */
+int reactor_post(reactor_t *reactor, uint32_t channel, fanout_frame_t *frame)
+{
+    return post(reactor, frame, channel, -1, 0);
+}
+
+/* Hands `frame` to the reactor that owns connection `conn_id`, for it alone. */
+int reactor_post_direct(reactor_t *reactor, int fd, uint64_t conn_id, fanout_frame_t *frame)
+{
+    return post(reactor, frame, CHANNEL_ALL, fd, conn_id);
+}
+
+/* Queues mail holding a reference to `frame` until it is delivered, and wakes the reactor up. */
+static int post(reactor_t *reactor, fanout_frame_t *frame, uint32_t channel, int fd, uint64_t conn_id)
+{
+    mail_t *mail;
+
+    pthread_mutex_lock(&reactor->mail_lock);
+    mail = reactor->spare_mail;
+    if(mail != NULL)
+    {
+        reactor->spare_mail = mail->next;
+        reactor->nspare_mail--;
+    }
+    pthread_mutex_unlock(&reactor->mail_lock);
+
+    if(mail == NULL)
+    {
+        mail = (mail_t *)mem_alloc(sizeof(mail_t));
+        if(mail == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return -1;
+        }
+    }
+
+    fanout_hold(frame);
+    mail->next    = NULL;
+    mail->frame   = frame;
+    mail->channel = channel;
+    mail->fd      = fd;
+    mail->conn_id = conn_id;
+
+    pthread_mutex_lock(&reactor->mail_lock);
+    if(reactor->mail_tail != NULL)
+    {
+        reactor->mail_tail->next = mail;
+    }
+    else
+    {
+        reactor->mail_head = mail;
+    }
+    reactor->mail_tail = mail;
+    pthread_mutex_unlock(&reactor->mail_lock);
+
+    reactor_wake(reactor);
+    return 0;
+}
+
+/* Detaches every queued message in arrival order; the caller hands them to reactor_recycle_mail. */
+mail_t *reactor_take_mail(reactor_t *reactor)
+{
+    mail_t *mail;
+
+    pthread_mutex_lock(&reactor->mail_lock);
+    mail               = reactor->mail_head;
+    reactor->mail_head = NULL;
+    reactor->mail_tail = NULL;
+    pthread_mutex_unlock(&reactor->mail_lock);
+
+    return mail;
+}
+
+/*
+ * Lets go of the frames in delivered mail and keeps the mail for the next posts to this
+ * reactor, freeing what the pool has no room for.
+ */
+void reactor_recycle_mail(reactor_t *reactor, mail_t *mail)
+{
+    for(const mail_t *delivered = mail; delivered != NULL; delivered = delivered->next)
+    {
+        fanout_release(delivered->frame);
+    }
+
+    pthread_mutex_lock(&reactor->mail_lock);
+    while(mail != NULL)
+    {
+        mail_t *next = mail->next;
+
+        if(reactor->nspare_mail < MAIL_SPARE_MAX)
+        {
+            mail->next          = reactor->spare_mail;
+            reactor->spare_mail = mail;
+            reactor->nspare_mail++;
+        }
+        else
+        {
+            mem_free(mail);
+        }
+        mail = next;
+    }
+    pthread_mutex_unlock(&reactor->mail_lock);
+}
+
+/* Hands a finished job back to the reactor that owns its connection. Called from worker threads. */
+void reactor_complete(reactor_t *reactor, job_t *job)
+{
+    pthread_mutex_lock(&reactor->mail_lock);
+    if(reactor->done_tail != NULL)
+    {
+        reactor->done_tail->next = job;
+    }
+    else
+    {
+        reactor->done_head = job;
+    }
+    reactor->done_tail = job;
+    pthread_mutex_unlock(&reactor->mail_lock);
+
+    reactor_wake(reactor);
+}
+
+job_t *reactor_take_completed(reactor_t *reactor)
+{
+    job_t *job;
+
+    pthread_mutex_lock(&reactor->mail_lock);
+    job                = reactor->done_head;
+    reactor->done_head = NULL;
+    reactor->done_tail = NULL;
+    pthread_mutex_unlock(&reactor->mail_lock);
+
+    return job;
+}
+
+void reactor_wake(const reactor_t *reactor)
+{
+    uint64_t one = 1;
+
+    if(write(reactor->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("reactor_wake error");
+    }
+}
+
+/* Dumps where this reactor's memory is going; answers SIGUSR1. */
+void reactor_print_stats(const reactor_t *reactor)
+{
+    conn_stats_t stats;
+    size_t       total;
+
+    conn_table_stats(&reactor->conns, &stats);
+    total = stats.slab_bytes + stats.rbuf_bytes + stats.queued_bytes + stats.spare_bytes + reactor->nspare_reqs * sizeof(request_t) + reactor->arena.cap;
+
+    printf("reactor %zu: %zu connections (%zu mid-frame), %zu bytes per idle connection\n", reactor->id, stats.open, stats.busy, sizeof(conn_t));
+    printf("reactor %zu: slabs %zu bytes for %zu slots, receive buffers %zu (%zu bytes), %zu bytes queued\n", reactor->id, stats.slab_bytes, stats.slab_slots, stats.rbufs, stats.rbuf_bytes, stats.queued_bytes);
+    printf("reactor %zu: spares %zu buffers, %zu chunks, %zu frame refs, %zu requests, arena %zu bytes; %zu bytes total\n", reactor->id, stats.spare_bufs, stats.spare_chunks, stats.spare_refs, reactor->nspare_reqs, reactor->arena.cap, total);
+}
+
+static void *reactor_thread(void *args)
+{
+    reactor_t *reactor;
+
+    reactor = (reactor_t *)args;
+    event_loop(reactor, &reactor->err);
+    return NULL;
+}
+
+/* Runs reactor 0 on the calling thread and the rest on their own threads until shutdown. */
+int reactor_group_run(reactor_t *group, size_t group_size)
+{
+    pthread_t *threads;
+    size_t     started;
+
+    threads = (pthread_t *)calloc(group_size, sizeof(pthread_t));
+    if(threads == NULL)
+    {
+        perror("Malloc failed to allocate memory\n");
+        return -1;
+    }
+
+    for(started = 1; started < group_size; started++)
+    {
+        if(start_thread(reactor_thread, &group[started], 0, &threads[started]) != 0)
+        {
+            fprintf(stderr, "reactor_group_run: failed to start reactor %zu\n", started);
+            running = 0;
+            break;
+        }
+    }
+
+    if(running)
+    {
+        event_loop(&group[0], &group[0].err);
+    }
+
+    for(size_t i = 1; i < started; i++)
+    {
+        reactor_wake(&group[i]);
+        errno = pthread_join(threads[i], NULL);
+        if(errno != 0)
+        {
+            perror("reactor_group_run::pthread_join");
+        }
+    }
+
+    free(threads);
+    return (started == group_size) ? 0 : -1;
+}
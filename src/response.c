@@ -0,0 +1,188 @@
+#include "response.h"
+#include <arpa/inet.h>
+#include <p101_c/p101_stdio.h>
+#include <string.h>
+
+static response_seg_t *next_seg(response_t *res, size_t len);
+
+void response_reset(response_t *res)
+{
+    res->data_len  = 0;
+    res->nsegs     = 0;
+    res->body_len  = 0;
+    res->started   = 0;
+    res->frame     = NULL;
+    res->frame_len = 0;
+}
+
+void response_start(response_t *res, uint8_t type, uint8_t version, uint16_t sender_id)
+{
+    response_reset(res);
+    res->header[0] = type;
+    res->header[1] = version;
+    sender_id      = htons(sender_id);
+    memcpy(&res->header[2], &sender_id, sizeof(sender_id));
+    res->started = 1;
+}
+
+/* Sends `frame`, header and all, as the response. It must outlive the send. */
+void response_frame(response_t *res, const uint8_t *frame, size_t len)
+{
+    response_reset(res);
+    res->frame     = frame;
+    res->frame_len = len;
+    res->started   = 1;
+}
+
+/* Reserves a segment for `len` more body bytes; fails instead of outgrowing the frame. */
+static response_seg_t *next_seg(response_t *res, size_t len)
+{
+    if(!res->started || res->frame != NULL || res->nsegs >= RESPONSE_SEGMENTS || res->body_len + len > UINT16_MAX)
+    {
+        fprintf(stderr, "response: frame too large\n");
+        return NULL;
+    }
+
+    res->body_len += len;
+    return &res->segs[res->nsegs++];
+}
+
+/*
+ * Claims `len` owned body bytes and returns where they start, extending the previous owned
+ * segment when there is one. The caller fills them in place.
+ */
+uint8_t *response_reserve(response_t *res, size_t len)
+{
+    response_seg_t *seg;
+    uint8_t        *dst;
+
+    if(res->data_len + len > RESPONSE_SIZE)
+    {
+        fprintf(stderr, "response: %zu bytes do not fit\n", res->data_len + len);
+        return NULL;
+    }
+
+    if(res->nsegs > 0 && res->segs[res->nsegs - 1].ref == NULL && res->body_len + len <= UINT16_MAX)
+    {
+        seg = &res->segs[res->nsegs - 1];
+        res->body_len += len;
+    }
+    else
+    {
+        seg = next_seg(res, len);
+        if(seg == NULL)
+        {
+            return NULL;
+        }
+        seg->ref = NULL;
+        seg->off = res->data_len;
+        seg->len = 0;
+    }
+
+    dst = res->data + res->data_len;
+    res->data_len += len;
+    seg->len += len;
+    return dst;
+}
+
+/* Gives back the last `len` bytes claimed by response_reserve. */
+void response_unreserve(response_t *res, size_t len)
+{
+    response_seg_t *seg;
+
+    seg = &res->segs[res->nsegs - 1];
+    seg->len -= len;
+    res->data_len -= len;
+    res->body_len -= len;
+    if(seg->len == 0)
+    {
+        res->nsegs--;
+    }
+}
+
+/* Copies `data` into the response. */
+int response_put(response_t *res, const void *data, size_t len)
+{
+    uint8_t *dst;
+
+    dst = response_reserve(res, len);
+    if(dst == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(dst, data, len);
+    return 0;
+}
+
+int response_put_tlv(response_t *res, uint8_t tag, const void *value, uint8_t len)
+{
+    uint8_t tl[2];
+
+    tl[0] = tag;
+    tl[1] = len;
+    if(response_put(res, tl, sizeof(tl)) < 0)
+    {
+        return -1;
+    }
+    return response_put(res, value, len);
+}
+
+/* Appends bytes without copying them; they must stay valid until the response is sent. */
+int response_ref(response_t *res, const void *data, size_t len)
+{
+    response_seg_t *seg;
+
+    seg = next_seg(res, len);
+    if(seg == NULL)
+    {
+        return -1;
+    }
+
+    seg->ref = (const uint8_t *)data;
+    seg->off = 0;
+    seg->len = len;
+    return 0;
+}
+
+/* Stamps the payload length into the header and lays the frame out for writev. Returns the iov count. */
+int response_iov(response_t *res, struct iovec *iov)
+{
+    uint16_t len;
+
+    if(!res->started)
+    {
+        return 0;
+    }
+
+    if(res->frame != NULL)
+    {
+        iov[0].iov_base = (void *)(uintptr_t)res->frame;
+        iov[0].iov_len  = res->frame_len;
+        return 1;
+    }
+
+    len = htons((uint16_t)res->body_len);
+    memcpy(&res->header[4], &len, sizeof(len));
+
+    iov[0].iov_base = res->header;
+    iov[0].iov_len  = HEADER_SIZE;
+    for(int i = 0; i < res->nsegs; i++)
+    {
+        const response_seg_t *seg = &res->segs[i];
+
+        iov[i + 1].iov_base = (void *)(uintptr_t)((seg->ref != NULL) ? seg->ref : res->data + seg->off);
+        iov[i + 1].iov_len  = seg->len;
+    }
+
+    return res->nsegs + 1;
+}
+
+size_t response_size(const response_t *res)
+{
+    if(!res->started)
+    {
+        return 0;
+    }
+    return (res->frame != NULL) ? res->frame_len : HEADER_SIZE + res->body_len;
+}
@@ -0,0 +1,310 @@
+#include "route.h"
+#include "fanout.h"
+#include "mem.h"
+#include <p101_c/p101_stdio.h>
+#include <pthread.h>
+#include <string.h>
+
+#define ROUTE_INITIAL_BITS 6
+#define ROUTE_SPARE_MAX 256    // entries kept for the next logins
+
+/* A user with connections to route to, or messages waiting for one. */
+typedef struct route_entry_t
+{
+    uint16_t               id;
+    uint8_t                nroutes;
+    uint8_t                head;       // oldest waiting message
+    uint8_t                waiting;
+    route_t                routes[ROUTE_CONNS];
+    struct fanout_frame_t *mailbox[ROUTE_MAILBOX];
+} route_entry_t;
+
+/* Session id to entry, open addressed with linear probing. */
+typedef struct route_map_t
+{
+    pthread_rwlock_t lock;       // readers route messages, writers are logins, logouts and offline mail
+    route_entry_t  **slots;
+    unsigned         bits;       // log2 of the slot count
+    size_t           count;
+    size_t           queued;     // messages waiting across all users
+    route_entry_t  **spares;     // entries freed by logouts
+    size_t           nspares;
+} route_map_t;
+
+static route_map_t map = {PTHREAD_RWLOCK_INITIALIZER, NULL, 0, 0, 0, NULL, 0};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Fibonacci hashing: the multiply spreads consecutive ids, the top bits pick the slot. */
+static size_t home_of(uint16_t id, unsigned bits)
+{
+    return (size_t)(((uint32_t)id * 2654435769U) >> (32 - bits));
+}
+
+/* Slot holding `id`, or the empty slot ending its probe. Called with the lock held and a table allocated. */
+static size_t probe(uint16_t id)
+{
+    size_t mask;
+    size_t pos;
+
+    mask = ((size_t)1 << map.bits) - 1;
+    for(pos = home_of(id, map.bits); map.slots[pos] != NULL; pos = (pos + 1) & mask)
+    {
+        if(map.slots[pos]->id == id)
+        {
+            break;
+        }
+    }
+    return pos;
+}
+
+static route_entry_t *find_entry(uint16_t id)
+{
+    if(map.slots == NULL)
+    {
+        return NULL;
+    }
+    return map.slots[probe(id)];
+}
+
+/* Doubles the table, or allocates it. Called with the write lock held. */
+static int grow(void)
+{
+    route_entry_t **old;
+    size_t          old_cap;
+    unsigned        bits;
+
+    bits = (map.slots == NULL) ? ROUTE_INITIAL_BITS : map.bits + 1;
+    old  = map.slots;
+
+    map.slots = (route_entry_t **)mem_alloc(((size_t)1 << bits) * sizeof(*map.slots));
+    if(map.slots == NULL)
+    {
+        map.slots = old;
+        return -1;
+    }
+    memset((void *)map.slots, 0, ((size_t)1 << bits) * sizeof(*map.slots));
+
+    old_cap  = (old == NULL) ? 0 : (size_t)1 << map.bits;
+    map.bits = bits;
+    for(size_t i = 0; i < old_cap; i++)
+    {
+        if(old[i] != NULL)
+        {
+            map.slots[probe(old[i]->id)] = old[i];
+        }
+    }
+    mem_free((void *)old);
+    return 0;
+}
+
+/* The entry for `id`, added empty if it has none. Called with the write lock held. */
+static route_entry_t *add_entry(uint16_t id)
+{
+    route_entry_t *entry;
+
+    entry = find_entry(id);
+    if(entry != NULL)
+    {
+        return entry;
+    }
+
+    // kept at most half full, so probes stay short
+    if((map.count + 1) * 2 > ((map.slots == NULL) ? 0 : (size_t)1 << map.bits) && grow() < 0)
+    {
+        return NULL;
+    }
+
+    entry = (map.nspares > 0) ? map.spares[--map.nspares] : (route_entry_t *)mem_alloc(sizeof(route_entry_t));
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+    entry->id      = id;
+    entry->nroutes = 0;
+    entry->head    = 0;
+    entry->waiting = 0;
+
+    map.slots[probe(id)] = entry;
+    map.count++;
+    return entry;
+}
+
+/* Removes an entry with no routes and no mail, shifting back the entries probed past it. */
+static void remove_entry(route_entry_t *entry)
+{
+    size_t mask;
+    size_t hole;
+    size_t pos;
+
+    mask = ((size_t)1 << map.bits) - 1;
+    hole = probe(entry->id);
+    for(pos = (hole + 1) & mask; map.slots[pos] != NULL; pos = (pos + 1) & mask)
+    {
+        size_t home = home_of(map.slots[pos]->id, map.bits);
+
+        // an entry may fill the hole unless its home lies cyclically in (hole, pos]
+        if(((pos - home) & mask) >= ((pos - hole) & mask))
+        {
+            map.slots[hole] = map.slots[pos];
+            hole            = pos;
+        }
+    }
+    map.slots[hole] = NULL;
+    map.count--;
+
+    if(map.spares == NULL)
+    {
+        map.spares = (route_entry_t **)mem_alloc(ROUTE_SPARE_MAX * sizeof(*map.spares));
+    }
+    if(map.spares == NULL || map.nspares >= ROUTE_SPARE_MAX)
+    {
+        mem_free(entry);
+        return;
+    }
+    map.spares[map.nspares++] = entry;
+}
+
+/*
+ * Records a connection of user `id`, which has just logged in. Messages that waited for the
+ * user are moved into `queued`, which has room for ROUTE_MAILBOX; the caller owns their
+ * references. Connections past ROUTE_CONNS are not recorded and get no direct messages.
+ */
+int route_join(uint16_t id, const route_t *route, struct fanout_frame_t **queued, size_t *nqueued)
+{
+    route_entry_t *entry;
+
+    pthread_rwlock_wrlock(&map.lock);
+
+    entry = add_entry(id);
+    if(entry == NULL)
+    {
+        pthread_rwlock_unlock(&map.lock);
+        return -1;
+    }
+
+    if(entry->nroutes < ROUTE_CONNS)
+    {
+        entry->routes[entry->nroutes++] = *route;
+    }
+
+    for(*nqueued = 0; entry->waiting > 0; entry->waiting--)
+    {
+        queued[(*nqueued)++] = entry->mailbox[entry->head];
+        entry->head          = (uint8_t)((entry->head + 1) % ROUTE_MAILBOX);
+    }
+    map.queued -= *nqueued;
+
+    pthread_rwlock_unlock(&map.lock);
+    return 0;
+}
+
+/* Forgets a connection of user `id` as it logs out or closes. */
+void route_leave(uint16_t id, int fd, uint64_t conn_id)
+{
+    route_entry_t *entry;
+
+    pthread_rwlock_wrlock(&map.lock);
+
+    entry = find_entry(id);
+    for(uint8_t i = 0; entry != NULL && i < entry->nroutes; i++)
+    {
+        if(entry->routes[i].fd == fd && entry->routes[i].conn_id == conn_id)
+        {
+            entry->routes[i] = entry->routes[--entry->nroutes];
+            break;
+        }
+    }
+
+    if(entry != NULL && entry->nroutes == 0 && entry->waiting == 0)
+    {
+        remove_entry(entry);
+    }
+
+    pthread_rwlock_unlock(&map.lock);
+}
+
+/*
+ * Finds where to send a direct message to user `id`: copies the user's connections into
+ * `routes`, which has room for ROUTE_CONNS, and returns how many there are. A user who is not
+ * logged in has the message kept for their next login instead, with a reference of its own,
+ * and 0 is returned; -1 means their mailbox, or every mailbox together, is full.
+ */
+int route_message(uint16_t id, struct fanout_frame_t *frame, route_t *routes)
+{
+    route_entry_t *entry;
+    int            n;
+
+    // the common case, a recipient who is online, only needs the read lock
+    pthread_rwlock_rdlock(&map.lock);
+    entry = find_entry(id);
+    n     = (entry != NULL) ? entry->nroutes : 0;
+    if(n > 0)
+    {
+        memcpy(routes, entry->routes, (size_t)n * sizeof(*routes));
+    }
+    pthread_rwlock_unlock(&map.lock);
+    if(n > 0)
+    {
+        return n;
+    }
+
+    // they may have logged in since the lock was let go
+    pthread_rwlock_wrlock(&map.lock);
+    entry = add_entry(id);
+    if(entry != NULL && entry->nroutes > 0)
+    {
+        n = entry->nroutes;
+        memcpy(routes, entry->routes, (size_t)n * sizeof(*routes));
+    }
+    else if(entry == NULL || entry->waiting == ROUTE_MAILBOX || map.queued >= ROUTE_QUEUED_MAX)
+    {
+        n = -1;
+        if(entry != NULL && entry->waiting == 0)
+        {
+            remove_entry(entry);
+        }
+    }
+    else
+    {
+        fanout_hold(frame);
+        entry->mailbox[(entry->head + entry->waiting) % ROUTE_MAILBOX] = frame;
+        entry->waiting++;
+        map.queued++;
+        n = 0;
+    }
+
+    pthread_rwlock_unlock(&map.lock);
+    return n;
+}
+
+/* Frees the map and the messages nobody came back for. Called once no reactor is left to use it. */
+void route_destroy(void)
+{
+    size_t cap;
+
+    cap = (map.slots == NULL) ? 0 : (size_t)1 << map.bits;
+    for(size_t i = 0; i < cap; i++)
+    {
+        route_entry_t *entry = map.slots[i];
+
+        if(entry == NULL)
+        {
+            continue;
+        }
+        for(uint8_t k = 0; k < entry->waiting; k++)
+        {
+            fanout_release(entry->mailbox[(entry->head + k) % ROUTE_MAILBOX]);
+        }
+        mem_free(entry);
+    }
+    for(size_t i = 0; i < map.nspares; i++)
+    {
+        mem_free(map.spares[i]);
+    }
+    mem_free((void *)map.slots);
+    mem_free((void *)map.spares);
+    map.slots   = NULL;
+    map.spares  = NULL;
+    map.count   = 0;
+    map.queued  = 0;
+    map.nspares = 0;
+}
@@ -0,0 +1,91 @@
+#include "schema.h"
+#include "channel.h"
+#include "messaging.h"
+
+#define SCHEMA(name, fields) {(name), (fields), sizeof(fields) / sizeof((fields)[0])}
+
+static const codec_field_t credential_fields[] = {
+    {"username", UTF8STRING, 1, UINT8_MAX, CODEC_UTF8},
+    {"password", UTF8STRING, 1, UINT8_MAX, CODEC_UTF8},
+};
+
+static const codec_field_t chat_fields[] = {
+    {"timestamp", GeneralizedTime, 1, UINT8_MAX, 0         },
+    {"content",   UTF8STRING,      0, UINT8_MAX, CODEC_UTF8},
+    {"username",  UTF8STRING,      1, UINT8_MAX, CODEC_UTF8},
+};
+
+static const codec_field_t channel_fields[] = {
+    {"channel", UTF8STRING, 1, CHANNEL_NAME_MAX, CODEC_UTF8},
+};
+
+static const codec_field_t channel_chat_fields[] = {
+    {"channel",   UTF8STRING,      1, CHANNEL_NAME_MAX, CODEC_UTF8},
+    {"timestamp", GeneralizedTime, 1, UINT8_MAX,        0         },
+    {"content",   UTF8STRING,      0, UINT8_MAX,        CODEC_UTF8},
+    {"username",  UTF8STRING,      1, UINT8_MAX,        CODEC_UTF8},
+};
+
+static const codec_field_t direct_fields[] = {
+    {"recipient", INTEGER,         2, 2,         0         },
+    {"timestamp", GeneralizedTime, 1, UINT8_MAX, 0         },
+    {"content",   UTF8STRING,      0, UINT8_MAX, CODEC_UTF8},
+    {"username",  UTF8STRING,      1, UINT8_MAX, CODEC_UTF8},
+};
+
+static const codec_field_t ack_fields[] = {
+    {"type", ENUMERATED, 1, 1, 0},
+};
+
+static const codec_field_t error_fields[] = {
+    {"code",    INTEGER,    1, 1,         0         },
+    {"message", UTF8STRING, 0, UINT8_MAX, CODEC_UTF8},
+};
+
+static const codec_field_t login_fields[] = {
+    {"user_id", INTEGER, 2, 2, 0},
+};
+
+static const codec_field_t list_get_fields[] = {
+    {"start", INTEGER, 2, 2, 0},
+    {"limit", INTEGER, 1, 1, 0},
+};
+
+static const codec_field_t list_page_fields[] = {
+    {"generation", INTEGER, 4, 4, 0},
+    {"total",      INTEGER, 2, 2, 0},
+    {"next",       INTEGER, 2, 2, 0},
+    {"more",       BOOLEAN, 1, 1, 0},
+};
+
+static const codec_field_t list_user_fields[] = {
+    {"user_id",  INTEGER,    2, 2,         0         },
+    {"username", UTF8STRING, 1, UINT8_MAX, CODEC_UTF8},
+};
+
+static const codec_field_t history_get_fields[] = {
+    {"channel", UTF8STRING, 0, CHANNEL_NAME_MAX, CODEC_UTF8},
+    {"since",   INTEGER,    4, 4,                0         },
+    {"limit",   INTEGER,    1, 1,                0         },
+};
+
+static const codec_field_t history_page_fields[] = {
+    {"last",   INTEGER, 4, 4, 0},
+    {"oldest", INTEGER, 4, 4, 0},
+    {"count",  INTEGER, 1, 1, 0},
+    {"more",   BOOLEAN, 1, 1, 0},
+};
+
+const codec_schema_t schema_credentials  = SCHEMA("credentials", credential_fields);
+const codec_schema_t schema_chat         = SCHEMA("chat", chat_fields);
+const codec_schema_t schema_ack          = SCHEMA("ack", ack_fields);
+const codec_schema_t schema_error        = SCHEMA("error", error_fields);
+const codec_schema_t schema_login        = SCHEMA("login", login_fields);
+const codec_schema_t schema_list_get     = SCHEMA("list_get", list_get_fields);
+const codec_schema_t schema_list_page    = SCHEMA("list_page", list_page_fields);
+const codec_schema_t schema_list_user    = SCHEMA("list_user", list_user_fields);
+const codec_schema_t schema_channel      = SCHEMA("channel", channel_fields);
+const codec_schema_t schema_channel_chat = SCHEMA("channel_chat", channel_chat_fields);
+const codec_schema_t schema_direct       = SCHEMA("direct", direct_fields);
+const codec_schema_t schema_history_get  = SCHEMA("history_get", history_get_fields);
+const codec_schema_t schema_history_page = SCHEMA("history_page", history_page_fields);
@@ -1,28 +1,54 @@
+#include "account.h"
 #include "args.h"
+#include "chat.h"
+#include "connection.h"
+#include "database.h"
+#include "fanout.h"
+#include "frames.h"
 #include "fsm.h"
+#include "history.h"
+#include "io.h"
+#include "list.h"
+#include "mem.h"
 #include "messaging.h"
 #include "networking.h"
+#include "online.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "route.h"
+#include "utf8.h"
 #include "utils.h"
+#include "workers.h"
 #include <errno.h>
 #include <memory.h>
 #include <netinet/in.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 
 #define INADDRESS "0.0.0.0"
 #define OUTADDRESS "127.0.0.1"
-#define BACKLOG 5
+#define BACKLOG SOMAXCONN
 #define PORT "8081"
 #define SM_PORT "8082"
+#define SM_TIMEOUT 3000    // 3s
 
 int main(int argc, char *argv[])
 {
-    int    retval;
-    int    server_fd;
-    int    sm_fd;
-    args_t args;
-    int    err;
+    int           retval;
+    int          *server_fds;
+    int           sm_fd;
+    args_t        args;
+    int           err;
+    reactor_t    *reactors;
+    size_t        ready;
+    int           pk;
+    atomic_int    user_count;
+    char          db_name[] = "meta_user";
+    DBO           meta_userDB;
+    worker_pool_t pool;
+    int           pool_ready;
 
     const unsigned char sm_msg[] = {
         ACC_Login,    // 10
@@ -39,25 +65,122 @@ int main(int argc, char *argv[])
 
     printf("Server launching... (press Ctrl+C to interrupt)\n");
 
-    retval = EXIT_SUCCESS;
+    retval     = EXIT_FAILURE;
+    sm_fd      = -1;
+    ready      = 0;
+    pool_ready = 0;
 
     memset(&args, 0, sizeof(args_t));
     args.addr = INADDRESS;
     convert_port(PORT, &args.port);
     args.sm_addr = OUTADDRESS;
     convert_port(SM_PORT, &args.sm_port);
+    args.max_clients = DEFAULT_MAX_CLIENTS;
+    args.threads     = 1;
+    args.workers     = DEFAULT_WORKERS;
+    args.io_uring    = 0;
+    args.backlog     = BACKLOG;
+    args.out_high    = CONN_OUT_HIGH_WATERMARK;
+    args.out_low     = CONN_OUT_LOW_WATERMARK;
+    args.history_dir = HISTORY_DIR;
 
     get_arguments(&args, argc, argv);
 
-    // Start TCP Server
-    server_fd = tcp_server(args.addr, args.port, BACKLOG, &err);
-    if(server_fd < 0)
+    meta_userDB.name = db_name;
+    meta_userDB.db   = NULL;
+
+    server_fds = (int *)calloc(args.threads, sizeof(int));
+    reactors   = (reactor_t *)calloc(args.threads, sizeof(reactor_t));
+    if(server_fds == NULL || reactors == NULL)
+    {
+        perror("Malloc failed to allocate memory\n");
+        goto cleanup;
+    }
+
+    utf8_init();
+    printf("UTF-8 validation: %s\n", utf8_impl_name());
+
+    if(frames_init() < 0)
+    {
+        fprintf(stderr, "main: Failed to encode the constant frames.\n");
+        goto cleanup;
+    }
+
+    if(account_register() < 0 || chat_register() < 0 || list_register() < 0)
+    {
+        fprintf(stderr, "main: Failed to register the message handlers.\n");
+        goto cleanup;
+    }
+
+    if(rate_init() < 0)
+    {
+        fprintf(stderr, "main: Failed to set up the rate limits.\n");
+        goto cleanup;
+    }
+
+    if(history_init(args.history_dir) < 0)
+    {
+        fprintf(stderr, "main: Failed to open the chat history.\n");
+        goto cleanup;
+    }
+
+    if(init_pk(&meta_userDB, USER_PK, &pk) < 0)
+    {
+        perror("init_pk error\n");
+        goto cleanup;
+    }
+    atomic_init(&user_count, pk);
+
+    if(database_open(&meta_userDB, &err) < 0)
+    {
+        perror("database error");
+        goto cleanup;
+    }
+
+    if(args.workers > 0)
+    {
+        if(worker_pool_init(&pool, args.workers, WORKER_QUEUE_CAPACITY, &err) < 0)
+        {
+            fprintf(stderr, "main::worker_pool_init: Failed to start workers.\n");
+            goto cleanup;
+        }
+        pool_ready = 1;
+    }
+
+    // Start TCP Server: one listener per reactor, sharing the port through SO_REUSEPORT
+    for(ready = 0; ready < args.threads; ready++)
     {
-        fprintf(stderr, "main::tcp_server: Failed to create TCP server.\n");
-        return EXIT_FAILURE;
+        err               = 0;
+        server_fds[ready] = tcp_server(args.addr, args.port, args.backlog, (args.threads > 1) ? O_SOCK_REUSEPORT : 0, &err);
+        if(server_fds[ready] < 0 || err != 0)
+        {
+            fprintf(stderr, "main::tcp_server: Failed to create TCP server.\n");
+            if(server_fds[ready] >= 0)
+            {
+                close(server_fds[ready]);
+            }
+            goto cleanup;
+        }
+
+        if(reactor_init(&reactors[ready], ready, server_fds[ready], args.max_clients, &err) < 0)
+        {
+            fprintf(stderr, "main::reactor_init: Failed to create event loop.\n");
+            close(server_fds[ready]);
+            goto cleanup;
+        }
+        reactors[ready].user_count = &user_count;
+        reactors[ready].pool       = pool_ready ? &pool : NULL;
+        reactors[ready].group      = reactors;
+        reactors[ready].group_size = args.threads;
+        reactors[ready].use_uring  = args.io_uring;
+        reactors[ready].out_high   = args.out_high;
+        reactors[ready].out_low    = args.out_low;
     }
 
-    printf("Listening on %s:%d\n", args.addr, args.port);
+    // a single reactor keeps meta_user in sync
+    reactors[0].meta_userDB = &meta_userDB;
+
+    printf("Listening on %s:%d with %zu event loop(s)\n", args.addr, args.port, args.threads);
 
     // Start TCP Client
     sm_fd = tcp_client(args.sm_addr, args.sm_port, &err);
@@ -70,17 +193,55 @@ int main(int argc, char *argv[])
     printf("Connect to server manager at %s:%d\n", args.sm_addr, args.sm_port);
 
     // just for demo
-    if(write(sm_fd, sm_msg, sizeof(user_count_t)) < 0)
+    if(sm_fd >= 0)
     {
-        fprintf(stderr, "main::tcp_client: write to server manager failed.\n");
-        // return EXIT_FAILURE;
+        code_t sm_code;
+
+        sm_code = io_result_code(write_deadline(sm_fd, sm_msg, sizeof(user_count_t), io_deadline(SM_TIMEOUT), &err));
+        if(sm_code != OK)
+        {
+            fprintf(stderr, "main::tcp_client: write to server manager failed: %s.\n", code_to_string(&sm_code));
+            // return EXIT_FAILURE;
+        }
     }
 
     // Wait for client connections
-    err = 0;
-    event_loop(server_fd, &err);
+    if(reactor_group_run(reactors, args.threads) == 0)
+    {
+        retval = EXIT_SUCCESS;
+    }
+    mem_print_stats();
 
-    close(sm_fd);
-    close(server_fd);
+cleanup:
+    // workers may still hand jobs back, so they stop before the reactors go away
+    if(pool_ready)
+    {
+        worker_pool_destroy(&pool);
+    }
+
+    if(meta_userDB.db != NULL)
+    {
+        printf("syncing meta_user in cleanup...\n");
+        store_int(meta_userDB.db, USER_PK, atomic_load(&user_count));
+        dbm_close(meta_userDB.db);
+    }
+
+    for(size_t i = 0; i < ready; i++)
+    {
+        reactor_destroy(&reactors[i]);
+        close(server_fds[i]);
+    }
+    online_destroy();
+    route_destroy();
+    history_destroy();
+    fanout_destroy();
+    rate_destroy();
+
+    if(sm_fd >= 0)
+    {
+        close(sm_fd);
+    }
+    free(reactors);
+    free(server_fds);
     return retval;
 }
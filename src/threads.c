@@ -5,7 +5,7 @@
 #include <stdio.h>
 #include <unistd.h>
 
-int start_thread(void *(*thread_fn)(void *targs), void *targs, size_t opts)
+int start_thread(void *(*thread_fn)(void *targs), void *targs, size_t opts, pthread_t *thread_id)
 {
     pthread_t thread;
 
@@ -21,6 +21,11 @@ int start_thread(void *(*thread_fn)(void *targs), void *targs, size_t opts)
         return -2;
     }
 
+    if(thread_id != NULL)
+    {
+        *thread_id = thread;
+    }
+
     if(opts & O_THREAD_JOIN)
     {
         errno = pthread_join(thread, NULL);
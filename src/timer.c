@@ -0,0 +1,182 @@
+#include "timer.h"
+#include <time.h>
+
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+static void insert(timer_wheel_t *wheel, wheel_timer_t *timer);
+static void cascade(timer_wheel_t *wheel, int level);
+
+uint64_t timer_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now_ms, void *owner)
+{
+    for(int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for(int slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+
+    wheel->now      = 0;
+    wheel->start_ms = now_ms;
+    wheel->owner    = owner;
+}
+
+void timer_init(wheel_timer_t *timer, timer_fn fn, void *arg)
+{
+    timer->next    = NULL;
+    timer->prev    = NULL;
+    timer->expires = 0;
+    timer->fn      = fn;
+    timer->arg     = arg;
+    timer->active  = 0;
+}
+
+/* Files a timer under the coarsest level whose span still separates it from now. */
+static void insert(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    wheel_timer_t *head;
+    uint64_t       delta;
+    int            level;
+
+    delta = timer->expires - wheel->now;
+    level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    head             = &wheel->slots[level][(timer->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK];
+    timer->prev      = head->prev;
+    timer->next      = head;
+    head->prev->next = timer;
+    head->prev       = timer;
+    timer->active    = 1;
+}
+
+/* (Re)arms a timer to fire `delay_ms` from the wheel's current tick, rounded up to whole ticks. */
+void timer_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t delay_ms)
+{
+    uint64_t ticks;
+    uint64_t max_ticks;
+
+    timer_cancel(timer);
+
+    ticks     = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    max_ticks = (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+    if(ticks == 0)
+    {
+        ticks = 1;
+    }
+    if(ticks > max_ticks)
+    {
+        ticks = max_ticks;
+    }
+
+    timer->expires = wheel->now + ticks;
+    insert(wheel, timer);
+}
+
+void timer_cancel(wheel_timer_t *timer)
+{
+    if(!timer->active)
+    {
+        return;
+    }
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next       = NULL;
+    timer->prev       = NULL;
+    timer->active     = 0;
+}
+
+/* Moves the timers of the current slot at `level` one level down, now that they are within its span. */
+static void cascade(timer_wheel_t *wheel, int level)
+{
+    wheel_timer_t *head;
+    wheel_timer_t *timer;
+
+    head = &wheel->slots[level][(wheel->now >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK];
+    while(head->next != head)
+    {
+        timer = head->next;
+        timer_cancel(timer);
+        insert(wheel, timer);
+    }
+}
+
+/* Fires every timer due by `now_ms`, one tick at a time. Callbacks may schedule or cancel any timer. */
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms)
+{
+    uint64_t target;
+
+    target = (now_ms - wheel->start_ms) / TIMER_TICK_MS;
+    while(wheel->now < target)
+    {
+        wheel_timer_t *head;
+
+        wheel->now++;
+
+        // each time a level wraps, the next level's current slot comes within reach
+        for(int level = 1; level < TIMER_LEVELS; level++)
+        {
+            if((wheel->now & ((1ULL << (TIMER_LEVEL_BITS * level)) - 1)) != 0)
+            {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        head = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+        while(head->next != head)
+        {
+            wheel_timer_t *timer = head->next;
+
+            timer_cancel(timer);
+            timer->fn(wheel->owner, timer->arg);
+        }
+    }
+}
+
+/*
+ * Milliseconds until the next tick that has something to do (a timer to fire or a level to
+ * cascade), capped at `max_ms`; suitable as an epoll_wait timeout.
+ */
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms, int max_ms)
+{
+    uint64_t elapsed;
+    uint64_t due_ms;
+
+    for(uint64_t tick = wheel->now + 1; tick <= wheel->now + TIMER_SLOTS; tick++)
+    {
+        const wheel_timer_t *head = &wheel->slots[0][tick & TIMER_SLOT_MASK];
+
+        if(head->next == head && (tick & TIMER_SLOT_MASK) != 0)
+        {
+            continue;
+        }
+
+        due_ms  = tick * TIMER_TICK_MS;
+        elapsed = now_ms - wheel->start_ms;
+        if(due_ms <= elapsed)
+        {
+            return 0;
+        }
+        if(due_ms - elapsed < (uint64_t)max_ms)
+        {
+            return (int)(due_ms - elapsed);
+        }
+        break;
+    }
+
+    return max_ms;
+}
@@ -0,0 +1,414 @@
+#include "uring.h"
+#include <errno.h>
+#include <p101_c/p101_stdio.h>
+#include <p101_c/p101_stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int                  sys_io_uring_setup(unsigned entries, struct io_uring_params *params);
+static int                  sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz);
+static int                  sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args);
+static int                  setup_buffers(uring_t *ring, unsigned nbufs, size_t buf_size, int *err);
+static struct io_uring_sqe *get_sqe(uring_t *ring);
+static void                 publish(uring_t *ring);
+
+int uring_init(uring_t *ring, unsigned entries, unsigned nbufs, size_t buf_size, int *err)
+{
+    struct io_uring_params params;
+    unsigned              *sq_array;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ring->fd     = sys_io_uring_setup(entries, &params);
+    if(ring->fd < 0 && errno == EINVAL)
+    {
+        // older kernels: fall back to a plain ring
+        memset(&params, 0, sizeof(params));
+        ring->fd = sys_io_uring_setup(entries, &params);
+    }
+    if(ring->fd < 0)
+    {
+        perror("io_uring_setup error");
+        goto error;
+    }
+
+    if(!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        fprintf(stderr, "io_uring: kernel lacks IORING_FEAT_EXT_ARG\n");
+        errno = ENOSYS;
+        goto error;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_size > ring->sq_size)
+        {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED)
+    {
+        ring->sq_ptr = NULL;
+        perror("mmap error");
+        goto error;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            perror("mmap error");
+            goto error;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes      = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        perror("mmap error");
+        goto error;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head    = (unsigned *)((uint8_t *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail    = (unsigned *)((uint8_t *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask    = (unsigned *)((uint8_t *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->cq_head    = (unsigned *)((uint8_t *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail    = (unsigned *)((uint8_t *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask    = (unsigned *)((uint8_t *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)((uint8_t *)ring->cq_ptr + params.cq_off.cqes);
+
+    // sqe slots are used in ring order, so the indirection array is the identity
+    sq_array = (unsigned *)((uint8_t *)ring->sq_ptr + params.sq_off.array);
+    for(unsigned i = 0; i < params.sq_entries; i++)
+    {
+        sq_array[i] = i;
+    }
+    ring->sq_local_tail = *ring->sq_tail;
+
+    if(setup_buffers(ring, nbufs, buf_size, err) < 0)
+    {
+        uring_destroy(ring);
+        return -1;
+    }
+
+    return 0;
+
+error:
+    *err = errno;
+    uring_destroy(ring);
+    return -1;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    // the kernel lets go of the rings and buffers once the fd is closed
+    if(ring->fd >= 0)
+    {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+
+    if(ring->buf_ring != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        ring->buf_ring = NULL;
+    }
+    free(ring->bufs);
+    ring->bufs = NULL;
+
+    if(ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if(ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    ring->cq_ptr = NULL;
+    if(ring->sq_ptr != NULL)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+        ring->sq_ptr = NULL;
+    }
+}
+
+/*
+ * Hands every prepared sqe to the kernel and waits up to `timeout_ms` for a completion,
+ * all in one io_uring_enter. Sets *err to ETIME when the wait expired.
+ */
+int uring_submit_and_wait(uring_t *ring, int timeout_ms, int *err)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    int                           ret;
+
+    publish(ring);
+
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    ret = sys_io_uring_enter(ring->fd, ring->sq_pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(ret < 0)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    ring->sq_pending -= ((unsigned)ret < ring->sq_pending) ? (unsigned)ret : ring->sq_pending;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek(const uring_t *ring)
+{
+    unsigned head;
+
+    head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_advance(uring_t *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t *uring_buffer(const uring_t *ring, unsigned bid)
+{
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+/* Returns a provided buffer to the kernel once its bytes have been copied out. */
+void uring_recycle(uring_t *ring, unsigned bid)
+{
+    struct io_uring_buf *buf;
+    unsigned short       tail;
+
+    tail      = ring->buf_ring->tail;
+    buf       = &ring->buf_ring->bufs[tail & (ring->nbufs - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len  = (uint32_t)ring->buf_size;
+    buf->bid  = (uint16_t)bid;
+    __atomic_store_n(&ring->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+int uring_prep_accept_multishot(uring_t *ring, int fd, int flags, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = (uint32_t)flags;
+    sqe->user_data    = user_data;
+    return 0;
+}
+
+/* One recv that keeps completing into provided buffers until it runs out of them. */
+int uring_prep_recv_multishot(uring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_prep_poll_multishot(uring_t *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = user_data;
+    return 0;
+}
+
+int uring_prep_send(uring_t *ring, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t)(uintptr_t)buf;
+    sqe->len       = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/* Cancels the outstanding request submitted with `target` as its user_data. */
+int uring_prep_cancel(uring_t *ring, uint64_t target, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(ring);
+    if(sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = target;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+static int setup_buffers(uring_t *ring, unsigned nbufs, size_t buf_size, int *err)
+{
+    struct io_uring_buf_reg reg;
+
+    ring->nbufs         = nbufs;
+    ring->buf_size      = buf_size;
+    ring->buf_ring_size = nbufs * sizeof(struct io_uring_buf);
+    ring->buf_ring      = (struct io_uring_buf_ring *)mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        perror("mmap error");
+        *err = errno;
+        return -1;
+    }
+
+    ring->bufs = (uint8_t *)malloc(nbufs * buf_size);
+    if(ring->bufs == NULL)
+    {
+        perror("Malloc failed to allocate memory\n");
+        *err = errno;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = nbufs;
+    reg.bgid         = URING_BUFFER_GROUP;
+    if(sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        perror("io_uring_register error");
+        *err = errno;
+        return -1;
+    }
+
+    for(unsigned i = 0; i < nbufs; i++)
+    {
+        uring_recycle(ring, i);
+    }
+
+    return 0;
+}
+
+/* Next free sqe; when the queue is full everything prepared so far is submitted first. */
+static struct io_uring_sqe *get_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        int ret;
+
+        publish(ring);
+        ret = sys_io_uring_enter(ring->fd, ring->sq_pending, 0, 0, NULL, 0);
+        if(ret < 0)
+        {
+            perror("io_uring_enter error");
+            return NULL;
+        }
+        ring->sq_pending -= ((unsigned)ret < ring->sq_pending) ? (unsigned)ret : ring->sq_pending;
+
+        if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static void publish(uring_t *ring)
+{
+    unsigned tail;
+
+    tail = *ring->sq_tail;
+    if(tail != ring->sq_local_tail)
+    {
+        ring->sq_pending += ring->sq_local_tail - tail;
+        __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    }
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
@@ -0,0 +1,320 @@
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define UTF8_X86
+#endif
+
+typedef int (*utf8_fn)(const uint8_t *str, size_t len);
+
+// picked once by utf8_init before any thread starts; the scalar path is always safe
+static utf8_fn     utf8_impl      = utf8_valid_scalar;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const char *utf8_impl_desc = "scalar";             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Picks the widest validator this CPU runs. */
+void utf8_init(void)
+{
+#ifdef UTF8_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        utf8_impl      = utf8_valid_avx2;
+        utf8_impl_desc = "avx2";
+        return;
+    }
+    if(__builtin_cpu_supports("ssse3"))
+    {
+        utf8_impl      = utf8_valid_ssse3;
+        utf8_impl_desc = "ssse3";
+        return;
+    }
+#endif
+    utf8_impl      = utf8_valid_scalar;
+    utf8_impl_desc = "scalar";
+}
+
+const char *utf8_impl_name(void)
+{
+    return utf8_impl_desc;
+}
+
+/* 1 if `str` is well-formed UTF-8: no overlongs, surrogates, code points past U+10FFFF or cut sequences. */
+int utf8_valid(const uint8_t *str, size_t len)
+{
+    return utf8_impl(str, len);
+}
+
+/* Byte at a time, following the well-formed byte sequences table of the Unicode standard. */
+int utf8_valid_scalar(const uint8_t *str, size_t len)
+{
+    size_t i;
+
+    i = 0;
+    while(i < len)
+    {
+        uint8_t lead;
+        uint8_t lo;
+        uint8_t hi;
+        size_t  need;
+
+        lead = str[i];
+        if(lead < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        lo = 0x80;
+        hi = 0xBF;
+        if(lead < 0xC2)
+        {
+            return 0;
+        }
+        if(lead < 0xE0)
+        {
+            need = 1;
+        }
+        else if(lead < 0xF0)
+        {
+            need = 2;
+            lo   = (lead == 0xE0) ? 0xA0 : 0x80;
+            hi   = (lead == 0xED) ? 0x9F : 0xBF;
+        }
+        else if(lead < 0xF5)
+        {
+            need = 3;
+            lo   = (lead == 0xF0) ? 0x90 : 0x80;
+            hi   = (lead == 0xF4) ? 0x8F : 0xBF;
+        }
+        else
+        {
+            return 0;
+        }
+
+        if(len - i <= need || str[i + 1] < lo || str[i + 1] > hi)
+        {
+            return 0;
+        }
+        for(size_t k = 2; k <= need; k++)
+        {
+            if((str[i + k] & 0xC0) != 0x80)
+            {
+                return 0;
+            }
+        }
+        i += need + 1;
+    }
+
+    return 1;
+}
+
+#ifdef UTF8_X86
+
+/*
+ * The vector paths use the lookup algorithm of Keiser and Lemire ("Validating UTF-8 in less
+ * than one instruction per byte"). Each byte is classified by three 16-entry tables: the high
+ * and low nibble of the byte before it and its own high nibble. ANDing the three gives a
+ * nonzero byte exactly where a 2-byte pattern is illegal. The third and fourth bytes of long
+ * sequences are then checked against the lead two or three bytes back. Blocks that are all
+ * ASCII skip the tables; they only have to show the block before them did not end mid-sequence.
+ * What is left after the last whole block goes to the next narrower validator.
+ */
+    #define TOO_SHORT (1 << 0)    // lead not followed by a continuation
+    #define TOO_LONG (1 << 1)     // continuation after ASCII
+    #define OVERLONG_3 (1 << 2)
+    #define TOO_LARGE (1 << 3)
+    #define SURROGATE (1 << 4)
+    #define OVERLONG_2 (1 << 5)
+    #define TOO_LARGE_1000 (1 << 6)
+    #define OVERLONG_4 (1 << 6)
+    #define TWO_CONTS (1 << 7)    // continuation after continuation, unless a long lead explains it
+    #define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// clang-format off
+static const uint8_t byte_1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+static const uint8_t byte_1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY, CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+static const uint8_t byte_2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// a byte above these in the last three positions starts a sequence the block does not finish
+static const uint8_t incomplete_tail[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+// clang-format on
+
+/*
+ * Where a narrower validator should pick up after the blocks before `pos`: the lead of a
+ * sequence the last block may have cut, so that sequence is checked whole. Everything before
+ * it has been checked already.
+ */
+static size_t sequence_start(const uint8_t *str, size_t pos)
+{
+    for(size_t k = 1; k <= 3 && k <= pos; k++)
+    {
+        uint8_t byte = str[pos - k];
+
+        if(byte < 0x80)
+        {
+            break;
+        }
+        if(byte >= 0xC0)
+        {
+            return pos - k;
+        }
+    }
+    return pos;
+}
+
+__attribute__((target("ssse3"))) static __m128i ssse3_nibble_lookup(const uint8_t *table, __m128i idx)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)table), _mm_and_si128(idx, _mm_set1_epi8(0x0F)));
+}
+
+/* Errors in `input`, given the block before it. */
+__attribute__((target("ssse3"))) static __m128i ssse3_check_block(__m128i input, __m128i prev_input)
+{
+    __m128i prev1;
+    __m128i prev2;
+    __m128i prev3;
+    __m128i special;
+    __m128i must23;
+
+    prev1   = _mm_alignr_epi8(input, prev_input, 15);
+    special = _mm_and_si128(_mm_and_si128(ssse3_nibble_lookup(byte_1_high, _mm_srli_epi16(prev1, 4)), ssse3_nibble_lookup(byte_1_low, prev1)), ssse3_nibble_lookup(byte_2_high, _mm_srli_epi16(input, 4)));
+
+    prev2  = _mm_alignr_epi8(input, prev_input, 14);
+    prev3  = _mm_alignr_epi8(input, prev_input, 13);
+    must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))), _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80))));
+    must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, special);
+}
+
+__attribute__((target("ssse3"))) int utf8_valid_ssse3(const uint8_t *str, size_t len)
+{
+    const __m128i tail = _mm_loadu_si128((const __m128i *)(incomplete_tail + 16));
+    __m128i       error;
+    __m128i       prev_input;
+    __m128i       prev_incomplete;
+    size_t        pos;
+
+    error           = _mm_setzero_si128();
+    prev_input      = _mm_setzero_si128();
+    prev_incomplete = _mm_setzero_si128();
+    for(pos = 0; len - pos >= sizeof(__m128i); pos += sizeof(__m128i))
+    {
+        __m128i input;
+
+        input = _mm_loadu_si128((const __m128i *)(str + pos));
+        if(_mm_movemask_epi8(input) == 0)
+        {
+            error = _mm_or_si128(error, prev_incomplete);
+        }
+        else
+        {
+            error           = _mm_or_si128(error, ssse3_check_block(input, prev_input));
+            prev_incomplete = _mm_subs_epu8(input, tail);
+        }
+        prev_input = input;
+    }
+
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF)
+    {
+        return 0;
+    }
+
+    pos = sequence_start(str, pos);
+    return utf8_valid_scalar(str + pos, len - pos);
+}
+
+__attribute__((target("avx2"))) static __m256i avx2_nibble_lookup(const uint8_t *table, __m256i idx)
+{
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table)), _mm256_and_si256(idx, _mm256_set1_epi8(0x0F)));
+}
+
+/* Errors in `input`, given the block before it. alignr works per 128-bit lane, hence the permute. */
+__attribute__((target("avx2"))) static __m256i avx2_check_block(__m256i input, __m256i prev_input)
+{
+    __m256i shifted;
+    __m256i prev1;
+    __m256i prev2;
+    __m256i prev3;
+    __m256i special;
+    __m256i must23;
+
+    shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+    prev1   = _mm256_alignr_epi8(input, shifted, 15);
+    special = _mm256_and_si256(_mm256_and_si256(avx2_nibble_lookup(byte_1_high, _mm256_srli_epi16(prev1, 4)), avx2_nibble_lookup(byte_1_low, prev1)), avx2_nibble_lookup(byte_2_high, _mm256_srli_epi16(input, 4)));
+
+    prev2  = _mm256_alignr_epi8(input, shifted, 14);
+    prev3  = _mm256_alignr_epi8(input, shifted, 13);
+    must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))), _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+    must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, special);
+}
+
+__attribute__((target("avx2"))) int utf8_valid_avx2(const uint8_t *str, size_t len)
+{
+    const __m256i tail = _mm256_loadu_si256((const __m256i *)incomplete_tail);
+    __m256i       error;
+    __m256i       prev_input;
+    __m256i       prev_incomplete;
+    size_t        pos;
+
+    error           = _mm256_setzero_si256();
+    prev_input      = _mm256_setzero_si256();
+    prev_incomplete = _mm256_setzero_si256();
+    for(pos = 0; len - pos >= sizeof(__m256i); pos += sizeof(__m256i))
+    {
+        __m256i input;
+
+        input = _mm256_loadu_si256((const __m256i *)(str + pos));
+        if(_mm256_movemask_epi8(input) == 0)
+        {
+            error = _mm256_or_si256(error, prev_incomplete);
+        }
+        else
+        {
+            error           = _mm256_or_si256(error, avx2_check_block(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, tail);
+        }
+        prev_input = input;
+    }
+
+    if(!_mm256_testz_si256(error, error))
+    {
+        return 0;
+    }
+
+    // every AVX2 CPU has SSSE3
+    pos = sequence_start(str, pos);
+    return utf8_valid_ssse3(str + pos, len - pos);
+}
+
+#endif
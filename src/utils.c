@@ -11,6 +11,7 @@ _Pragma("clang diagnostic ignored \"-Wdisabled-macro-expansion\"")
 #define SIG_BUF 50
 
     volatile sig_atomic_t running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+volatile sig_atomic_t stats_requested = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
 /* Calls `free()` and nullifies the ptr. */
 void nfree(void **ptr)
@@ -34,6 +35,12 @@ static void handle_signal(int sig)
         running = 0;
         snprintf(message, sizeof(message), "\n%s\n", "Shutting down gracefully...");
     }
+    else if(sig == SIGUSR1)
+    {
+        // each reactor notices the change and dumps its stats
+        stats_requested = stats_requested + 1;
+        snprintf(message, sizeof(message), "%s\n", "Dumping stats...");
+    }
     write(STDOUT_FILENO, message, strlen(message));
 }
 
@@ -51,4 +58,18 @@ void setup_signal(void)
         perror("sigaction");
         exit(EXIT_FAILURE);
     }
+
+    if(sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // Connections stay open, so a peer can vanish between two writes
+    sa.sa_handler = SIG_IGN;
+    if(sigaction(SIGPIPE, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
 }
@@ -0,0 +1,230 @@
+#include "workers.h"
+#include "mem.h"
+#include "reactor.h"
+#include "threads.h"
+#include <errno.h>
+#include <p101_c/p101_stdio.h>
+#include <p101_c/p101_stdlib.h>
+#include <string.h>
+
+static void *worker_main(void *args);
+
+int worker_pool_init(worker_pool_t *pool, size_t workers, size_t capacity, int *err)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->capacity = capacity;
+
+    errno = pthread_mutex_init(&pool->lock, NULL);
+    if(errno != 0)
+    {
+        perror("pthread_mutex_init error");
+        *err = errno;
+        return -1;
+    }
+
+    errno = pthread_cond_init(&pool->ready, NULL);
+    if(errno != 0)
+    {
+        perror("pthread_cond_init error");
+        *err = errno;
+        pthread_mutex_destroy(&pool->lock);
+        return -1;
+    }
+
+    pool->threads = (pthread_t *)calloc(workers, sizeof(pthread_t));
+    if(pool->threads == NULL)
+    {
+        *err = errno;
+        worker_pool_destroy(pool);
+        return -1;
+    }
+
+    for(size_t i = 0; i < workers; i++)
+    {
+        if(start_thread(worker_main, pool, 0, &pool->threads[i]) != 0)
+        {
+            *err = errno;
+            worker_pool_destroy(pool);
+            return -1;
+        }
+        pool->nthreads++;
+    }
+
+    return 0;
+}
+
+/* Stops the workers after their current job and drops anything still queued. */
+void worker_pool_destroy(worker_pool_t *pool)
+{
+    job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(size_t i = 0; i < pool->nthreads; i++)
+    {
+        errno = pthread_join(pool->threads[i], NULL);
+        if(errno != 0)
+        {
+            perror("worker_pool_destroy::pthread_join");
+        }
+    }
+
+    job = pool->head;
+    while(job != NULL)
+    {
+        job_t *next = job->next;
+
+        job_destroy(job);
+        job = next;
+    }
+
+    free(pool->threads);
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Snapshots a fully read request for a worker. The frame is copied and every pointer the
+ * handler writes through is redirected into the job, so the connection may close meanwhile.
+ * Jobs come from the reactor's spares when one is big enough.
+ */
+job_t *job_create(const request_t *request, ssize_t (*func)(request_t *request))
+{
+    reactor_t *reactor;
+    job_t     *job;
+    size_t     size;
+    int        err;
+
+    err     = 0;
+    reactor = request->reactor;
+    size    = HEADER_SIZE + request->len;
+    job     = reactor->spare_jobs;
+    if(job != NULL && job->cap >= size)
+    {
+        reactor->spare_jobs = job->next;
+        reactor->nspare_jobs--;
+    }
+    else
+    {
+        size_t cap = (size < JOB_CONTENT_MIN) ? JOB_CONTENT_MIN : size;
+
+        job = (job_t *)mem_alloc(sizeof(job_t) + cap);
+        if(job == NULL)
+        {
+            perror("Malloc failed to allocate memory\n");
+            return NULL;
+        }
+        job->cap = cap;
+        arena_init(&job->arena);
+    }
+
+    job->next       = NULL;
+    job->reactor    = reactor;
+    job->fd         = request->conn->fd;
+    job->conn_id    = request->conn->id;
+    job->session_id = *request->session_id;
+    job->func       = func;
+    job->result     = -1;
+    job->request    = *request;
+    memcpy(job->content, request->content, size);
+
+    job->request.content    = job->content;
+    job->request.client_fd  = &job->fd;
+    job->request.session_id = &job->session_id;
+    job->request.conn       = NULL;
+    job->request.arena      = &job->arena;
+
+    // like the reactor's per-frame arena, sized from the payload; a failure here only means spilling later
+    arena_reserve(&job->arena, request->len, &err);
+    return job;
+}
+
+/* Hands a finished job back to its reactor for reuse. Only called on that reactor's thread. */
+void job_release(job_t *job)
+{
+    reactor_t *reactor = job->reactor;
+
+    if(reactor->nspare_jobs >= JOB_SPARE_MAX)
+    {
+        job_destroy(job);
+        return;
+    }
+
+    arena_reset(&job->arena);
+    job->next           = reactor->spare_jobs;
+    reactor->spare_jobs = job;
+    reactor->nspare_jobs++;
+}
+
+void job_destroy(job_t *job)
+{
+    arena_destroy(&job->arena);
+    mem_free(job);
+}
+
+/* Queues a job; fails instead of blocking when the queue is full. */
+int worker_pool_submit(worker_pool_t *pool, job_t *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    if(pool->stopping || pool->queued >= pool->capacity)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    if(pool->tail != NULL)
+    {
+        pool->tail->next = job;
+    }
+    else
+    {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->queued++;
+
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static void *worker_main(void *args)
+{
+    worker_pool_t *pool;
+
+    pool = (worker_pool_t *)args;
+
+    while(1)
+    {
+        job_t *job;
+
+        pthread_mutex_lock(&pool->lock);
+        while(pool->head == NULL && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if(pool->stopping)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        job        = pool->head;
+        pool->head = job->next;
+        if(pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->next   = NULL;
+        job->result = job->func(&job->request);
+        reactor_complete(job->reactor, job);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,160 @@
+/*
+ * Decode cost of the schema codec against the unchecked pointer walk the handlers used before it.
+ *
+ * "latency" feeds each decode's result into the next one, the way a reactor decodes one frame
+ * and acts on it; "throughput" runs independent decodes back to back so the CPU can overlap them.
+ *
+ * Built as the bench_codec target listed in files.txt, or by hand:
+ *
+ *   gcc -std=c17 -O2 -D_GNU_SOURCE -Iinclude tests/bench_codec.c src/codec.c src/schema.c src/response.c src/utf8.c -o bench_codec
+ *   ./bench_codec [iterations]
+ */
+#include "messaging.h"
+#include "schema.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 20000000UL
+#define ROUNDS 5    // best of, to ride out scheduler noise
+
+typedef int (*decode_fn)(const codec_schema_t *schema, const uint8_t *body, size_t len, codec_view_t *views);
+
+typedef struct sample_t
+{
+    const char           *name;
+    const codec_schema_t *schema;
+    uint8_t               body[UINT8_MAX];
+    size_t                len;
+} sample_t;
+
+static volatile size_t sink;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+static size_t put_tlv(uint8_t *dst, uint8_t tag, const char *value)
+{
+    size_t len;
+
+    len    = strlen(value);
+    dst[0] = tag;
+    dst[1] = (uint8_t)len;
+    memcpy(dst + 2, value, len);
+    return len + 2;
+}
+
+/*
+ * The walk account_create/account_login and chat_broadcast did, into the same views the codec
+ * fills: no tag, length or bounds checks.
+ */
+__attribute__((noinline)) static int legacy_decode(const codec_schema_t *schema, const uint8_t *body, size_t len, codec_view_t *views)
+{
+    const uint8_t *ptr;
+
+    (void)len;
+    ptr = body + 1;
+    for(size_t i = 0; i < schema->nfields; i++)
+    {
+        memcpy(&views[i].len, ptr, sizeof(views[i].len));
+        ptr += sizeof(views[i].len);
+        views[i].ptr = ptr;
+        ptr += views[i].len + 1;
+    }
+    return 0;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+/* Nanoseconds per decode. With `chained`, each decode starts only once the previous one's last length is known. */
+static double bench(decode_fn decode, const sample_t *sample, unsigned long iterations, int chained)
+{
+    struct timespec start;
+    struct timespec end;
+    codec_view_t    views[CHAT_FIELDS];
+    const uint8_t  *body;
+    size_t          last;
+    size_t          total;
+
+    body  = sample->body;
+    last  = sample->schema->nfields - 1;
+    total = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(unsigned long i = 0; i < iterations; i++)
+    {
+        if(decode(sample->schema, body, sample->len, views) < 0)
+        {
+            fprintf(stderr, "%s: sample does not decode\n", sample->name);
+            exit(EXIT_FAILURE);
+        }
+        total += (size_t)(uintptr_t)views[0].ptr + views[last].len;
+
+        if(chained)
+        {
+            size_t len  = views[last].len;
+            size_t same = len;
+
+            // zero, but only the CPU can work that out, and only once the decode is done
+            __asm__("" : "+r"(same));
+            body = sample->body + (len - same);
+        }
+        __asm__ volatile("" : : "g"(sample->body) : "memory");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sink = total;
+    return elapsed_ns(&start, &end) / (double)iterations;
+}
+
+static double best_of(decode_fn decode, const sample_t *sample, unsigned long iterations, int chained)
+{
+    double best;
+
+    best = bench(decode, sample, iterations, chained);
+    for(int i = 1; i < ROUNDS; i++)
+    {
+        double ns;
+
+        ns = bench(decode, sample, iterations, chained);
+        if(ns < best)
+        {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    sample_t      samples[2];
+    unsigned long iterations;
+
+    iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+
+    samples[0].name   = "login";
+    samples[0].schema = &schema_credentials;
+    samples[0].len    = put_tlv(samples[0].body, UTF8STRING, "Testing");
+    samples[0].len += put_tlv(samples[0].body + samples[0].len, UTF8STRING, "Password123");
+
+    samples[1].name   = "chat";
+    samples[1].schema = &schema_chat;
+    samples[1].len    = put_tlv(samples[1].body, GeneralizedTime, "20240301123045Z");
+    samples[1].len += put_tlv(samples[1].body + samples[1].len, UTF8STRING, "hello from the benchmark");
+    samples[1].len += put_tlv(samples[1].body + samples[1].len, UTF8STRING, "Testing");
+
+    printf("%-8s %-12s %10s %10s\n", "message", "mode", "legacy ns", "codec ns");
+    for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+    {
+        for(int chained = 1; chained >= 0; chained--)
+        {
+            double legacy;
+            double codec;
+
+            legacy = best_of(legacy_decode, &samples[i], iterations, chained);
+            codec  = best_of(codec_decode, &samples[i], iterations, chained);
+            printf("%-8s %-12s %10.2f %10.2f\n", samples[i].name, chained ? "latency" : "throughput", legacy, codec);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/*
+ * UTF-8 validation of chat-sized values: the byte-at-a-time validator against the vector paths
+ * this CPU supports, on ASCII text and on text mixing 2, 3 and 4 byte sequences.
+ *
+ * Built as the bench_utf8 target listed in files.txt, or by hand:
+ *
+ *   gcc -std=c17 -O2 -D_GNU_SOURCE -Iinclude tests/bench_utf8.c src/utf8.c -o bench_utf8
+ *   ./bench_utf8 [iterations]
+ */
+#include "utf8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 5000000UL
+#define ROUNDS 5    // best of, to ride out scheduler noise
+#define MAX_VALUE 255    // a UTF8STRING value never exceeds one length byte
+
+typedef int (*validate_fn)(const uint8_t *str, size_t len);
+
+typedef struct impl_t
+{
+    const char *name;
+    validate_fn fn;
+} impl_t;
+
+static volatile int sink;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Repeats `pattern` into `buf`, whole characters only, up to `len` bytes. Returns the length used. */
+static size_t fill(uint8_t *buf, size_t len, const char *pattern)
+{
+    size_t plen;
+    size_t used;
+    size_t pos;
+
+    plen = strlen(pattern);
+    used = 0;
+    pos  = 0;
+    while(1)
+    {
+        uint8_t lead = (uint8_t)pattern[pos];
+        size_t  seq  = (lead < 0x80) ? 1 : (lead < 0xE0) ? 2 : (lead < 0xF0) ? 3 : 4;
+
+        if(used + seq > len)
+        {
+            return used;
+        }
+        memcpy(buf + used, pattern + pos, seq);
+        used += seq;
+        pos = (pos + seq) % plen;
+    }
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static double bench(validate_fn fn, const uint8_t *buf, size_t len, unsigned long iterations)
+{
+    struct timespec start;
+    struct timespec end;
+    double          best;
+
+    best = 0;
+    for(int round = 0; round < ROUNDS; round++)
+    {
+        int    valid;
+        double ns;
+
+        valid = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(unsigned long i = 0; i < iterations; i++)
+        {
+            valid &= fn(buf, len);
+            __asm__ volatile("" : : "g"(buf) : "memory");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        sink = valid;
+
+        if(!valid)
+        {
+            fprintf(stderr, "sample rejected\n");
+            exit(EXIT_FAILURE);
+        }
+
+        ns = elapsed_ns(&start, &end) / (double)iterations;
+        if(round == 0 || ns < best)
+        {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[]    = {16, 64, 128, MAX_VALUE};
+    static const char  *texts[][2] = {
+        {"ascii", "hello from the benchmark "                       },
+        {"mixed", "h\xC3\xA9llo \xE6\xBC\xA2\xE5\xAD\x97 \xF0\x9F\x98\x80 "},
+    };
+    impl_t        impls[4];
+    size_t        nimpls;
+    unsigned long iterations;
+    uint8_t       buf[MAX_VALUE];
+
+    iterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+
+    utf8_init();
+    nimpls                 = 0;
+    impls[nimpls].name     = "scalar";
+    impls[nimpls++].fn     = utf8_valid_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("ssse3"))
+    {
+        impls[nimpls].name = "ssse3";
+        impls[nimpls++].fn = utf8_valid_ssse3;
+    }
+    if(__builtin_cpu_supports("avx2"))
+    {
+        impls[nimpls].name = "avx2";
+        impls[nimpls++].fn = utf8_valid_avx2;
+    }
+#endif
+    impls[nimpls].name = utf8_impl_name();
+    impls[nimpls++].fn = utf8_valid;
+
+    printf("%-6s %5s", "text", "bytes");
+    for(size_t i = 0; i < nimpls; i++)
+    {
+        printf(" %9s%s", impls[i].name, (i == nimpls - 1) ? "*" : " ");
+    }
+    printf("   (ns per value, * = runtime choice)\n");
+
+    for(size_t t = 0; t < sizeof(texts) / sizeof(texts[0]); t++)
+    {
+        for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            size_t len;
+
+            len = fill(buf, sizes[s], texts[t][1]);
+            printf("%-6s %5zu", texts[t][0], len);
+            for(size_t i = 0; i < nimpls; i++)
+            {
+                printf(" %9.2f ", bench(impls[i].fn, buf, len, iterations));
+            }
+            printf("\n");
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
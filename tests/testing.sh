@@ -1,26 +1,54 @@
 #!/bin/bash
 
+# Connections stay open until logout, a protocol error or the idle timeout, so every case
+# half-closes its socket once its frames are sent: -N for OpenBSD netcat (use -q 1 with others).
+
 # account create
-echo -ne '\x0D\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc 127.0.0.1 8081  | hexdump -C
+echo -ne '\x0D\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc -N 127.0.0.1 8081  | hexdump -C
 
 # account login
-echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc 127.0.0.1 8081  | hexdump -C
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc -N 127.0.0.1 8081  | hexdump -C
 
 # account login wrong password
-echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x31' | nc 127.0.0.1 8081  | hexdump -C
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x31' | nc -N 127.0.0.1 8081  | hexdump -C
 
 # account logout
-echo -ne '\x0C\x02\x00\x01\x00\x00' | nc 127.0.0.1 8081 | hexdump -C
+echo -ne '\x0C\x02\x00\x01\x00\x00' | nc -N 127.0.0.1 8081 | hexdump -C
 
 # account create Tia
-echo -ne '\x0D\x02\x00\x00\x00\x12\x0C\x03\x54\x69\x61\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc 127.0.0.1 8081  | hexdump -C
+echo -ne '\x0D\x02\x00\x00\x00\x12\x0C\x03\x54\x69\x61\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc -N 127.0.0.1 8081  | hexdump -C
 
 # account login Tia
-echo -ne '\x0A\x02\x00\x00\x00\x12\x0C\x03\x54\x69\x61\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc 127.0.0.1 8081  | hexdump -C
+echo -ne '\x0A\x02\x00\x00\x00\x12\x0C\x03\x54\x69\x61\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc -N 127.0.0.1 8081  | hexdump -C
 
-# chat
-echo -ne '\x14\x02\x00\x01\x00\x1E\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc 127.0.0.1 8081  | hexdump -C
+# chat (sending needs a logged-in connection)
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33\x14\x02\x00\x01\x00\x1E\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc -N 127.0.0.1 8081  | hexdump -C
 
 # chat invalid
-echo -ne '\x15\x02\x00\x01\x00\x1E\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc 127.0.0.1 8081  | hexdump -C
+echo -ne '\x15\x02\x00\x01\x00\x1E\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc -N 127.0.0.1 8081  | hexdump -C
+
+
+# channel join, send twice, leave (a send after leaving is refused with 0x29)
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33\x28\x02\x00\x01\x00\x09\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x2A\x02\x00\x01\x00\x27\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x2A\x02\x00\x01\x00\x27\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x79\x6F\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x29\x02\x00\x01\x00\x09\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x2A\x02\x00\x01\x00\x27\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc -N 127.0.0.1 8081  | hexdump -C
+
+# direct message to Tia (user 4 on a fresh database) while online: it arrives on Tia's connection
+(echo -ne '\x0A\x02\x00\x00\x00\x12\x0C\x03\x54\x69\x61\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33'; sleep 2) | nc -N 127.0.0.1 8081  | hexdump -C &
+sleep 1
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33\x32\x02\x00\x01\x00\x22\x02\x02\x00\x04\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc -N 127.0.0.1 8081  | hexdump -C
+wait
+
+# direct message to Tia once offline: acked and kept for the next login
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33\x32\x02\x00\x01\x00\x25\x02\x02\x00\x04\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x05\x6C\x61\x74\x65\x72\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc -N 127.0.0.1 8081  | hexdump -C
+
+# Tia logging back in is sent what was kept
+echo -ne '\x0A\x02\x00\x00\x00\x12\x0C\x03\x54\x69\x61\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33' | nc -N 127.0.0.1 8081  | hexdump -C
+
+# history paging: one message a page; on a fresh history the two channel messages are 2 and 3,
+# so the second page asks from the first page's last sequence
+echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33\x3C\x02\x00\x01\x00\x12\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x02\x04\x00\x00\x00\x00\x02\x01\x01\x3C\x02\x00\x01\x00\x12\x0C\x07\x67\x65\x6E\x65\x72\x61\x6C\x02\x04\x00\x00\x00\x02\x02\x01\x01' | nc -N 127.0.0.1 8081  | hexdump -C
+
+# v3 envelope: login and chat in one frame, answered with one envelope
+echo -ne '\x02\x03\x00\x00\x00\x40\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33\x14\x02\x00\x01\x00\x1E\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67' | nc -N 127.0.0.1 8081  | hexdump -C
 
+# chat over the default rate of 10 a second with a burst of 50: the last replies are 0x21
+{ echo -ne '\x0A\x02\x00\x00\x00\x16\x0C\x07\x54\x65\x73\x74\x69\x6E\x67\x0C\x0B\x50\x61\x73\x73\x77\x6F\x72\x64\x31\x32\x33'; for i in $(seq 60); do echo -ne '\x14\x02\x00\x01\x00\x1E\x18\x0F\x32\x30\x32\x34\x30\x33\x30\x31\x31\x32\x33\x30\x34\x35\x5A\x0C\x02\x68\x69\x0C\x07\x54\x65\x73\x74\x69\x6E\x67'; done; } | nc -N 127.0.0.1 8081  | hexdump -C | tail -n 4